@@ -0,0 +1,435 @@
+/*
+ *  Binary AST files
+ *
+ *  `rvcc -emit-ast out.rast <program>` writes the typed AST produced by the
+ *  parser, and `rvcc in.rast` reads it back instead of tokenizing and
+ *  parsing, so that several back end configurations can share one front end
+ *  run.
+ *
+ *  The file is a header followed by one table of fixed size records for
+ *  each kind of object: functions, nodes, locals, types and tokens, then
+ *  the source text and the strings. Records refer to each other by their
+ *  index in the table (-1 for NULL) and to strings by their offset, so the
+ *  file does not depend on where it is loaded. Reading it maps the file,
+ *  allocates each table at once and turns the indices into pointers; the
+ *  strings and the source are used in place.
+ *
+ *  The parser gives every int local the shared TyInt, and the passes
+ *  compare types by address (cse.c), so the record of TyInt is marked in
+ *  the header and read back as TyInt itself.
+ */
+
+#include "rvcc.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define AST_MAGIC "RAST"
+// bumped whenever a record changes
+#define AST_VERSION 2
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  int32_t funcCnt, nodeCnt, objCnt, typeCnt, tokCnt;
+  int32_t srcLen; // of the source, with its terminator
+  int32_t strLen; // of the string table
+  int32_t tyInt;  // the record of TyInt, -1 if nothing has the type
+} Header;
+
+typedef struct {
+  int32_t next, name, params, body, locals, stackSize;
+} FuncRec;
+
+typedef struct {
+  int32_t nodeType, dataType, next, tok, left, right, body, val, var, funcName,
+      args, cond, then, els, init, inc;
+} NodeRec;
+
+typedef struct {
+  int32_t next, name, dataType, offSet, idx;
+} ObjRec;
+
+typedef struct {
+  int32_t kind, size, align, name, base, returnType, params, next;
+} TypeRec;
+
+typedef struct {
+  int32_t type, idx, val, len; // idx is the offset in the source
+} TokRec;
+
+// =================================================================
+// writing
+
+// the objects of a kind in the order of their records, with a hash table
+// from their address to their index
+typedef struct {
+  void **items;
+  int cnt;
+  int cap;
+  int *slots; // index + 1, 0 for an empty slot
+  int slotCap;
+} Table;
+
+static Table Funcs, Nodes, Objs, Types, Toks;
+
+static int *slotOf(Table *t, void *p) {
+  uint64_t h = (uintptr_t)p * 0x9e3779b97f4a7c15;
+  int i = (h >> 32) & (t->slotCap - 1);
+  while (t->slots[i] && t->items[t->slots[i] - 1] != p)
+    i = (i + 1) & (t->slotCap - 1);
+  return &t->slots[i];
+}
+
+static int lookup(Table *t, void *p) {
+  if (!p)
+    return -1;
+  return *slotOf(t, p) - 1;
+}
+
+// add p to the table, returns whether it is new
+static bool insert(Table *t, void *p) {
+  if (!p || (t->slotCap && *slotOf(t, p)))
+    return false;
+
+  if (t->cnt == t->cap) {
+    t->cap = t->cap ? t->cap * 2 : 64;
+    t->items = realloc(t->items, sizeof(void *) * t->cap);
+  }
+  // keep the hash table at most half full
+  if ((t->cnt + 1) * 2 > t->slotCap) {
+    free(t->slots);
+    t->slotCap = t->slotCap ? t->slotCap * 2 : 128;
+    t->slots = calloc(t->slotCap, sizeof(int));
+    for (int i = 0; i < t->cnt; i++)
+      *slotOf(t, t->items[i]) = i + 1;
+  }
+  t->items[t->cnt++] = p;
+  *slotOf(t, p) = t->cnt;
+  return true;
+}
+
+static void markType(Type *ty);
+
+static void markTok(Token *tok) { insert(&Toks, tok); }
+
+static void markType(Type *ty) {
+  if (!insert(&Types, ty))
+    return;
+  markTok(ty->name);
+  markType(ty->base);
+  markType(ty->returnType);
+  markType(ty->params);
+  markType(ty->next);
+}
+
+static void markObj(Obj *var) {
+  for (; var && insert(&Objs, var); var = var->next)
+    markType(var->dataType);
+}
+
+// in the order of a recursion over the children and then the next node,
+// with a stack of the nodes to visit instead: a chain like a+b+c+... is
+// as deep as it is long
+static void markNode(Node *node) {
+  Node **stack = malloc(sizeof(Node *));
+  int cnt = 0, cap = 1;
+  stack[cnt++] = node;
+  while (cnt) {
+    node = stack[--cnt];
+    if (!node || !insert(&Nodes, node))
+      continue;
+    markType(node->dataType);
+    markTok(node->tok);
+    markObj(node->var);
+
+    // pushed in reverse, the left operand is visited first
+    Node *next[] = {node->next, node->inc,  node->init, node->els,
+                    node->then, node->cond, node->args, node->body,
+                    node->right, node->left};
+    int n = sizeof(next) / sizeof(*next);
+    if (cnt + n > cap) {
+      cap = (cnt + n) * 2;
+      stack = realloc(stack, sizeof(Node *) * cap);
+    }
+    for (int i = 0; i < n; i++)
+      stack[cnt++] = next[i];
+  }
+  free(stack);
+}
+
+// the string table
+static FILE *Strs;
+static size_t StrLen;
+
+static int32_t addStr(char *s) {
+  if (!s)
+    return -1;
+  int32_t off = ftell(Strs);
+  fwrite(s, 1, strlen(s) + 1, Strs);
+  return off;
+}
+
+void writeAST(Function *prog, char *input, char *path) {
+  for (Function *fn = prog; fn; fn = fn->next) {
+    insert(&Funcs, fn);
+    markObj(fn->locals);
+    markObj(fn->params);
+    markNode(fn->body);
+  }
+
+  char *strs;
+  Strs = open_memstream(&strs, &StrLen);
+
+  FILE *out = fopen(path, "wb");
+  if (!out)
+    error("cannot open %s", path);
+
+  // the records go into memory first, the string table is not complete
+  // before all of them are written
+  char *recs;
+  size_t recLen;
+  FILE *buf = open_memstream(&recs, &recLen);
+
+  for (int i = 0; i < Funcs.cnt; i++) {
+    Function *fn = Funcs.items[i];
+    FuncRec rec = {
+        lookup(&Funcs, fn->next), addStr(fn->name), lookup(&Objs, fn->params),
+        lookup(&Nodes, fn->body), lookup(&Objs, fn->locals), fn->stackSize,
+    };
+    fwrite(&rec, sizeof(rec), 1, buf);
+  }
+  for (int i = 0; i < Nodes.cnt; i++) {
+    Node *node = Nodes.items[i];
+    NodeRec rec = {
+        node->nodeType,           lookup(&Types, node->dataType),
+        lookup(&Nodes, node->next), lookup(&Toks, node->tok),
+        lookup(&Nodes, node->left), lookup(&Nodes, node->right),
+        lookup(&Nodes, node->body), node->val,
+        lookup(&Objs, node->var),   addStr(node->funcName),
+        lookup(&Nodes, node->args), lookup(&Nodes, node->cond),
+        lookup(&Nodes, node->then), lookup(&Nodes, node->els),
+        lookup(&Nodes, node->init), lookup(&Nodes, node->inc),
+    };
+    fwrite(&rec, sizeof(rec), 1, buf);
+  }
+  for (int i = 0; i < Objs.cnt; i++) {
+    Obj *var = Objs.items[i];
+    ObjRec rec = {
+        lookup(&Objs, var->next), addStr(var->name),
+        lookup(&Types, var->dataType), var->offSet, var->idx,
+    };
+    fwrite(&rec, sizeof(rec), 1, buf);
+  }
+  for (int i = 0; i < Types.cnt; i++) {
+    Type *ty = Types.items[i];
+    TypeRec rec = {
+        ty->kind,
+        ty->size,
+        ty->align,
+        lookup(&Toks, ty->name),
+        lookup(&Types, ty->base),
+        lookup(&Types, ty->returnType),
+        lookup(&Types, ty->params),
+        lookup(&Types, ty->next),
+    };
+    fwrite(&rec, sizeof(rec), 1, buf);
+  }
+  for (int i = 0; i < Toks.cnt; i++) {
+    Token *tok = Toks.items[i];
+    TokRec rec = {tok->type, tok->idx - input, tok->val, tok->len};
+    fwrite(&rec, sizeof(rec), 1, buf);
+  }
+  fclose(buf);
+  fclose(Strs);
+
+  Header h = {AST_MAGIC, AST_VERSION,       Funcs.cnt, Nodes.cnt,
+              Objs.cnt,  Types.cnt,         Toks.cnt,  strlen(input) + 1,
+              StrLen,    lookup(&Types, TyInt)};
+  fwrite(&h, sizeof(h), 1, out);
+  fwrite(recs, 1, recLen, out);
+  fwrite(input, 1, h.srcLen, out);
+  fwrite(strs, 1, StrLen, out);
+  if (fclose(out))
+    error("cannot write %s", path);
+  free(recs);
+  free(strs);
+}
+
+// =================================================================
+// reading
+
+static char *Path;
+static Header *Head;
+static char *Src;
+static char *Str;
+
+static Function *FuncArr;
+static Node *NodeArr;
+static Obj *ObjArr;
+static Type *TypeArr;
+static Token *TokArr;
+
+static void corrupt() { error("%s: invalid AST file", Path); }
+
+// the object at index i of the table of n objects
+static void *at(void *arr, int32_t i, int32_t n, size_t size) {
+  if (i == -1)
+    return NULL;
+  if (i < 0 || i >= n)
+    corrupt();
+  return (char *)arr + i * size;
+}
+
+#define FUNC(i) ((Function *)at(FuncArr, i, Head->funcCnt, sizeof(Function)))
+#define NODE(i) ((Node *)at(NodeArr, i, Head->nodeCnt, sizeof(Node)))
+#define OBJ(i) ((Obj *)at(ObjArr, i, Head->objCnt, sizeof(Obj)))
+#define TYPE(i)                                                                \
+  ((i) == Head->tyInt ? TyInt                                                  \
+                      : (Type *)at(TypeArr, i, Head->typeCnt, sizeof(Type)))
+#define TOK(i) ((Token *)at(TokArr, i, Head->tokCnt, sizeof(Token)))
+
+static char *str(int32_t off) {
+  if (off == -1)
+    return NULL;
+  if (off < 0 || off >= Head->strLen)
+    corrupt();
+  return Str + off;
+}
+
+bool isASTFile(char *path) {
+  int len = strlen(path);
+  return len > 5 && !strcmp(path + len - 5, ".rast");
+}
+
+Function *readAST(char *path) {
+  Path = path;
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st))
+    error("cannot open %s", path);
+  if (st.st_size < sizeof(Header))
+    corrupt();
+  // the map stays for as long as the compiler runs, the strings are in it
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    error("cannot map %s", path);
+  close(fd);
+
+  Head = (Header *)map;
+  if (memcmp(Head->magic, AST_MAGIC, 4))
+    corrupt();
+  if (Head->version != AST_VERSION)
+    error("%s: AST version %u, expected %d", path, Head->version,
+          AST_VERSION);
+  if (Head->funcCnt < 0 || Head->nodeCnt < 0 || Head->objCnt < 0 ||
+      Head->typeCnt < 0 || Head->tokCnt < 0 || Head->srcLen < 1 ||
+      Head->strLen < 0 || Head->tyInt < -1 || Head->tyInt >= Head->typeCnt)
+    corrupt();
+
+  int64_t size = sizeof(Header) + (int64_t)Head->funcCnt * sizeof(FuncRec) +
+                 (int64_t)Head->nodeCnt * sizeof(NodeRec) +
+                 (int64_t)Head->objCnt * sizeof(ObjRec) +
+                 (int64_t)Head->typeCnt * sizeof(TypeRec) +
+                 (int64_t)Head->tokCnt * sizeof(TokRec) + Head->srcLen +
+                 Head->strLen;
+  if (size != st.st_size)
+    corrupt();
+
+  FuncRec *funcs = (FuncRec *)(Head + 1);
+  NodeRec *nodes = (NodeRec *)(funcs + Head->funcCnt);
+  ObjRec *objs = (ObjRec *)(nodes + Head->nodeCnt);
+  TypeRec *types = (TypeRec *)(objs + Head->objCnt);
+  TokRec *toks = (TokRec *)(types + Head->typeCnt);
+  Src = (char *)(toks + Head->tokCnt);
+  Str = Src + Head->srcLen;
+  if (Src[Head->srcLen - 1] ||
+      (Head->strLen && Str[Head->strLen - 1]))
+    corrupt();
+  setCurrentInput(Src);
+
+  FuncArr = calloc(Head->funcCnt, sizeof(Function));
+  NodeArr = calloc(Head->nodeCnt, sizeof(Node));
+  ObjArr = calloc(Head->objCnt, sizeof(Obj));
+  TypeArr = calloc(Head->typeCnt, sizeof(Type));
+  TokArr = calloc(Head->tokCnt, sizeof(Token));
+
+  for (int i = 0; i < Head->funcCnt; i++) {
+    FuncRec *r = &funcs[i];
+    FuncArr[i] = (Function){
+        .next = FUNC(r->next),
+        .name = str(r->name),
+        .params = OBJ(r->params),
+        .body = NODE(r->body),
+        .locals = OBJ(r->locals),
+        .stackSize = r->stackSize,
+    };
+  }
+  for (int i = 0; i < Head->nodeCnt; i++) {
+    NodeRec *r = &nodes[i];
+    // the switches of the passes take any other value as a bug
+    if (r->nodeType <= ND_INVALID || r->nodeType > ND_INLINE)
+      corrupt();
+    NodeArr[i] = (Node){
+        .nodeType = r->nodeType,
+        .dataType = TYPE(r->dataType),
+        .next = NODE(r->next),
+        .tok = TOK(r->tok),
+        .left = NODE(r->left),
+        .right = NODE(r->right),
+        .body = NODE(r->body),
+        .val = r->val,
+        .var = OBJ(r->var),
+        .funcName = str(r->funcName),
+        .args = NODE(r->args),
+        .cond = NODE(r->cond),
+        .then = NODE(r->then),
+        .els = NODE(r->els),
+        .init = NODE(r->init),
+        .inc = NODE(r->inc),
+    };
+  }
+  for (int i = 0; i < Head->objCnt; i++) {
+    ObjRec *r = &objs[i];
+    ObjArr[i] = (Obj){
+        .next = OBJ(r->next),
+        .name = str(r->name),
+        .dataType = TYPE(r->dataType),
+        .offSet = r->offSet,
+        .idx = r->idx,
+    };
+  }
+  for (int i = 0; i < Head->typeCnt; i++) {
+    TypeRec *r = &types[i];
+    if (r->kind < TY_INT || r->kind > TY_FUNCTION ||
+        (i == Head->tyInt && (r->kind != TY_INT || r->size != TyInt->size)))
+      corrupt();
+    TypeArr[i] = (Type){
+        .kind = r->kind,
+        .size = r->size,
+        .align = r->align,
+        .name = TOK(r->name),
+        .base = TYPE(r->base),
+        .returnType = TYPE(r->returnType),
+        .params = TYPE(r->params),
+        .next = TYPE(r->next),
+    };
+  }
+  for (int i = 0; i < Head->tokCnt; i++) {
+    TokRec *r = &toks[i];
+    if (r->idx < 0 || r->len < 0 || r->idx + r->len >= Head->srcLen ||
+        r->type < TK_INVALID || r->type > TK_EOF)
+      corrupt();
+    TokArr[i] = (Token){
+        .type = r->type,
+        .idx = Src + r->idx,
+        .val = r->val,
+        .len = r->len,
+    };
+  }
+
+  // the functions are written in the order of the program
+  return Head->funcCnt ? &FuncArr[0] : NULL;
+}
@@ -0,0 +1,58 @@
+#!/bin/bash
+
+# 用rvsim运行bench/下的每个程序, 将周期数与bench/baseline中的记录比较,
+# 任何一项变慢或结果改变都会失败. 生成的代码变快后用UPDATE=1重写baseline
+RVSIM=rvsim/rvsim
+BASELINE=bench/baseline
+LEVELS="-O0 -O1 -O2"
+
+# 每行: 程序 优化等级 返回值 周期数 指令数
+result=$(mktemp)
+trap 'rm -f "$result" tmp.s' EXIT
+
+for file in bench/*.c; do
+    name=$(basename "$file" .c)
+    for level in $LEVELS; do
+        ./rvcc $level "$(cat "$file")" > tmp.s || exit
+        stats=$($RVSIM -stats $RVSIM_FLAGS tmp.s 2>&1)
+        exit=$(echo "$stats" | awk '$1 == "exit" {print $2}')
+        cycles=$(echo "$stats" | awk '$1 == "cycles" {print $2}')
+        insts=$(echo "$stats" | awk '$1 == "insts" {print $2}')
+        if [ -z "$cycles" ]; then
+            echo "$name $level: $stats"
+            exit 1
+        fi
+        echo "$name $level $exit $cycles $insts" >> "$result"
+    done
+done
+
+if [ -n "$UPDATE" ]; then
+    cp "$result" $BASELINE
+    cat $BASELINE
+    exit 0
+fi
+
+# 逐项对比, 没有记录的新程序只打印
+failed=0
+while read -r name level exit cycles insts; do
+    old=$(awk -v n="$name" -v l="$level" '$1 == n && $2 == l' $BASELINE)
+    if [ -z "$old" ]; then
+        echo "$name $level: $cycles cycles (new)"
+        continue
+    fi
+    read -r _ _ oldExit oldCycles oldInsts <<< "$old"
+    if [ "$exit" != "$oldExit" ]; then
+        echo "$name $level: returned $exit, expected $oldExit"
+        failed=1
+    elif [ "$cycles" -gt "$oldCycles" ]; then
+        echo "$name $level: $oldCycles => $cycles cycles, slower"
+        failed=1
+    else
+        echo "$name $level: $oldCycles => $cycles cycles"
+    fi
+done < "$result"
+
+if [ "$failed" = 1 ]; then
+    exit 1
+fi
+echo OK
@@ -0,0 +1,7 @@
+int main() {
+  int s = 0;
+  int i;
+  for (i = 0; i < 500; i = i + 1)
+    s = s + add10(i, 1, 2, 3, 4, 5, 6, 7, 8, 9) - add6(1, 2, 3, 4, 5, i);
+  return s;
+}
@@ -0,0 +1,17 @@
+int digitSum(int n) {
+  int s = 0;
+  while (n != 0) {
+    int q = n / 10;
+    s = s + n - q * 10;
+    n = q;
+  }
+  return s;
+}
+
+int main() {
+  int s = 0;
+  int i;
+  for (i = 0; i < 3000; i = i + 1)
+    s = s + digitSum(i * 7919) - digitSum(i / 3);
+  return s;
+}
@@ -0,0 +1,7 @@
+int fib(int n) {
+  if (n <= 1)
+    return n;
+  return fib(n - 1) + fib(n - 2);
+}
+
+int main() { return fib(20); }
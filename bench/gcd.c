@@ -0,0 +1,20 @@
+int mod(int a, int b) { return a - a / b * b; }
+
+int gcd(int a, int b) {
+  while (b != 0) {
+    int t = mod(a, b);
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+int main() {
+  int s = 0;
+  int i;
+  int j;
+  for (i = 1; i < 60; i = i + 1)
+    for (j = 1; j < 60; j = j + 1)
+      s = s + gcd(i, j);
+  return s;
+}
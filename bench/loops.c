@@ -0,0 +1,15 @@
+int main() {
+  int s = 0;
+  int n = 30;
+  int i;
+  int j;
+  for (i = 0; i < n; i = i + 1)
+    for (j = 0; j < n; j = j + 1) {
+      int k = n * 2 + 1;
+      if (i < j)
+        s = s + i * k + j;
+      else
+        s = s - j;
+    }
+  return s;
+}
@@ -0,0 +1,15 @@
+int swap(int *a, int *b) {
+  int t = *a;
+  *a = *b;
+  *b = t;
+  return 0;
+}
+
+int main() {
+  int x = 1;
+  int y = 2;
+  int i;
+  for (i = 0; i < 1000; i = i + 1)
+    swap(&x, &y);
+  return x * 10 + y;
+}
@@ -0,0 +1,373 @@
+/*
+ *  Incremental compilation cache
+ *
+ *  With -fcache-dir=<dir>, the assembly of every function is kept in a file
+ *  of <dir> named after a hash of the tokens of the function, the options
+ *  its code depends on and the compiler itself. When the program is
+ *  compiled again, a function whose tokens have not changed is neither
+ *  parsed nor generated: its code is copied from the file.
+ *
+ *  At -O2 calls may be inlined, so the key of a function also covers the
+ *  functions it calls, directly or not, and these are parsed whenever one
+ *  of their callers is compiled. Labels are numbered within each function
+ *  (see codegen.c), so the code of a function does not depend on the ones
+ *  before it.
+ *
+ *  The files are kept in least recently used order by their modification
+ *  time: a hit touches the file, and when the files take more than
+ *  -fcache-limit=<n> bytes once the program is compiled, the oldest ones
+ *  are removed. The directory is read once per compilation, not once per
+ *  stored function.
+ */
+
+#include "rvcc.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// directory of the cache, set by -fcache-dir=<dir>
+char *CacheDir;
+// the files of the cache take at most this many bytes
+long CacheLimit = 64 << 20;
+
+static int HitCnt;
+static int MissCnt;
+static int EvictCnt;
+// entries written by this compilation
+static int StoreCnt;
+
+// a function definition, as it is in the token stream
+typedef struct {
+  Token *start; // first token of the definition
+  Token *end;   // the closing brace of the body
+  char *name;
+  uint64_t hash; // of the tokens
+  uint64_t key;  // of the tokens, the options and the inlined callees
+  char *text;    // the cached code, NULL on a miss
+  bool parse;    // compiled, or inlined into a function which is compiled
+} Def;
+
+static Def *Defs;
+static int DefCnt;
+
+// =================================================================
+// keys
+
+// FNV-1a, continuing from h
+static uint64_t hashBytes(uint64_t h, const void *data, size_t len) {
+  const uint8_t *p = data;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ p[i]) * 0x100000001b3;
+  return h;
+}
+
+static uint64_t hashStr(uint64_t h, char *str) {
+  // the terminator separates the strings
+  return hashBytes(h, str, strlen(str) + 1);
+}
+
+// the options which change the code, and the compiler: like a rebuilt
+// compiler, another build leaves the entries of the old one behind
+static uint64_t hashOptions() {
+  char buf[128];
+  snprintf(buf, sizeof(buf),
+           "O%d inline=%d unroll=%d,%d instrument=%d rvc=%d rvv=%d zba=%d "
+           "zbb=%d",
+           OptLevel, InlineLimit, UnrollLoops, UnrollLimit,
+           InstrumentFunctions, IsaC, IsaV, IsaZba, IsaZbb);
+  uint64_t h = hashStr(0xcbf29ce484222325, buf);
+
+  // the code follows the profile
+  FILE *in = ProfileUse ? fopen(ProfileUse, "r") : NULL;
+  if (in) {
+    char line[4096];
+    for (size_t n; (n = fread(line, 1, sizeof(line), in));)
+      h = hashBytes(h, line, n);
+    fclose(in);
+  }
+
+  struct stat st;
+  if (stat("/proc/self/exe", &st) == 0) {
+    h = hashBytes(h, &st.st_size, sizeof(st.st_size));
+    h = hashBytes(h, &st.st_mtim, sizeof(st.st_mtim));
+  }
+  return h;
+}
+
+static uint64_t hashTokens(Token *start, Token *end) {
+  uint64_t h = 0xcbf29ce484222325;
+  for (Token *tok = start;; tok = tok->next) {
+    h = hashBytes(h, &tok->len, sizeof(tok->len));
+    h = hashBytes(h, tok->idx, tok->len);
+    if (tok == end)
+      return h;
+  }
+}
+
+static Def *findDef(Token *tok) {
+  for (int i = 0; i < DefCnt; i++)
+    if (strlen(Defs[i].name) == tok->len &&
+        !strncmp(Defs[i].name, tok->idx, tok->len))
+      return &Defs[i];
+  return NULL;
+}
+
+// mark the functions def calls, directly or not
+static void markCallees(Def *def, bool *callees) {
+  for (Token *tok = def->start; tok != def->end; tok = tok->next) {
+    if (tok->type != TK_IDENT || !tokenCompare(tok->next, "("))
+      continue;
+    Def *callee = findDef(tok);
+    if (callee && !callees[callee - Defs]) {
+      callees[callee - Defs] = true;
+      markCallees(callee, callees);
+    }
+  }
+}
+
+// =================================================================
+// splitting the program
+
+// find the definitions in the token stream, without parsing them. Returns
+// false if they do not look like definitions, the parser reports the error.
+static bool splitDefs(Token *tok) {
+  int cap = 0;
+  while (tok->type != TK_EOF) {
+    Def def = {.start = tok};
+    // declspec declarator, up to the body
+    for (; !tokenCompare(tok, "{"); tok = tok->next) {
+      if (tok->type == TK_EOF)
+        return false;
+      if (!def.name && tok->type == TK_IDENT)
+        def.name = strndup(tok->idx, tok->len);
+    }
+    if (!def.name)
+      return false;
+
+    for (int depth = 0;; tok = tok->next) {
+      if (tok->type == TK_EOF)
+        return false;
+      if (tokenCompare(tok, "{"))
+        depth++;
+      if (tokenCompare(tok, "}") && --depth == 0)
+        break;
+    }
+    def.end = tok;
+    tok = tok->next;
+
+    if (DefCnt == cap) {
+      cap = cap ? cap * 2 : 16;
+      Defs = realloc(Defs, sizeof(Def) * cap);
+    }
+    Defs[DefCnt++] = def;
+  }
+  return true;
+}
+
+// =================================================================
+// files
+
+static char *entryPath(uint64_t key) {
+  char *path;
+  size_t size;
+  FILE *out = open_memstream(&path, &size);
+  fprintf(out, "%s/%016llx.s", CacheDir, (unsigned long long)key);
+  fclose(out);
+  return path;
+}
+
+static char *lookup(uint64_t key) {
+  char *path = entryPath(key);
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    free(path);
+    return NULL;
+  }
+
+  char *text;
+  size_t size;
+  FILE *out = open_memstream(&text, &size);
+  char buf[4096];
+  for (size_t n; (n = fread(buf, 1, sizeof(buf), in));)
+    fwrite(buf, 1, n, out);
+  fclose(out);
+  fclose(in);
+
+  // the entry is the most recently used one now
+  utimensat(AT_FDCWD, path, NULL, 0);
+  free(path);
+  return text;
+}
+
+typedef struct {
+  char *path;
+  off_t size;
+  struct timespec mtime;
+} Entry;
+
+static int olderFirst(const void *a, const void *b) {
+  const struct timespec *x = &((Entry *)a)->mtime;
+  const struct timespec *y = &((Entry *)b)->mtime;
+  if (x->tv_sec != y->tv_sec)
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+void evictCache() {
+  // only the entries written now can have taken the cache past the limit
+  if (!StoreCnt)
+    return;
+  DIR *dir = opendir(CacheDir);
+  if (!dir)
+    return;
+
+  Entry *entries = NULL;
+  int cnt = 0, cap = 0;
+  long total = 0;
+  for (struct dirent *d; (d = readdir(dir));) {
+    int len = strlen(d->d_name);
+    if (len < 2 || strcmp(d->d_name + len - 2, ".s"))
+      continue;
+
+    char *path;
+    size_t size;
+    FILE *out = open_memstream(&path, &size);
+    fprintf(out, "%s/%s", CacheDir, d->d_name);
+    fclose(out);
+    struct stat st;
+    if (stat(path, &st)) {
+      free(path);
+      continue;
+    }
+
+    if (cnt == cap) {
+      cap = cap ? cap * 2 : 64;
+      entries = realloc(entries, sizeof(Entry) * cap);
+    }
+    entries[cnt++] = (Entry){path, st.st_size, st.st_mtim};
+    total += st.st_size;
+  }
+  closedir(dir);
+
+  qsort(entries, cnt, sizeof(Entry), olderFirst);
+  for (int i = 0; i < cnt && total > CacheLimit; i++) {
+    if (unlink(entries[i].path) == 0) {
+      total -= entries[i].size;
+      EvictCnt++;
+    }
+  }
+
+  for (int i = 0; i < cnt; i++)
+    free(entries[i].path);
+  free(entries);
+}
+
+void cacheStore(Function *fn, char *text) {
+  if (mkdir(CacheDir, 0777) && errno != EEXIST)
+    return;
+
+  // write to a file of our own first, so that a compiler running at the
+  // same time never reads half of an entry
+  char *path = entryPath(fn->cacheKey);
+  char *tmp;
+  size_t size;
+  FILE *out = open_memstream(&tmp, &size);
+  fprintf(out, "%s.%d.tmp", path, (int)getpid());
+  fclose(out);
+
+  FILE *file = fopen(tmp, "w");
+  if (file) {
+    bool ok = fputs(text, file) >= 0;
+    if (fclose(file) == 0 && ok && rename(tmp, path) == 0)
+      StoreCnt++;
+    else
+      unlink(tmp);
+  }
+  free(tmp);
+  free(path);
+}
+
+// =================================================================
+
+// parse the definition alone, by ending the token stream after it
+static Function *parseDef(Def *def) {
+  Token *next = def->end->next;
+  Token eof = {.type = TK_EOF, .idx = next->idx};
+  def->end->next = &eof;
+  Function *fn = parse(def->start);
+  def->end->next = next;
+  return fn;
+}
+
+Function *parseCached(Token *tok) {
+  if (!splitDefs(tok))
+    return parse(tok);
+
+  uint64_t options = hashOptions();
+  for (int i = 0; i < DefCnt; i++)
+    Defs[i].hash = hashTokens(Defs[i].start, Defs[i].end);
+
+  bool *callees = calloc(DefCnt, sizeof(bool));
+  for (int i = 0; i < DefCnt; i++) {
+    Def *def = &Defs[i];
+    def->key = hashBytes(options, &def->hash, sizeof(def->hash));
+    if (OptLevel < 2)
+      continue;
+    memset(callees, 0, DefCnt * sizeof(bool));
+    markCallees(def, callees);
+    for (int j = 0; j < DefCnt; j++)
+      if (callees[j])
+        def->key = hashBytes(def->key, &Defs[j].hash, sizeof(uint64_t));
+  }
+
+  // a function is parsed when it is compiled, or may be inlined into one
+  // which is compiled
+  for (int i = 0; i < DefCnt; i++) {
+    Def *def = &Defs[i];
+    def->text = lookup(def->key);
+    if (def->text) {
+      HitCnt++;
+      continue;
+    }
+    MissCnt++;
+    def->parse = true;
+    if (OptLevel < 2)
+      continue;
+    memset(callees, 0, DefCnt * sizeof(bool));
+    markCallees(def, callees);
+    for (int j = 0; j < DefCnt; j++)
+      if (callees[j])
+        Defs[j].parse = true;
+  }
+  free(callees);
+
+  Function head = {};
+  Function *cur = &head;
+  for (int i = 0; i < DefCnt; i++) {
+    Def *def = &Defs[i];
+    Function *fn;
+    if (def->parse) {
+      fn = parseDef(def);
+    } else {
+      // only the cached code is needed, the body is left empty
+      fn = calloc(1, sizeof(Function));
+      fn->name = def->name;
+      fn->body = calloc(1, sizeof(Node));
+      fn->body->nodeType = ND_BLOCK;
+      fn->body->tok = def->start;
+    }
+    fn->cachedAsm = def->text;
+    if (!def->text)
+      fn->cacheKey = def->key;
+    cur = cur->next = fn;
+  }
+  return head.next;
+}
+
+void reportCache() {
+  fprintf(stderr, "cache: %d hits, %d misses, %d evicted\n", HitCnt,
+          MissCnt, EvictCnt);
+}
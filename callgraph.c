@@ -0,0 +1,256 @@
+/*
+ *  Call graph and whole program optimization
+ *
+ *  The edges of the call graph are the ND_FUNCALL nodes of each function,
+ *  found by funcName among the functions of the program. A call to a
+ *  function defined in another object file has no edge.
+ *
+ *  With -fwhole-program the input is the whole program: nothing but main is
+ *  called from outside of it. Then
+ *
+ *  - functions main does not reach are dropped;
+ *  - from -O1, a parameter which gets the same constant at every call is
+ *    assigned that constant at the start of the body, and propagate.c folds
+ *    it into the uses. All the callers are known, so the function is
+ *    specialized in place: a clone would leave the original to no one.
+ */
+
+#include "rvcc.h"
+
+// drop unreachable functions and specialize parameters, set by
+// -fwhole-program
+bool WholeProgram;
+
+typedef struct CallNode {
+  Function *fn;
+  struct CallNode **callees; // with repeats, one for each call
+  int calleeCnt;
+  Node **calls; // the calls of the function, from the other functions too
+  int callCnt;
+  bool reached; // from main
+} CallNode;
+
+static CallNode *Graph;
+static int GraphSize;
+
+static int RemovedCnt;
+static int SpecializedCnt;
+
+static CallNode *findNode(char *name) {
+  for (int i = 0; i < GraphSize; i++)
+    if (!strcmp(Graph[i].fn->name, name))
+      return &Graph[i];
+  return NULL;
+}
+
+static void addCall(CallNode *caller, Node *call) {
+  CallNode *callee = findNode(call->funcName);
+  if (!callee)
+    return;
+  caller->callees = realloc(caller->callees,
+                            sizeof(CallNode *) * (caller->calleeCnt + 1));
+  caller->callees[caller->calleeCnt++] = callee;
+  callee->calls =
+      realloc(callee->calls, sizeof(Node *) * (callee->callCnt + 1));
+  callee->calls[callee->callCnt++] = call;
+}
+
+// the calls under node, including the ones of inlined bodies
+static void collectCalls(CallNode *caller, Node *node) {
+  // down the left operands in a loop (see node.c)
+  Node **chain;
+  int cnt = leftChain(node, NULL, &chain);
+  for (int i = 0; i < cnt; i++) {
+    node = chain[i];
+    if (node->nodeType == ND_FUNCALL)
+      addCall(caller, node);
+    collectCalls(caller, node->right);
+    collectCalls(caller, node->cond);
+    collectCalls(caller, node->then);
+    collectCalls(caller, node->els);
+    collectCalls(caller, node->init);
+    collectCalls(caller, node->inc);
+    for (Node *n = node->body; n; n = n->next)
+      collectCalls(caller, n);
+    for (Node *n = node->args; n; n = n->next)
+      collectCalls(caller, n);
+  }
+  free(chain);
+}
+
+static void buildGraph(Function *prog) {
+  GraphSize = 0;
+  for (Function *fn = prog; fn; fn = fn->next)
+    GraphSize++;
+  Graph = calloc(GraphSize, sizeof(CallNode));
+  int i = 0;
+  for (Function *fn = prog; fn; fn = fn->next)
+    Graph[i++].fn = fn;
+  for (i = 0; i < GraphSize; i++)
+    collectCalls(&Graph[i], Graph[i].fn->body);
+}
+
+static void freeGraph() {
+  for (int i = 0; i < GraphSize; i++) {
+    free(Graph[i].callees);
+    free(Graph[i].calls);
+  }
+  free(Graph);
+  Graph = NULL;
+  GraphSize = 0;
+}
+
+static void reach(CallNode *node) {
+  // a worklist, recursion would take as much stack as the longest chain of
+  // calls
+  CallNode **work = malloc(sizeof(CallNode *) * GraphSize);
+  int cnt = 0;
+  node->reached = true;
+  work[cnt++] = node;
+  while (cnt) {
+    node = work[--cnt];
+    for (int i = 0; i < node->calleeCnt; i++) {
+      CallNode *callee = node->callees[i];
+      if (!callee->reached) {
+        callee->reached = true;
+        work[cnt++] = callee;
+      }
+    }
+  }
+  free(work);
+}
+
+// the functions main reaches, all of them if there is no main
+static Function *removeUnreachable(Function *prog) {
+  CallNode *entry = findNode("main");
+  if (!entry)
+    return prog;
+  reach(entry);
+
+  Function head = {};
+  Function *cur = &head;
+  for (int i = 0; i < GraphSize; i++) {
+    if (!Graph[i].reached) {
+      RemovedCnt++;
+      continue;
+    }
+    cur = cur->next = Graph[i].fn;
+  }
+  cur->next = NULL;
+  return head.next;
+}
+
+static Node *newCallNode(NodeType type, Token *tok, Type *ty) {
+  Node *node = calloc(1, sizeof(Node));
+  node->nodeType = type;
+  node->tok = tok;
+  node->dataType = ty;
+  return node;
+}
+
+// whether the tree assigns to var
+static bool assigns(Node *node, Obj *var) {
+  for (; node; node = node->left) {
+    if (node->nodeType == ND_ASSIGN && node->left->nodeType == ND_VAR &&
+        node->left->var == var)
+      return true;
+    if (assigns(node->right, var) || assigns(node->cond, var) ||
+        assigns(node->then, var) || assigns(node->els, var) ||
+        assigns(node->init, var) || assigns(node->inc, var))
+      return true;
+    for (Node *n = node->body; n; n = n->next)
+      if (assigns(n, var))
+        return true;
+    for (Node *n = node->args; n; n = n->next)
+      if (assigns(n, var))
+        return true;
+  }
+  return false;
+}
+
+// the constant every call passes for param, the idx-th parameter. A
+// recursive call may pass param on as it is, if the body never changes it.
+static bool constantArg(CallNode *node, Obj *param, int idx, int *val) {
+  bool changed = takesAddrOf(node->fn->body, param) ||
+                 assigns(node->fn->body, param);
+  bool found = false;
+  for (int i = 0; i < node->callCnt; i++) {
+    Node *arg = node->calls[i]->args;
+    for (int j = 0; j < idx && arg; j++)
+      arg = arg->next;
+    if (!changed && arg->nodeType == ND_VAR && arg->var == param)
+      continue;
+    if (arg->nodeType != ND_NUM || (found && arg->val != *val))
+      return false;
+    *val = arg->val;
+    found = true;
+  }
+  return found;
+}
+
+// param = val at the start of the body
+static void bindParam(Function *fn, Obj *param, int val) {
+  Token *tok = fn->body->tok;
+  Node *var = newCallNode(ND_VAR, tok, param->dataType);
+  var->var = param;
+  Node *num = newCallNode(ND_NUM, tok, param->dataType);
+  num->val = val;
+  Node *assign = newCallNode(ND_ASSIGN, tok, param->dataType);
+  assign->left = var;
+  assign->right = num;
+
+  Node *stmt = newCallNode(ND_EXPR_STMT, tok, NULL);
+  stmt->left = assign;
+  stmt->next = fn->body->body;
+  fn->body->body = stmt;
+  SpecializedCnt++;
+}
+
+static void specializeParams(CallNode *node) {
+  // main is called from outside, and a function nothing calls has no
+  // constants to take
+  if (!strcmp(node->fn->name, "main") || !node->callCnt)
+    return;
+
+  int nparams = 0;
+  for (Obj *param = node->fn->params; param; param = param->next)
+    nparams++;
+  for (int i = 0; i < node->callCnt; i++) {
+    int nargs = 0;
+    for (Node *arg = node->calls[i]->args; arg; arg = arg->next)
+      nargs++;
+    if (nargs != nparams)
+      return;
+  }
+
+  int idx = 0;
+  for (Obj *param = node->fn->params; param; param = param->next, idx++) {
+    int val;
+    if (param->dataType->kind == TY_INT &&
+        constantArg(node, param, idx, &val))
+      bindParam(node->fn, param, val);
+  }
+}
+
+Function *optimizeCalls(Function *prog) {
+  if (!WholeProgram)
+    return prog;
+
+  buildGraph(prog);
+  prog = removeUnreachable(prog);
+  freeGraph();
+
+  // the calls of the dropped functions do not count
+  if (OptLevel >= 1) {
+    buildGraph(prog);
+    for (int i = 0; i < GraphSize; i++)
+      specializeParams(&Graph[i]);
+    freeGraph();
+  }
+  return prog;
+}
+
+void reportCalls() {
+  fprintf(stderr, "calls: %d functions removed, %d parameters specialized\n",
+          RemovedCnt, SpecializedCnt);
+}
@@ -0,0 +1,420 @@
+/*
+ *  Control flow graph
+ *
+ *  The statements of a function are split into basic blocks. A block holds
+ *  items, the expressions codegen evaluates one after another: expression
+ *  statements, returns, conditions and increments of loops. An if ends its
+ *  block with two successors, a loop gets a head block with the condition,
+ *  and a return goes to the exit block, so whatever follows it starts a
+ *  block without predecessors.
+ *
+ *  An inlined call is an expression, its body is not split into blocks:
+ *  the locals it reads count as read, and only the assignments before its
+ *  first branch count as writes.
+ *
+ *  On top of the graph, liveness and reaching definitions are computed for
+ *  the locals, unless the function takes the address of one of them: a
+ *  pointer may then reach any local.
+ */
+
+#include "rvcc.h"
+
+static int setWords(int n) { return (n + 63) / 64; }
+
+BitSet newBitSet(int n) { return calloc(setWords(n) + 1, sizeof(uint64_t)); }
+
+bool inBitSet(BitSet set, int i) { return set[i / 64] >> (i % 64) & 1; }
+
+void addBitSet(BitSet set, int i) { set[i / 64] |= (uint64_t)1 << (i % 64); }
+
+static void copyBitSet(BitSet to, BitSet from, int n) {
+  memcpy(to, from, setWords(n) * sizeof(uint64_t));
+}
+
+// to |= from, returns whether to has changed
+static bool unionBitSet(BitSet to, BitSet from, int n) {
+  bool changed = false;
+  for (int i = 0; i < setWords(n); i++) {
+    uint64_t v = to[i] | from[i];
+    changed |= v != to[i];
+    to[i] = v;
+  }
+  return changed;
+}
+
+// =================================================================
+// building the graph
+
+static CFG *Cfg;
+// the block the next item goes to
+static BasicBlock *Cur;
+
+static BasicBlock *newBlock() {
+  BasicBlock *bb = calloc(1, sizeof(BasicBlock));
+  bb->id = Cfg->blockCnt;
+  Cfg->blocks = realloc(Cfg->blocks, sizeof(BasicBlock *) * ++Cfg->blockCnt);
+  Cfg->blocks[bb->id] = bb;
+  return bb;
+}
+
+static void addEdge(BasicBlock *from, BasicBlock *to) {
+  from->succs[from->succCnt++] = to;
+  to->preds = realloc(to->preds, sizeof(BasicBlock *) * ++to->predCnt);
+  to->preds[to->predCnt - 1] = from;
+}
+
+static void addItem(ItemKind kind, Node *stmt, Node **expr) {
+  if (Cur->itemCnt == Cur->itemCap) {
+    Cur->itemCap = Cur->itemCap ? Cur->itemCap * 2 : 4;
+    Cur->items = realloc(Cur->items, sizeof(Item) * Cur->itemCap);
+  }
+  Cur->items[Cur->itemCnt++] = (Item){kind, stmt, expr};
+}
+
+static void buildStmt(Node *node) {
+  switch (node->nodeType) {
+  case ND_EXPR_STMT:
+    addItem(IT_STMT, node, &node->left);
+    return;
+  case ND_RETURN:
+    addItem(IT_STMT, node, &node->left);
+    addEdge(Cur, Cfg->exit);
+    // code after the return can not be reached
+    Cur = newBlock();
+    return;
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      buildStmt(n);
+    return;
+  case ND_IF: {
+    addItem(IT_COND, node, &node->cond);
+    BasicBlock *cond = Cur;
+    BasicBlock *join = newBlock();
+
+    Cur = newBlock();
+    addEdge(cond, Cur);
+    buildStmt(node->then);
+    addEdge(Cur, join);
+
+    if (node->els) {
+      Cur = newBlock();
+      addEdge(cond, Cur);
+      buildStmt(node->els);
+      addEdge(Cur, join);
+    } else {
+      addEdge(cond, join);
+    }
+    Cur = join;
+    return;
+  }
+  case ND_LOOP: {
+    if (node->init)
+      buildStmt(node->init);
+
+    BasicBlock *head = newBlock();
+    BasicBlock *end = newBlock();
+    addEdge(Cur, head);
+    Cur = head;
+    if (node->cond)
+      addItem(IT_COND, node, &node->cond);
+
+    Cur = newBlock();
+    addEdge(head, Cur);
+    if (node->cond)
+      addEdge(head, end);
+    buildStmt(node->then);
+    if (node->inc)
+      addItem(IT_INC, node, &node->inc);
+    addEdge(Cur, head);
+    Cur = end;
+    return;
+  }
+  default:
+    return;
+  }
+}
+
+// the definitions found so far, in the order of the items
+static void addDef(Node *node) {
+  Cfg->defs = realloc(Cfg->defs, sizeof(Node *) * ++Cfg->defCnt);
+  Cfg->defs[Cfg->defCnt - 1] = node;
+}
+
+// in the order of use, so that a local written before it is read is not
+// counted as read
+typedef struct {
+  BitSet use;
+  BitSet def;
+  // the definitions of each local, and the gen set of reaching definitions
+  BitSet *varDefs;
+  BitSet gen;
+  int defIdx;
+  bool collect; // add the definitions to Cfg->defs
+} Walk;
+
+static void walkExpr(Walk *w, Node *node, bool always);
+
+// a tree whose parts may be skipped or run in any order: every read
+// counts, no write is known to happen
+static void walkAll(Walk *w, Node *node) {
+  // down the left operands in a loop, see node.c
+  for (; node; node = node->left) {
+    if (node->nodeType == ND_VAR || node->nodeType == ND_ASSIGN) {
+      walkExpr(w, node, false);
+      return;
+    }
+    walkAll(w, node->right);
+    walkAll(w, node->cond);
+    walkAll(w, node->then);
+    walkAll(w, node->els);
+    walkAll(w, node->init);
+    walkAll(w, node->inc);
+    for (Node *n = node->body; n; n = n->next)
+      walkAll(w, n);
+    for (Node *n = node->args; n; n = n->next)
+      walkAll(w, n);
+  }
+}
+
+static void walkWrite(Walk *w, Node *node, Obj *var, bool always) {
+  if (!Cfg->tracked[var->idx] || !always)
+    return;
+
+  if (w->def)
+    addBitSet(w->def, var->idx);
+  if (w->collect)
+    addDef(node);
+  if (w->gen) {
+    // this definition replaces the other ones of the local
+    for (int i = 0; i < setWords(Cfg->defCnt); i++)
+      w->gen[i] &= ~w->varDefs[var->idx][i];
+    addBitSet(w->gen, w->defIdx);
+  }
+  w->defIdx++;
+}
+
+// in the order codegen evaluates the expression. The left operand comes
+// last, so the walk goes down the left operands in a loop (see node.c).
+static void walkExpr(Walk *w, Node *node, bool always) {
+  for (;; node = node->left) {
+    switch (node->nodeType) {
+    case ND_NUM:
+      return;
+    case ND_VAR:
+      if (Cfg->tracked[node->var->idx] && w->use &&
+          !inBitSet(w->def, node->var->idx))
+        addBitSet(w->use, node->var->idx);
+      return;
+    case ND_ADDR:
+      if (node->left->nodeType != ND_VAR)
+        walkExpr(w, node->left, always);
+      return;
+    case ND_ASSIGN:
+      // the address is computed first, then the value
+      if (node->left->nodeType == ND_DEREF)
+        walkExpr(w, node->left->left, always);
+      walkExpr(w, node->right, always);
+      if (node->left->nodeType == ND_VAR)
+        walkWrite(w, node, node->left->var, always);
+      return;
+    case ND_NEG:
+    case ND_DEREF:
+      continue;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+      // the right operand is evaluated first
+      walkExpr(w, node->right, always);
+      continue;
+    case ND_FUNCALL:
+      // arguments are not evaluated in order, a write in one of them is
+      // only known to happen after all of them
+      for (Node *arg = node->args; arg; arg = arg->next)
+        walkAll(w, arg);
+      return;
+    case ND_INLINE:
+      // the statements before the first branch of the body always run
+      for (Node *n = node->body; n; n = n->next) {
+        if (n->nodeType != ND_EXPR_STMT)
+          always = false;
+        if (always)
+          walkExpr(w, n->left, always);
+        else
+          walkAll(w, n);
+      }
+      return;
+    default:
+      walkAll(w, node);
+      return;
+    }
+  }
+}
+
+void exprUseDef(CFG *cfg, Node *expr, BitSet use, BitSet def) {
+  Cfg = cfg;
+  Walk w = {use, def};
+  walkExpr(&w, expr, true);
+}
+
+CFG *buildCFG(Function *fn) {
+  CFG *cfg = calloc(1, sizeof(CFG));
+  cfg->fn = fn;
+  Cfg = cfg;
+
+  // a load through a pointer may read any local, as in the *(&x+1) tests
+  bool addrTaken = takesAddr(fn->body);
+  for (Obj *var = fn->locals; var; var = var->next)
+    var->idx = cfg->varCnt++;
+  cfg->vars = calloc(cfg->varCnt, sizeof(Obj *));
+  cfg->tracked = calloc(cfg->varCnt, sizeof(bool));
+  for (Obj *var = fn->locals; var; var = var->next) {
+    cfg->vars[var->idx] = var;
+    cfg->tracked[var->idx] = !addrTaken;
+  }
+
+  cfg->entry = Cur = newBlock();
+  cfg->exit = newBlock();
+  buildStmt(fn->body);
+  // falling off the end of the function
+  addEdge(Cur, cfg->exit);
+
+  // the blocks reached from the entry
+  BasicBlock **stack = calloc(cfg->blockCnt, sizeof(BasicBlock *));
+  int depth = 0;
+  stack[depth++] = cfg->entry;
+  cfg->entry->reachable = true;
+  while (depth) {
+    BasicBlock *bb = stack[--depth];
+    for (int i = 0; i < bb->succCnt; i++) {
+      if (bb->succs[i]->reachable)
+        continue;
+      bb->succs[i]->reachable = true;
+      stack[depth++] = bb->succs[i];
+    }
+  }
+  free(stack);
+
+  // number the definitions
+  Walk w = {.collect = true};
+  for (int i = 0; i < cfg->blockCnt; i++)
+    for (int j = 0; j < cfg->blocks[i]->itemCnt; j++)
+      if (*cfg->blocks[i]->items[j].expr)
+        walkExpr(&w, *cfg->blocks[i]->items[j].expr, true);
+  return cfg;
+}
+
+void freeCFG(CFG *cfg) {
+  for (int i = 0; i < cfg->blockCnt; i++) {
+    BasicBlock *bb = cfg->blocks[i];
+    free(bb->items);
+    free(bb->preds);
+    free(bb->use);
+    free(bb->def);
+    free(bb->liveIn);
+    free(bb->liveOut);
+    free(bb->gen);
+    free(bb->kill);
+    free(bb->reachIn);
+    free(bb->reachOut);
+    free(bb);
+  }
+  free(cfg->blocks);
+  free(cfg->vars);
+  free(cfg->tracked);
+  free(cfg->defs);
+  free(cfg);
+}
+
+// =================================================================
+// dataflow
+
+// liveIn = use | (liveOut & ~def), liveOut is the union of the liveIn of
+// the successors. Nothing is live at the exit.
+void computeLiveness(CFG *cfg) {
+  Cfg = cfg;
+  int n = cfg->varCnt;
+  for (int i = 0; i < cfg->blockCnt; i++) {
+    BasicBlock *bb = cfg->blocks[i];
+    bb->use = newBitSet(n);
+    bb->def = newBitSet(n);
+    bb->liveIn = newBitSet(n);
+    bb->liveOut = newBitSet(n);
+    Walk w = {bb->use, bb->def};
+    for (int j = 0; j < bb->itemCnt; j++)
+      if (*bb->items[j].expr)
+        walkExpr(&w, *bb->items[j].expr, true);
+  }
+
+  // blocks are in the order of the code, going backwards needs fewer rounds
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = cfg->blockCnt - 1; i >= 0; i--) {
+      BasicBlock *bb = cfg->blocks[i];
+      for (int j = 0; j < bb->succCnt; j++)
+        unionBitSet(bb->liveOut, bb->succs[j]->liveIn, n);
+
+      for (int j = 0; j < setWords(n); j++) {
+        uint64_t v = bb->use[j] | (bb->liveOut[j] & ~bb->def[j]);
+        changed |= v != bb->liveIn[j];
+        bb->liveIn[j] = v;
+      }
+    }
+  }
+}
+
+// reachOut = gen | (reachIn & ~kill), reachIn is the union of the reachOut
+// of the predecessors. The values locals hold at the entry, the arguments
+// or nothing, are not definitions.
+void computeReachingDefs(CFG *cfg) {
+  Cfg = cfg;
+  int n = cfg->defCnt;
+
+  BitSet *varDefs = calloc(cfg->varCnt, sizeof(BitSet));
+  for (int i = 0; i < cfg->varCnt; i++)
+    varDefs[i] = newBitSet(n);
+  for (int i = 0; i < n; i++)
+    addBitSet(varDefs[cfg->defs[i]->left->var->idx], i);
+
+  Walk w = {.varDefs = varDefs};
+  for (int i = 0; i < cfg->blockCnt; i++) {
+    BasicBlock *bb = cfg->blocks[i];
+    bb->gen = newBitSet(n);
+    bb->kill = newBitSet(n);
+    bb->reachIn = newBitSet(n);
+    bb->reachOut = newBitSet(n);
+
+    w.gen = bb->gen;
+    int start = w.defIdx;
+    for (int j = 0; j < bb->itemCnt; j++)
+      if (*bb->items[j].expr)
+        walkExpr(&w, *bb->items[j].expr, true);
+    // every definition of a local written in the block is overwritten
+    for (int d = start; d < w.defIdx; d++)
+      unionBitSet(bb->kill, varDefs[cfg->defs[d]->left->var->idx], n);
+    copyBitSet(bb->reachOut, bb->gen, n);
+  }
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = 0; i < cfg->blockCnt; i++) {
+      BasicBlock *bb = cfg->blocks[i];
+      for (int j = 0; j < bb->predCnt; j++)
+        unionBitSet(bb->reachIn, bb->preds[j]->reachOut, n);
+
+      for (int j = 0; j < setWords(n); j++) {
+        uint64_t v = bb->gen[j] | (bb->reachIn[j] & ~bb->kill[j]);
+        changed |= v != bb->reachOut[j];
+        bb->reachOut[j] = v;
+      }
+    }
+  }
+
+  for (int i = 0; i < cfg->varCnt; i++)
+    free(varDefs[i]);
+  free(varDefs);
+}
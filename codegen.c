@@ -4,36 +4,176 @@
 
 #include "rvcc.h"
 
+// time every function, set by -finstrument-functions
+bool InstrumentFunctions;
+
+bool IsaZba;
+bool IsaZbb;
+
 static int StackDepth;
 // 用于函数参数的寄存器们
-static char *ArgReg[] = {"a0", "a1", "a2", "a3", "a4", "a5"};
+static char *ArgReg[] = {"a0", "a1", "a2", "a3", "a4", "a5", "a6", "a7"};
 static Function *CurrentFn;
+// whether CurrentFn takes the address of any of its locals
+static bool CurrentFnAddrTaken;
+// label number of the join point of the innermost inlined call being
+// generated, 0 outside of inlined bodies
+static int InlineExit;
 
 static void genExpr(Node *node);
+static void genStmt(Node *node);
+
+// the distance from fp to where the frame layout below puts fp. With
+// compressed instructions, fp points to the bottom of the frame rather than
+// to the saved fp, so that the locals are at small positive offsets, which
+// c.lw, c.ld, c.sw and c.sd can reach.
+static int FrameBias;
+
+// the offset from fp of what is off bytes from the saved fp
+static int frameOffset(int off) { return off + FrameBias; }
+
+// number of the last code block of CurrentFn. Labels are numbered within
+// their function, so that the code of a function does not depend on the
+// ones before it (see cache.c)
+static int BlockCnt;
+
+static int count() { return ++BlockCnt; }
+
+// a branch of an if which rarely runs. It is generated after the rest of
+// the function, out of the way of the code which runs often.
+typedef struct ColdBlock {
+  struct ColdBlock *next;
+  Node *node;     // the if
+  Node *stmt;     // its cold branch
+  int cnt;        // number of the if
+  int stackDepth; // StackDepth at the branch
+  int inlineExit; // InlineExit at the branch
+} ColdBlock;
+
+// the cold blocks of CurrentFn not generated yet, in order
+static ColdBlock *ColdBlocks;
+static ColdBlock **ColdTail = &ColdBlocks;
+// generating a cold block, which comes after .L.return
+static bool InColdBlock;
+
+// add one to a counter of -fprofile-generate, the counters are an array of
+// 8 byte words emitted after the code
+static void genCount(Node *node, ProfKind kind) {
+  if (!ProfileGenerate)
+    return;
+  int i = newCounter(node, kind);
+  int off = i * 8;
+  emit("  # 剖析计数器%d加1\n", i);
+  emit("  la t0, __rvcc_profile_counts\n");
+  // past the reach of a 12 bit offset
+  if (off >= 2048) {
+    emit("  li t1, %d\n", off);
+    emit("  add t0, t0, t1\n");
+    off = 0;
+  }
+  emit("  ld t1, %d(t0)\n", off);
+  emit("  addi t1, t1, 1\n");
+  emit("  sd t1, %d(t0)\n", off);
+}
+
+// whether .L.return has more to do than the epilogue: main writes the
+// counts of -fprofile-generate, and -finstrument-functions times every
+// function there
+static bool hasExitCode(Function *fn) {
+  return InstrumentFunctions || (ProfileGenerate && !strcmp(fn->name, "main"));
+}
 
-// count for the number of code block
-static int count() {
-  static int I = 1;
-  return I++;
+// -finstrument-functions keeps the cycle and instruction counts at the
+// entry of the function, and the time its callees took before it was
+// called, right below fp
+#define INSTR_CYCLES -8
+#define INSTR_INSTRET -16
+#define INSTR_CHILD_CYCLES -24
+#define INSTR_CHILD_INSTRET -32
+#define INSTR_FRAME 32
+
+// the time spent in the callees of the running function is added up in
+// __rvcc_instrument_child of runtime/instrument.c, one for the functions of
+// every file, the entry saves that of the caller
+static void genInstrumentEntry() {
+  emit("  # 记录进入函数时的周期数和指令数\n");
+  emit("  rdcycle t0\n");
+  emit("  rdinstret t1\n");
+  emit("  sd t0, %d(fp)\n", frameOffset(INSTR_CYCLES));
+  emit("  sd t1, %d(fp)\n", frameOffset(INSTR_INSTRET));
+  emit("  # 保存调用者的被调函数用时, 从0开始累计本函数的\n");
+  emit("  la t2, __rvcc_instrument_child\n");
+  emit("  ld t0, 0(t2)\n");
+  emit("  ld t1, 8(t2)\n");
+  emit("  sd t0, %d(fp)\n", frameOffset(INSTR_CHILD_CYCLES));
+  emit("  sd t1, %d(fp)\n", frameOffset(INSTR_CHILD_INSTRET));
+  emit("  sd zero, 0(t2)\n");
+  emit("  sd zero, 8(t2)\n");
+}
+
+// add the call to the row of the function: calls, cycles, cycles outside
+// of the callees, instructions, instructions outside of the callees. The
+// caller's callees took this call's time more. a0 holds the return value.
+static void genInstrumentExit(Function *fn) {
+  emit("  # 计算本次调用的周期数t0和指令数t1\n");
+  emit("  rdcycle t0\n");
+  emit("  rdinstret t1\n");
+  emit("  ld t2, %d(fp)\n", frameOffset(INSTR_CYCLES));
+  emit("  sub t0, t0, t2\n");
+  emit("  ld t2, %d(fp)\n", frameOffset(INSTR_INSTRET));
+  emit("  sub t1, t1, t2\n");
+
+  emit("  # 累加到%s的调用次数和总用时\n", fn->name);
+  emit("  la t2, .L.instrument.%s\n", fn->name);
+  emit("  ld t3, 0(t2)\n");
+  emit("  addi t3, t3, 1\n");
+  emit("  sd t3, 0(t2)\n");
+  emit("  ld t3, 8(t2)\n");
+  emit("  add t3, t3, t0\n");
+  emit("  sd t3, 8(t2)\n");
+  emit("  ld t3, 24(t2)\n");
+  emit("  add t3, t3, t1\n");
+  emit("  sd t3, 24(t2)\n");
+
+  emit("  # 减去被调函数的用时, 累加到%s的自身用时\n", fn->name);
+  emit("  la t4, __rvcc_instrument_child\n");
+  emit("  ld t3, 0(t4)\n");
+  emit("  sub t3, t0, t3\n");
+  emit("  ld t5, 16(t2)\n");
+  emit("  add t5, t5, t3\n");
+  emit("  sd t5, 16(t2)\n");
+  emit("  ld t3, 8(t4)\n");
+  emit("  sub t3, t1, t3\n");
+  emit("  ld t5, 32(t2)\n");
+  emit("  add t5, t5, t3\n");
+  emit("  sd t5, 32(t2)\n");
+
+  emit("  # 本次调用的用时计入调用者的被调函数用时\n");
+  emit("  ld t3, %d(fp)\n", frameOffset(INSTR_CHILD_CYCLES));
+  emit("  add t3, t3, t0\n");
+  emit("  sd t3, 0(t4)\n");
+  emit("  ld t3, %d(fp)\n", frameOffset(INSTR_CHILD_INSTRET));
+  emit("  add t3, t3, t1\n");
+  emit("  sd t3, 8(t4)\n");
 }
 
 // push the value of a0 onto the stack
 static void push() {
   //  sp is the stack pointer, the stack grows downwards, under 64
   //  bits, 8 bytes is a unit, so sp-8
-  printf("  # 压栈, 将a0的值存入栈顶\n");
-  printf("  addi sp, sp, -8\n");
+  emit("  # 压栈, 将a0的值存入栈顶\n");
+  emit("  addi sp, sp, -8\n");
   // sd rs2, offset(rs1)  M[x[rs1] + sext(offset) = x[rs2][63: 0]
-  printf("  sd a0, 0(sp)\n");
+  emit("  sd a0, 0(sp)\n");
   StackDepth++;
 }
 
 // pop the value of the address pointed to by sp into the register
 static void pop(char *reg) {
   // ld rd, offset(rs1) x[rd] = M[x[rs1] + sext(offset)][63:0]
-  printf("  # 弹栈, 将栈顶的值存入%s\n", reg);
-  printf("  ld %s, 0(sp)\n", reg);
-  printf("  addi sp, sp, 8\n");
+  emit("  # 弹栈, 将栈顶的值存入%s\n", reg);
+  emit("  ld %s, 0(sp)\n", reg);
+  emit("  addi sp, sp, 8\n");
   StackDepth--;
 }
 
@@ -42,14 +182,59 @@ static int alighTo(int n, int align) {
   return (n + align - 1) / align * align;
 }
 
+// count the arguments of a function call
+static int countArgs(Node *node) {
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    nargs++;
+  return nargs;
+}
+
+// restore sp, fp and ra of the caller, the frame of CurrentFn is released
+static void epilogue() {
+  // write fp to sp
+  emit("  # 将fp的值写回sp\n");
+  if (FrameBias)
+    emit("  addi sp, fp, %d\n", FrameBias);
+  else
+    emit("  mv sp, fp\n");
+  // pop the stack of the earliest fp saved values and restore fp.
+  emit("  # 将最早fp保存的值弹栈, 恢复fp和sp\n");
+  emit("  ld fp, 0(sp)\n");
+  // 将ra寄存器弹栈,恢复ra的值
+  emit("  # 将ra寄存器弹栈,恢复ra的值\n");
+  emit("  ld ra, 8(sp)\n");
+  emit("  addi sp, sp, 16\n");
+}
+
+// load and store instructions for a value of the type
+static char *loadOp(Type *ty) { return ty->size == 4 ? "lw" : "ld"; }
+static char *storeOp(Type *ty) { return ty->size == 4 ? "sw" : "sd"; }
+
+// ints are 32 bits wide, computed by the instructions with a w suffix, which
+// keep them sign extended in the 64-bit registers
+static char *wordSuffix(Type *ty) { return ty->kind == TY_INT ? "w" : ""; }
+
+// load the value the address in a0 points to into a0
+static void load(Type *ty) {
+  emit("  # 读取a0中存放的地址, 得到的值存入a0\n");
+  emit("  %s a0, 0(a0)\n", loadOp(ty));
+}
+
+// store a0 into the address in a1
+static void store(Type *ty) {
+  emit("  # 将a0的值, 写入到a1中存放的地址\n");
+  emit("  %s a0, 0(a1)\n", storeOp(ty));
+}
+
 // offset is relative to fp
 static void genAddr(Node *node) {
   switch (node->nodeType) {
   case ND_VAR:
-    printf("  # 获取变量%s的栈内地址为%d(fp)\n", node->var->name,
-           node->var->offSet);
-    printf("  addi a0, fp, %d\n",
-           node->var->offSet); // fp is frame pointer, also named as x8, s0
+    emit("  # 获取变量%s的栈内地址为%d(fp)\n", node->var->name,
+           frameOffset(node->var->offSet));
+    emit("  addi a0, fp, %d\n",
+           frameOffset(node->var->offSet)); // fp is frame pointer, also named as x8, s0
     return;
   case ND_DEREF:
     genExpr(node->left);
@@ -60,26 +245,187 @@ static void genAddr(Node *node) {
   errorTok(node->tok, "not an lvalue");
 }
 
+// whether the value of node can be loaded into any register directly,
+// without using other registers or the stack
+static bool isSimple(Node *node) {
+  switch (node->nodeType) {
+  case ND_NUM:
+  case ND_VAR:
+    return true;
+  case ND_ADDR:
+    return node->left->nodeType == ND_VAR;
+  default:
+    return false;
+  }
+}
+
+// load a simple value into reg
+static void genSimple(Node *node, char *reg) {
+  switch (node->nodeType) {
+  case ND_NUM:
+    emit("  # 将%d加载到%s中\n", node->val, reg);
+    emit("  li %s, %d\n", reg, node->val);
+    return;
+  case ND_VAR:
+    emit("  # 将变量%s的值加载到%s中\n", node->var->name, reg);
+    emit("  %s %s, %d(fp)\n", loadOp(node->dataType), reg,
+         frameOffset(node->var->offSet));
+    return;
+  case ND_ADDR:
+    emit("  # 将变量%s的地址加载到%s中\n", node->left->var->name, reg);
+    emit("  addi %s, fp, %d\n", reg, frameOffset(node->left->var->offSet));
+    return;
+  default:
+    break;
+  }
+  errorTok(node->tok, "not a simple expression");
+}
+
+// evaluate the arguments of a function call into the argument registers,
+// arguments past the 8th go to the stack, the 9th at 0(sp).
+// returns the number of stack slots to be released after the call
+static int genArgs(Node *node) {
+  int nargs = countArgs(node);
+  Node **args = calloc(nargs, sizeof(Node *));
+  int i = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    args[i++] = arg;
+
+  int nreg = nargs < NARGREG ? nargs : NARGREG;
+  int nstack = nargs - nreg;
+
+  // sp has to be 16-byte aligned at the call
+  int pad = (StackDepth + nstack) % 2;
+  if (pad) {
+    emit("  # 对齐栈, 使调用时sp为16字节对齐\n");
+    emit("  addi sp, sp, -8\n");
+    StackDepth++;
+  }
+
+  for (i = nargs - 1; i >= nreg; i--) {
+    genExpr(args[i]);
+    push();
+  }
+
+  // Other arguments are evaluated with a0 and a1 (and may contain calls),
+  // so they are computed first. The last one stays in a0, the others wait
+  // on the stack.
+  int last = -1;
+  for (i = 0; i < nreg; i++)
+    if (!isSimple(args[i]))
+      last = i;
+
+  for (i = 0; i < nreg; i++) {
+    if (isSimple(args[i]))
+      continue;
+    genExpr(args[i]);
+    if (i != last)
+      push();
+  }
+
+  // No argument register except a0 is in use yet, so the moves below can
+  // not overwrite each other: a0 is moved out of the way first, then the
+  // values on the stack are popped into place
+  if (last > 0) {
+    emit("  # 将a0的值移入%s\n", ArgReg[last]);
+    emit("  mv %s, a0\n", ArgReg[last]);
+  }
+  for (i = last - 1; i >= 0; i--)
+    if (!isSimple(args[i]))
+      pop(ArgReg[i]);
+
+  // simple arguments go straight into their registers
+  for (i = 0; i < nreg; i++)
+    if (isSimple(args[i]))
+      genSimple(args[i], ArgReg[i]);
+
+  free(args);
+  return nstack + pad;
+}
+
+// `return f(...)`: nothing in the frame is needed after the call, so release
+// it first and jump to the callee, which then returns to our caller directly.
+// A call to the current function itself just rebinds the parameters and
+// jumps back to the start of the body, so recursion becomes a loop.
+// Returns false if the call has to be generated as a normal call.
+static bool genTailCall(Node *node) {
+  // the callee can not find arguments on a stack we've released
+  if (node->nodeType != ND_FUNCALL || countArgs(node) > NARGREG)
+    return false;
+  // a pointer into the frame may be passed on, and the frame is gone (or
+  // reused) once we jump
+  if (CurrentFnAddrTaken)
+    return false;
+  // the jump would skip the code at .L.return
+  if (hasExitCode(CurrentFn))
+    return false;
+
+  genCount(node, PROF_CALL);
+  genArgs(node);
+
+  if (!strcmp(node->funcName, CurrentFn->name)) {
+    emit("  # 尾递归, 跳转到%s的.L.tailcall.%s段\n", CurrentFn->name,
+           CurrentFn->name);
+    emit("  j .L.tailcall.%s\n", CurrentFn->name);
+    return true;
+  }
+
+  epilogue();
+  emit("  # 尾调用函数%s\n", node->funcName);
+  emit("  tail %s\n", node->funcName);
+  return true;
+}
+
+static void genBinary(Node *node);
+
+// x + y*2, x + y*4 or x + y*8, which Zba adds in one instruction, as
+// pointer arithmetic is. Returns the shift, and y in index.
+static int shiftAdd(Node *node, Node **index) {
+  if (!IsaZba || node->nodeType != ND_ADD || node->right->nodeType != ND_MUL)
+    return 0;
+  Node *y = node->right->left, *scale = node->right->right;
+  if (y->nodeType == ND_NUM) {
+    scale = y;
+    y = node->right->right;
+  }
+  if (scale->nodeType != ND_NUM)
+    return 0;
+  for (int shift = 1; shift <= 3; shift++) {
+    if (scale->val == 1 << shift) {
+      *index = y;
+      return shift;
+    }
+  }
+  return 0;
+}
+
+// an int divided by a constant other than 0, which genDivConst() lowers
+// from -O1. The divisor is part of its code, it is not evaluated.
+static bool isDivConst(Node *node) {
+  return OptLevel >= 1 && node->nodeType == ND_DIV &&
+         node->dataType->kind == TY_INT && node->right->nodeType == ND_NUM &&
+         node->right->val != 0;
+}
+
 static void genExpr(Node *node) {
 
   // load data to a0 register
   switch (node->nodeType) {
   case ND_NUM:
-    printf("  # 将%d加载到a0中\n", node->val);
-    printf("  li a0, %d\n", node->val);
+    emit("  # 将%d加载到a0中\n", node->val);
+    emit("  li a0, %d\n", node->val);
     return;
   case ND_NEG:
     genExpr(node->left);
-    printf("  # 对a0值进行取反\n");
-    printf("  neg a0, a0\n");
+    emit("  # 对a0值进行取反\n");
+    emit("  neg%s a0, a0\n", wordSuffix(node->dataType));
     return;
   case ND_VAR:
     // calculate the address of the variable and store into a0
     genAddr(node);
     // the data stored in the a0 address is accessed and stored in the a0
     // address
-    printf("  # 读取a0中存放的地址, 得到的值存入a0\n");
-    printf("  ld a0, 0(a0)\n");
+    load(node->dataType);
     return;
   case ND_ASSIGN:
     // left
@@ -87,95 +433,172 @@ static void genExpr(Node *node) {
     push();
     genExpr(node->right);
     pop("a1");
-    printf("  # 将a0的值, 写入到a1中存放的地址\n");
-    printf("  sd a0, 0(a1)\n"); // assign
+    store(node->dataType);
     return;
   case ND_DEREF:
     genExpr(node->left);
-    printf("  # 读取a0中存放的地址, 得到的值存入a0\n");
-    printf("  ld a0, 0(a0)\n");
+    load(node->dataType);
     return;
   case ND_ADDR:
     genAddr(node->left);
     return;
   case ND_FUNCALL: {
-    int nargs = 0;
-
-    // Calculate the values of all parameters and push to stack
-    for (Node *arg = node->args; arg; arg = arg->next) {
-      genExpr(arg);
-      push();
-      nargs++;
-    }
-
-    assert(nargs <=
-           6); // up to 6 registers to store the parameters of the function
-
-    // pop the arguments to register, a0 -> args1, a1 -> args2 and so on
-    for (int i = nargs - 1; i >= 0; i--) {
-      pop(ArgReg[i]);
+    genCount(node, PROF_CALL);
+    int nslots = genArgs(node);
+    emit("\n  # 调用函数%s\n", node->funcName);
+    emit("  call %s\n", node->funcName);
+    if (nslots) {
+      emit("  # 释放栈上传递的参数\n");
+      emit("  addi sp, sp, %d\n", nslots * 8);
+      StackDepth -= nslots;
     }
+    return;
+  }
+  case ND_INLINE: {
+    int cnt = count();
+    int outer = InlineExit;
+    InlineExit = cnt;
+    emit("\n# =====内联函数%s %d==============\n", node->funcName, cnt);
+    genCount(node, PROF_CALL);
+    for (Node *n = node->body; n; n = n->next)
+      genStmt(n);
+    InlineExit = outer;
 
-    printf("\n  # 调用函数%s\n", node->funcName);
-    printf("  call %s\n", node->funcName);
+    // every return of the inlined body jumps here with the value in a0
+    emit("# 内联函数%s的返回点\n", node->funcName);
+    emit(".L.inline.%s.%d:\n", CurrentFn->name, cnt);
     return;
   }
   default:
     break;
   }
 
-  // consider the priority, recurse to the right node first
-  genExpr(node->right);
-  push();
-  genExpr(node->left);
-  pop("a1");
+  // consider the priority, the right operand is evaluated first. A chain
+  // like a+b+c+... is generated in a loop (see node.c): the right operands
+  // from the top down, then the operand at the bottom, then the operators
+  // from the bottom up, which is the code the recursion gives.
+  Node **chain;
+  int cnt = leftChain(node, isBinary, &chain);
+  if (!cnt)
+    errorTok(node->tok, "invalid expression");
+  for (int i = 0; i < cnt; i++) {
+    if (isDivConst(chain[i]))
+      continue;
+    Node *index;
+    genExpr(shiftAdd(chain[i], &index) ? index : chain[i]->right);
+    push();
+  }
+  genExpr(chain[cnt - 1]->left);
+  for (int i = cnt - 1; i >= 0; i--) {
+    if (!isDivConst(chain[i]))
+      pop("a1");
+    genBinary(chain[i]);
+  }
+  free(chain);
+}
+
+// a0 / d for an int a0 and a constant d other than 0 (see isDivConst()),
+// rounded towards zero as divw does, with a1 free to use. It takes no
+// divide: by 2^k, a0 is shifted right after adding 2^k - 1 if it is
+// negative. By any other d, a0 is multiplied by M = ceil(2^p / |d|) with
+// p = 31 + ceil(log2 |d|): a0*M / 2^p is then a0 / |d| plus less than
+// 1/|d|, which the floor of the shift drops, and 1 is added for a negative
+// a0 to round up instead. The product takes 63 bits at most, so mul gives
+// all of it.
+static void genDivConst(Node *node) {
+  long d = node->right->val;
+  long abs = d < 0 ? -d : d;
+  int log2 = 0;
+  while ((1L << log2) < abs)
+    log2++;
+
+  emit("  # a0÷%ld, 结果写入a0\n", d);
+  if (abs == 1L << log2) {
+    if (log2) {
+      emit("  sraiw a1, a0, 31\n");
+      emit("  srliw a1, a1, %d\n", 32 - log2);
+      emit("  addw a0, a0, a1\n");
+      emit("  sraiw a0, a0, %d\n", log2);
+    }
+  } else {
+    int p = 31 + log2;
+    long magic = ((1L << p) + abs - 1) / abs;
+    emit("  li a1, %ld\n", magic);
+    emit("  mul a1, a0, a1\n");
+    emit("  srai a1, a1, %d\n", p);
+    emit("  sraiw a0, a0, 31\n");
+    emit("  subw a0, a1, a0\n");
+  }
+  if (d < 0)
+    emit("  negw a0, a0\n");
+}
+
+// the operator of a binary node, the left operand is in a0 and the right
+// one in a1, which only holds y of x + y*k (see shiftAdd()) and nothing for
+// a constant divisor
+static void genBinary(Node *node) {
+  if (isDivConst(node)) {
+    genDivConst(node);
+    return;
+  }
 
   // generate what each binary tree node does in assembly code
+  Node *index;
+  int shift = shiftAdd(node, &index);
+  if (shift) {
+    emit("  # a0+a1*%d, 结果写入a0\n", 1 << shift);
+    emit("  sh%dadd a0, a1, a0\n", shift);
+    // the int result is kept sign extended, as addw leaves it
+    if (node->dataType->kind == TY_INT)
+      emit("  sext.w a0, a0\n");
+    return;
+  }
+
   switch (node->nodeType) {
   case ND_ADD:
-    printf("  # a0+a1, 结果写入a0\n");
-    printf("  add a0, a0, a1\n");
+    emit("  # a0+a1, 结果写入a0\n");
+    emit("  add%s a0, a0, a1\n", wordSuffix(node->dataType));
     return;
   case ND_SUB:
-    printf("  # a0-a1, 结果写入a0\n");
-    printf("  sub a0, a0, a1\n");
+    emit("  # a0-a1, 结果写入a0\n");
+    emit("  sub%s a0, a0, a1\n", wordSuffix(node->dataType));
     return;
   case ND_MUL:
-    printf("  # a0*a1, 结果写入a0\n");
-    printf("  mul a0, a0, a1\n");
+    emit("  # a0*a1, 结果写入a0\n");
+    emit("  mul%s a0, a0, a1\n", wordSuffix(node->dataType));
     return;
   case ND_DIV:
-    printf("  # a0÷a1, 结果写入a0\n");
-    printf("  div a0, a0, a1\n");
+    emit("  # a0÷a1, 结果写入a0\n");
+    emit("  div%s a0, a0, a1\n", wordSuffix(node->dataType));
     return;
   case ND_EQ:
   case ND_NE:
     // first compare the two values to see if they are equal
-    printf("  # 判断是否a0%sa1\n", node->nodeType == ND_EQ ? "=" : "≠");
-    printf("  xor a0, a0, a1\n");
+    emit("  # 判断是否a0%sa1\n", node->nodeType == ND_EQ ? "=" : "≠");
+    emit("  xor a0, a0, a1\n");
 
     // then base on condition to set 1 or 0 to reg
     if (node->nodeType == ND_EQ)
       // Set if Equal to Zero (rd, rs1)
       // if x[rd] == 0, then write 1 to x[rs1] otherwise 0
-      printf("  seqz a0, a0\n");
+      emit("  seqz a0, a0\n");
     else
       // Set if not Equal to Zero (rd, rs2)
       // if x[rd] != 0, then write 1 to x[rs1] otherwise 0
-      printf("  snez a0, a0\n");
+      emit("  snez a0, a0\n");
     return;
   case ND_LT:
     // Set if Less Than (rs, rs1, rs2)
     // compare x[rs1], x[rs2], if x[rs1] < x[rs2], then write 1 to rs, otherwise
     // 0
-    printf("  # 判断a0<a1\n");
-    printf("  slt a0, a0, a1\n");
+    emit("  # 判断a0<a1\n");
+    emit("  slt a0, a0, a1\n");
     return;
   case ND_LE:
     // a0 <= a1 <==> a0 = a1 < a0, a0 = a1^1
-    printf("  # 判断是否a0≤a1\n");
-    printf("  slt a0, a1, a0\n");
-    printf("  xori a0, a0, 1\n");
+    emit("  # 判断是否a0≤a1\n");
+    emit("  slt a0, a1, a0\n");
+    emit("  xori a0, a0, 1\n");
     return;
   default:
     break;
@@ -184,15 +607,360 @@ static void genExpr(Node *node) {
   errorTok(node->tok, "invalid expression");
 }
 
+static bool isIntExpr(Node *node) {
+  return node->dataType && node->dataType->kind == TY_INT &&
+         isPureExpr(node);
+}
+
+// the variable and value of the branch of an if which is v = value
+static bool assignsVar(Node *stmt, Node **var, Node **val) {
+  if (stmt->nodeType == ND_BLOCK && stmt->body && !stmt->body->next)
+    stmt = stmt->body;
+  if (stmt->nodeType != ND_EXPR_STMT || stmt->left->nodeType != ND_ASSIGN ||
+      stmt->left->left->nodeType != ND_VAR)
+    return false;
+  *var = stmt->left->left;
+  *val = stmt->left->right;
+  return isIntExpr(*var) && isIntExpr(*val);
+}
+
+// if (a < b) v = b; else v = a; is v = max(a, b) and takes no branch with
+// Zbb, as does if (v < b) v = b;. The operands are computed whichever way
+// the if goes, so they may have no side effects. The branches are counted
+// with -fprofile-generate, which needs them.
+static bool genMinMax(Node *node) {
+  Node *cond = node->cond;
+  if (!IsaZbb || ProfileGenerate ||
+      (cond->nodeType != ND_LT && cond->nodeType != ND_LE) ||
+      !isIntExpr(cond->left) || !isIntExpr(cond->right))
+    return false;
+
+  Node *var, *thenVal, *elsVar, *elsVal;
+  if (!assignsVar(node->then, &var, &thenVal))
+    return false;
+  if (!node->els)
+    elsVal = var;
+  else if (!assignsVar(node->els, &elsVar, &elsVal) ||
+           elsVar->var != var->var)
+    return false;
+
+  // a < b and a <= b pick the same value when a = b
+  char *op;
+  if (sameExpr(thenVal, cond->right) && sameExpr(elsVal, cond->left))
+    op = "max";
+  else if (sameExpr(thenVal, cond->left) && sameExpr(elsVal, cond->right))
+    op = "min";
+  else
+    return false;
+
+  emit("  # 分支赋值即%s, 不需要跳转\n", op);
+  genAddr(var);
+  push();
+  genExpr(cond->right);
+  push();
+  genExpr(cond->left);
+  pop("a1");
+  emit("  %s a0, a0, a1\n", op);
+  pop("a1");
+  store(var->dataType);
+  return true;
+}
+
+// whether control never goes past the end of the statement
+static bool endsInReturn(Node *node) {
+  switch (node->nodeType) {
+  case ND_RETURN:
+    return true;
+  case ND_BLOCK: {
+    Node *last = node->body;
+    while (last && last->next)
+      last = last->next;
+    return last && endsInReturn(last);
+  }
+  case ND_IF:
+    return node->els && endsInReturn(node->then) && endsInReturn(node->els);
+  default:
+    return false;
+  }
+}
+
+// the branch of the if to move out of line, NULL to keep both in place.
+// With a profile, it is the branch which runs less than half of the time.
+// Without one, from -O1, a branch which returns while the other goes on is
+// taken to be an early return or an error path, unlikely to run.
+static Node *coldBranch(Node *node) {
+  long runs = profileCount(node, PROF_IF);
+  long thens = profileCount(node, PROF_THEN);
+  if (runs > 0 && thens >= 0) {
+    if (thens * 2 < runs)
+      return node->then;
+    if (node->els && (runs - thens) * 2 < runs)
+      return node->els;
+    return NULL;
+  }
+  if (OptLevel < 1 || runs == 0)
+    return NULL;
+
+  bool thenReturns = endsInReturn(node->then);
+  bool elsReturns = node->els && endsInReturn(node->els);
+  if (thenReturns && !elsReturns)
+    return node->then;
+  if (elsReturns && !thenReturns)
+    return node->els;
+  return NULL;
+}
+
+// generate the cold blocks of CurrentFn, each jumps back to the end of its
+// if unless it returns. The blocks may have cold blocks of their own.
+static void genColdBlocks() {
+  while (ColdBlocks) {
+    ColdBlock *block = ColdBlocks;
+    ColdBlocks = block->next;
+    if (!ColdBlocks)
+      ColdTail = &ColdBlocks;
+
+    int depth = StackDepth;
+    int outer = InlineExit;
+    StackDepth = block->stackDepth;
+    InlineExit = block->inlineExit;
+
+    emit("\n# 分支%d的.L.cold.%s.%d段标签\n", block->cnt, CurrentFn->name,
+         block->cnt);
+    emit(".L.cold.%s.%d:\n", CurrentFn->name, block->cnt);
+    if (block->stmt == block->node->then)
+      genCount(block->node, PROF_THEN);
+    InColdBlock = true;
+    genStmt(block->stmt);
+    InColdBlock = false;
+    if (!endsInReturn(block->stmt)) {
+      emit("  # 跳转回分支%d的.L.end.%s.%d段\n", block->cnt, CurrentFn->name,
+           block->cnt);
+      emit("  j .L.end.%s.%d\n", CurrentFn->name, block->cnt);
+    }
+
+    StackDepth = depth;
+    InlineExit = outer;
+    free(block);
+  }
+}
+
+// the body and increment of a loop, then its condition, which jumps back
+// while it holds. The loop is entered by a jump to the condition.
+static void genRotatedLoop(Node *node, int cnt) {
+  char *fn = CurrentFn->name;
+  emit("  # 跳转到循环%d的.L.cond.%s.%d段\n", cnt, fn, cnt);
+  emit("  j .L.cond.%s.%d\n", fn, cnt);
+
+  emit("\n# 循环%d的.L.begin.%s.%d段标签\n", cnt, fn, cnt);
+  emit(".L.begin.%s.%d:\n", fn, cnt);
+  emit("\n# Then语句%d\n", cnt);
+  genCount(node, PROF_BODY);
+  genStmt(node->then);
+
+  if (node->inc) {
+    emit("\n# Inc语句%d\n", cnt);
+    genExpr(node->inc);
+  }
+
+  emit("\n# 循环%d的.L.cond.%s.%d段标签\n", cnt, fn, cnt);
+  emit(".L.cond.%s.%d:\n", fn, cnt);
+  emit("# Cond表达式%d\n", cnt);
+  genExpr(node->cond);
+  emit("  # 若a0不为0, 则跳转到循环%d的.L.begin.%s.%d段\n", cnt, fn, cnt);
+  emit("  bnez a0, .L.begin.%s.%d\n", fn, cnt);
+}
+
+// the registers of a loop on vectors (see vector.c): the addresses of the
+// arrays are in a2 to a7, the operands which do not change in t3 to t6
+static char *vecPtrReg(VecLoop *vl, Node *addr) {
+  static char *regs[] = {"a2", "a3", "a4", "a5", "a6", "a7"};
+  return regs[vecPtr(vl, addr)];
+}
+
+static char *vecScalarReg(VecLoop *vl, Node *node) {
+  static char *regs[] = {"t3", "t4", "t5", "t6"};
+  return regs[vecScalar(vl, node)];
+}
+
+static char *vecOp(Node *node) {
+  switch (node->nodeType) {
+  case ND_ADD:
+    return "vadd";
+  case ND_SUB:
+    return "vsub";
+  case ND_MUL:
+    return "vmul";
+  default:
+    return "vdiv";
+  }
+}
+
+// the value of expr for the elements of the strip into v<reg>, the
+// registers above it are free
+static void genVecExpr(VecLoop *vl, Node *node, int reg) {
+  if (vecScalar(vl, node) >= 0) {
+    emit("  # 将%s的值复制到v%d的每个元素\n", vecScalarReg(vl, node), reg);
+    emit("  vmv.v.x v%d, %s\n", reg, vecScalarReg(vl, node));
+    return;
+  }
+  if (node->nodeType == ND_DEREF) {
+    emit("  # 读取%s开始的元素到v%d\n", vecPtrReg(vl, node->left), reg);
+    emit("  vle32.v v%d, (%s)\n", reg, vecPtrReg(vl, node->left));
+    return;
+  }
+  if (node->nodeType == ND_NEG) {
+    genVecExpr(vl, node->left, reg);
+    emit("  # 对v%d的元素取反\n", reg);
+    emit("  vrsub.vx v%d, v%d, zero\n", reg, reg);
+    return;
+  }
+
+  // a chain like a+b+c+... in a loop (see node.c), from the bottom up
+  Node **chain;
+  int cnt = vecChain(vl, node, &chain);
+  Node *bottom = chain[cnt - 1];
+  int i = cnt - 1;
+  if (vecScalar(vl, bottom->left) >= 0 && bottom->nodeType != ND_DIV) {
+    // x op v, in the order of vrsub for a subtraction
+    char *x = vecScalarReg(vl, bottom->left);
+    genVecExpr(vl, bottom->right, reg);
+    emit("  # %s与v%d的元素运算, 结果写入v%d\n", x, reg, reg);
+    emit("  %s.vx v%d, v%d, %s\n",
+         bottom->nodeType == ND_SUB ? "vrsub" : vecOp(bottom), reg, reg, x);
+    i--;
+  } else {
+    genVecExpr(vl, bottom->left, reg);
+  }
+
+  for (; i >= 0; i--) {
+    Node *right = chain[i]->right;
+    if (vecScalar(vl, right) >= 0) {
+      char *x = vecScalarReg(vl, right);
+      emit("  # v%d的元素与%s运算, 结果写入v%d\n", reg, x, reg);
+      emit("  %s.vx v%d, v%d, %s\n", vecOp(chain[i]), reg, reg, x);
+      continue;
+    }
+    genVecExpr(vl, right, reg + 1);
+    emit("  # v%d与v%d的元素运算, 结果写入v%d\n", reg, reg + 1, reg);
+    emit("  %s.vv v%d, v%d, v%d\n", vecOp(chain[i]), reg, reg, reg + 1);
+  }
+  free(chain);
+}
+
+// the loop on vectors of a loop which vector.c vectorizes, generated right
+// after its init. A strip of elements takes an iteration, until n - i are
+// done. It jumps to .L.scalar, where the scalar loop is generated next, if
+// an array loaded from starts less than a vector below the one stored to,
+// and to .L.join past the scalar loop once it is done.
+static void genVectorLoop(Node *node, VecLoop *vl, int cnt) {
+  char *fn = CurrentFn->name;
+  emit("\n# 循环%d的向量化版本\n", cnt);
+  genExpr(vl->counter);
+  push();
+  genExpr(vl->bound);
+  pop("a1");
+  emit("  # 要处理的元素个数存入t0, 不大于0时循环不执行\n");
+  emit("  sub t0, a0, a1\n");
+  emit("  bge zero, t0, .L.join.%s.%d\n", fn, cnt);
+
+  for (int i = 0; i < vl->ptrCnt; i++) {
+    genExpr(vl->ptrs[i]);
+    emit("  # 数组的首个元素地址存入%s\n", vecPtrReg(vl, vl->ptrs[i]));
+    emit("  mv %s, a0\n", vecPtrReg(vl, vl->ptrs[i]));
+  }
+  for (int i = 0; i < vl->scalarCnt; i++) {
+    genExpr(vl->scalars[i]);
+    emit("  # 循环中不变的操作数存入%s\n", vecScalarReg(vl, vl->scalars[i]));
+    emit("  mv %s, a0\n", vecScalarReg(vl, vl->scalars[i]));
+  }
+
+  if (!vl->sum && vl->ptrCnt > 1) {
+    emit("  # 一个向量的字节数减1存入t1\n");
+    emit("  vsetvli t1, zero, e32, m1, ta, ma\n");
+    emit("  slli t1, t1, 2\n");
+    emit("  addi t1, t1, -1\n");
+    for (int i = 1; i < vl->ptrCnt; i++) {
+      char *reg = vecPtrReg(vl, vl->ptrs[i]);
+      emit("  # 若0<a2-%s<=t1, 后面的迭代读取前面写入的元素, 执行标量循环\n",
+           reg);
+      emit("  sub a0, a2, %s\n", reg);
+      emit("  addi a0, a0, -1\n");
+      emit("  bltu a0, t1, .L.scalar.%s.%d\n", fn, cnt);
+    }
+  }
+
+  // the loop ends with i = n, the value of i is not read in it
+  genAddr(vl->counter);
+  push();
+  genExpr(vl->bound);
+  pop("a1");
+  store(vl->counter->dataType);
+
+  if (vl->sum) {
+    genExpr(vl->sum);
+    emit("  # 和的初值存入v1的元素0\n");
+    emit("  vsetvli t1, t0, e32, m1, ta, ma\n");
+    emit("  vmv.s.x v1, a0\n");
+  }
+
+  emit("\n# 循环%d的.L.vector.%s.%d段标签\n", cnt, fn, cnt);
+  emit(".L.vector.%s.%d:\n", fn, cnt);
+  emit("  # 本次处理的元素个数存入t1\n");
+  emit("  vsetvli t1, t0, e32, m1, ta, ma\n");
+  genVecExpr(vl, vl->expr, 2);
+  if (vl->sum) {
+    emit("  # v2的元素加到v1的元素0\n");
+    emit("  vredsum.vs v1, v2, v1\n");
+  } else {
+    emit("  # v2的元素写入a2开始的地址\n");
+    emit("  vse32.v v2, (a2)\n");
+  }
+  emit("  # 地址后移t1个元素\n");
+  emit("  slli t2, t1, 2\n");
+  for (int i = 0; i < vl->ptrCnt; i++) {
+    char *reg = vecPtrReg(vl, vl->ptrs[i]);
+    emit("  add %s, %s, t2\n", reg, reg);
+  }
+  emit("  sub t0, t0, t1\n");
+  emit("  bnez t0, .L.vector.%s.%d\n", fn, cnt);
+
+  if (vl->sum) {
+    genAddr(vl->sum);
+    emit("  mv a1, a0\n");
+    emit("  # v1的元素0即为和\n");
+    emit("  vmv.x.s a0, v1\n");
+    store(vl->sum->dataType);
+  }
+  emit("  # 跳过标量循环\n");
+  emit("  j .L.join.%s.%d\n", fn, cnt);
+  emit("\n# 循环%d的.L.scalar.%s.%d段标签\n", cnt, fn, cnt);
+  emit(".L.scalar.%s.%d:\n", fn, cnt);
+}
+
 static void genStmt(Node *node) {
   switch (node->nodeType) {
   case ND_RETURN:
-    printf("# 返回语句\n");
+    emit("# 返回语句\n");
+    if (InlineExit) {
+      genExpr(node->left);
+      emit("  # 跳转到内联函数的返回点.L.inline.%s.%d\n", CurrentFn->name, InlineExit);
+      emit("  j .L.inline.%s.%d\n", CurrentFn->name, InlineExit);
+      return;
+    }
+    if (OptLevel >= 1 && genTailCall(node->left))
+      return;
     genExpr(node->left);
+    // .L.return is behind, rather than jumping back to it, return from here
+    if (InColdBlock && !hasExitCode(CurrentFn)) {
+      epilogue();
+      emit("  # 返回a0值给系统调用\n");
+      emit("  ret\n");
+      return;
+    }
     // no condition jumps : jumps to .L.return segement
     // the way represent "j offset" is jal x0.
-    printf("  # 跳转到.L.return.%s段\n", CurrentFn->name);
-    printf("  j .L.return.%s\n", CurrentFn->name);
+    emit("  # 跳转到.L.return.%s段\n", CurrentFn->name);
+    emit("  j .L.return.%s\n", CurrentFn->name);
     return;
   case ND_EXPR_STMT:
     genExpr(node->left);
@@ -204,65 +972,123 @@ static void genStmt(Node *node) {
     return;
   case ND_IF: {
     int cnt = count();
-    printf("\n# =====分支语句%d==============\n", cnt);
-    printf("\n# Cond表达式%d\n", cnt);
+    emit("\n# =====分支语句%d==============\n", cnt);
+    genCount(node, PROF_IF);
+    if (genMinMax(node))
+      return;
+    emit("\n# Cond表达式%d\n", cnt);
     genExpr(node->cond);
 
+    // the cold branch is taken by a jump, the other one falls through
+    Node *cold = coldBranch(node);
+    if (cold) {
+      Node *hot = cold == node->then ? node->els : node->then;
+      emit("  # 分支%d很少执行, 放到函数末尾的.L.cold.%s.%d段\n", cnt,
+           CurrentFn->name, cnt);
+      emit("  %s a0, .L.cold.%s.%d\n", cold == node->then ? "bnez" : "beqz",
+           CurrentFn->name, cnt);
+      if (hot) {
+        emit("\n# %s语句%d\n", hot == node->then ? "Then" : "Else", cnt);
+        if (hot == node->then)
+          genCount(node, PROF_THEN);
+        genStmt(hot);
+      }
+      emit("\n# 分支%d的.L.end.%s.%d段标签\n", cnt, CurrentFn->name, cnt);
+      emit(".L.end.%s.%d:\n", CurrentFn->name, cnt);
+
+      ColdBlock *block = calloc(1, sizeof(ColdBlock));
+      *block = (ColdBlock){NULL, node, cold, cnt, StackDepth, InlineExit};
+      *ColdTail = block;
+      ColdTail = &block->next;
+      return;
+    }
+
+    // without an else statement, there is no else path to jump over
+    if (!node->els) {
+      emit("  # 若a0为0, 则跳转到分支%d的.L.end.%s.%d段\n", cnt, CurrentFn->name, cnt);
+      emit("  beqz a0, .L.end.%s.%d\n", CurrentFn->name, cnt);
+
+      emit("\n# Then语句%d\n", cnt);
+      genCount(node, PROF_THEN);
+      genStmt(node->then);
+
+      emit("\n# 分支%d的.L.end.%s.%d段标签\n", cnt, CurrentFn->name, cnt);
+      emit(".L.end.%s.%d:\n", CurrentFn->name, cnt);
+      return;
+    }
+
     // Check whether the result is 0. If it is 0, go to the else tag
-    printf("  # 若a0为0, 则跳转到分支%d的.L.else.%d段\n", cnt, cnt);
-    printf("  beqz a0, .L.else.%d\n", cnt);
+    emit("  # 若a0为0, 则跳转到分支%d的.L.else.%s.%d段\n", cnt, CurrentFn->name, cnt);
+    emit("  beqz a0, .L.else.%s.%d\n", CurrentFn->name, cnt);
 
-    printf("\n# Then语句%d\n", cnt);
+    emit("\n# Then语句%d\n", cnt);
+    genCount(node, PROF_THEN);
     genStmt(node->then);
 
-    printf("  # 跳转到分支%d的.L.end.%d段\n", cnt, cnt);
-    printf("  j .L.end.%d\n", cnt);
+    emit("  # 跳转到分支%d的.L.end.%s.%d段\n", cnt, CurrentFn->name, cnt);
+    emit("  j .L.end.%s.%d\n", CurrentFn->name, cnt);
 
-    // Generate tag with or without the else statement
-    printf("\n# Else语句%d\n", cnt);
-    printf("# 分支%d的.L.else.%d段标签\n", cnt, cnt);
-    printf(".L.else.%d:\n", cnt);
-    if (node->els)
-      genStmt(node->els);
+    emit("\n# Else语句%d\n", cnt);
+    emit("# 分支%d的.L.else.%s.%d段标签\n", cnt, CurrentFn->name, cnt);
+    emit(".L.else.%s.%d:\n", CurrentFn->name, cnt);
+    genStmt(node->els);
 
-    printf("\n# 分支%d的.L.end.%d段标签\n", cnt, cnt);
-    printf(".L.end.%d:\n", cnt);
+    emit("\n# 分支%d的.L.end.%s.%d段标签\n", cnt, CurrentFn->name, cnt);
+    emit(".L.end.%s.%d:\n", CurrentFn->name, cnt);
 
     return;
   }
   case ND_LOOP: { // for or while loop
     int cnt = count();
-    printf("\n# ===============循环语句%d===============\n", cnt);
+    emit("\n# ===============循环语句%d===============\n", cnt);
+    genCount(node, PROF_LOOP);
 
     if (node->init) {
-      printf("\n# Init语句%d\n", cnt);
+      emit("\n# Init语句%d\n", cnt);
       genStmt(node->init);
     }
 
-    printf("\n# 循环%d的.L.begin.%d段标签\n", cnt, cnt);
-    printf(".L.begin.%d:\n", cnt); // printf loop header tag
+    VecLoop *vl = node->vectorize ? vectorLoop(CurrentFn, node) : NULL;
+    if (vl)
+      genVectorLoop(node, vl, cnt);
 
-    printf("# Cond表达式%d\n", cnt);
+    // with the condition at the bottom, an iteration takes one branch back
+    // instead of a test at the top and a jump back (see genRotatedLoop)
+    if (OptLevel >= 1 && node->cond) {
+      genRotatedLoop(node, cnt);
+      if (vl) {
+        emit("\n# 循环%d的.L.join.%s.%d段标签\n", cnt, CurrentFn->name, cnt);
+        emit(".L.join.%s.%d:\n", CurrentFn->name, cnt);
+        free(vl);
+      }
+      return;
+    }
+
+    emit("\n# 循环%d的.L.begin.%s.%d段标签\n", cnt, CurrentFn->name, cnt);
+    emit(".L.begin.%s.%d:\n", CurrentFn->name, cnt); // printf loop header tag
+
+    emit("# Cond表达式%d\n", cnt);
     if (node->cond) {
       genExpr(node->cond);
-      printf("  # 若a0为0, 则跳转到循环%d的.L.end.%d段\n", cnt, cnt);
-      printf("  beqz a0, .L.end.%d\n", cnt); // Determine if the result is 0, if
-                                             // it is 0 then jump to the end tag
+      emit("  # 若a0为0, 则跳转到循环%d的.L.end.%s.%d段\n", cnt, CurrentFn->name, cnt);
+      // Determine if the result is 0, if it is 0 then jump to the end tag
+      emit("  beqz a0, .L.end.%s.%d\n", CurrentFn->name, cnt);
     }
 
-    printf("\n# Then语句%d\n", cnt);
+    emit("\n# Then语句%d\n", cnt);
+    genCount(node, PROF_BODY);
     genStmt(node->then); // Generate loop body statements
 
     if (node->inc) { // handling loop increment statements
-      printf("\n# Inc语句%d\n", cnt);
+      emit("\n# Inc语句%d\n", cnt);
       genExpr(node->inc);
     }
 
-    printf("  # 跳转到循环%d的.L.begin.%d段\n", cnt, cnt);
-    printf("  j .L.begin.%d\n", cnt);
+    emit("  # 跳转到循环%d的.L.begin.%s.%d段\n", cnt, CurrentFn->name, cnt);
+    emit("  j .L.begin.%s.%d\n", CurrentFn->name, cnt);
     // 输出循环尾部标签
-    printf("\n# 循环%d的.L.end.%d段标签\n", cnt, cnt);
-    printf(".L.end.%d:\n", cnt);
+    emit("\n# 循环%d的.L.end.%s.%d段标签\n", cnt, CurrentFn->name, cnt);
+    emit(".L.end.%s.%d:\n", CurrentFn->name, cnt);
 
     return;
   }
@@ -274,14 +1100,24 @@ static void genStmt(Node *node) {
 }
 
 // Calculate the offset from the variable's linked list
-static void assignLVarOffset(Function *prog) {
+void assignLVarOffset(Function *prog) {
   // Calculate the stack space used by its variables for each function
   for (Function *fn = prog; fn; fn = fn->next) {
-    int offSet = 0;
+    int offSet = InstrumentFunctions ? INSTR_FRAME : 0;
+
+    // parameters past the 8th stay where the caller put them, right above
+    // the saved ra and fp
+    int i = 0;
+    for (Obj *var = fn->params; var; var = var->next, i++)
+      if (i >= NARGREG)
+        var->offSet = 16 + (i - NARGREG) * 8;
 
-    // fetch all the variables
+    // fetch all the variables, each one aligned to its type
     for (Obj *var = fn->locals; var; var = var->next) {
-      offSet += 8;
+      if (var->offSet > 0)
+        continue;
+      offSet += var->dataType->size;
+      offSet = alighTo(offSet, var->dataType->align);
       var->offSet = -offSet;
     }
 
@@ -289,20 +1125,109 @@ static void assignLVarOffset(Function *prog) {
   }
 }
 
+// call dump(arg0, arg1, *size) of the runtime (see runtime/), keeping the
+// value main returns
+static void genDump(char *dump, char *arg0, char *arg1, char *size) {
+  emit("  # 调用%s写出计数\n", dump);
+  emit("  addi sp, sp, -16\n");
+  emit("  sd a0, 0(sp)\n");
+  emit("  la a0, %s\n", arg0);
+  emit("  la a1, %s\n", arg1);
+  emit("  la a2, %s\n", size);
+  emit("  ld a2, 0(a2)\n");
+  emit("  call %s\n", dump);
+  emit("  ld a0, 0(sp)\n");
+  emit("  addi sp, sp, 16\n");
+}
+
+// the counters, and for each one the location and kind it counts
+static void genCounters() {
+  emit("\n# ===============剖析计数器===============\n");
+  emit("  .data\n");
+  emit("  .align 3\n");
+  emit("__rvcc_profile_size:\n");
+  emit("  .dword %d\n", counterCnt());
+  emit("__rvcc_profile_counts:\n");
+  emit("  .zero %d\n", counterCnt() * 8);
+  emit("__rvcc_profile_keys:\n");
+  for (int i = 0; i < counterCnt(); i++)
+    emit("  .dword %ld\n", counterKey(i));
+  flushInsts();
+}
+
+// a row of counts for each function, see genInstrumentExit(), then the
+// names of the functions in the same order. A function of .init_array
+// registers them with runtime/instrument.c before main, which writes the
+// tables of all the files at exit.
+static void genInstrumentTable(Function *prog) {
+  int n = 0;
+  for (Function *fn = prog; fn; fn = fn->next)
+    n++;
+  emit("\n# ===============函数计时表===============\n");
+  emit("  .data\n");
+  emit("  .align 3\n");
+  emit(".L.instrument_table:\n");
+  for (Function *fn = prog; fn; fn = fn->next) {
+    emit(".L.instrument.%s:\n", fn->name);
+    emit("  .zero 40\n");
+  }
+  emit(".L.instrument_names:\n");
+  for (Function *fn = prog; fn; fn = fn->next)
+    emit("  .string \"%s\"\n", fn->name);
+
+  emit("  # 程序启动时向运行时登记本文件的计时表\n");
+  emit("  .section .init_array,\"aw\"\n");
+  emit("  .align 3\n");
+  emit("  .dword .L.instrument_init\n");
+  emit("  .text\n");
+  emit(".L.instrument_init:\n");
+  emit("  la a0, .L.instrument_table\n");
+  emit("  la a1, .L.instrument_names\n");
+  emit("  li a2, %d\n", n);
+  emit("  tail __rvcc_instrument_register\n");
+  flushInsts();
+}
+
 // traversing the AST tree to generate assembly code
 // code generation entry function, containing the base information of the code
 // block
 void codegen(Function *prog) {
   assignLVarOffset(prog);
+  // let the assembler take the c. forms
+  if (IsaC)
+    printf("  .option rvc\n");
+  // and the vector instructions
+  if (IsaV)
+    printf("  .option arch, +v\n");
+  if (IsaZba)
+    printf("  .option arch, +zba\n");
+  if (IsaZbb)
+    printf("  .option arch, +zbb\n");
 
   // Generate separate code for each function
   for (Function *fn = prog; fn; fn = fn->next) {
-    printf("  # 定义全局%s段\n", fn->name);
-    printf("  .global %s\n", fn->name);
-    printf("\n# ===============%s程序开始===============\n", fn->name);
-    printf("# %s段标签, 也是程序入口段\n", fn->name);
-    printf("%s:\n", fn->name);
+    if (fn->cachedAsm) {
+      printf("%s", fn->cachedAsm);
+      continue;
+    }
+
+    // the code of a function which goes into the cache is kept in text
+    char *text;
+    size_t size;
+    FILE *out = NULL;
+    if (fn->cacheKey) {
+      out = open_memstream(&text, &size);
+      setOutput(out);
+    }
+
+    emit("  # 定义全局%s段\n", fn->name);
+    emit("  .global %s\n", fn->name);
+    emit("\n# ===============%s程序开始===============\n", fn->name);
+    emit("# %s段标签, 也是程序入口段\n", fn->name);
+    emit("%s:\n", fn->name);
     CurrentFn = fn;
+    BlockCnt = 0;
+    CurrentFnAddrTaken = takesAddr(fn->body);
     // stack layout
     //-------------------------------// sp
     //              ra
@@ -313,51 +1238,77 @@ void codegen(Function *prog) {
     //-------------------------------// sp = sp-16-StackSize
     //     Expression evaluation
     //-------------------------------//
+    // with compressed instructions fp = sp-16-StackSize (see FrameBias)
+    FrameBias = IsaC ? fn->stackSize : 0;
 
     // prologue
 
     // 将ra寄存器压栈,保存ra的值
-    printf("  # 将ra寄存器压栈,保存ra的值, ra寄存器保存的是返回地址\n");
-    printf("  addi sp, sp, -16\n");
-    printf("  sd ra, 8(sp)\n");
-    printf("  # 将fp压栈, fp属于“被调用者保存”的寄存器, 需要恢复原值\n");
-    printf("  sd fp, 0(sp)\n");
-    // write sp to fp
-    printf("  # 将sp的值写入fp\n");
-    printf("  mv fp, sp\n");
-
-    // the offset is the size of the stack used by the actual variable
-    printf("  # sp腾出StackSize大小的栈空间\n");
-    printf("  addi sp, sp, -%d\n", fn->stackSize);
+    emit("  # 将ra寄存器压栈,保存ra的值, ra寄存器保存的是返回地址\n");
+    emit("  addi sp, sp, -16\n");
+    emit("  sd ra, 8(sp)\n");
+    emit("  # 将fp压栈, fp属于“被调用者保存”的寄存器, 需要恢复原值\n");
+    emit("  sd fp, 0(sp)\n");
+    if (FrameBias) {
+      emit("  # sp腾出StackSize大小的栈空间\n");
+      emit("  addi sp, sp, -%d\n", fn->stackSize);
+      emit("  # 将sp的值写入fp, fp指向栈帧底部\n");
+      emit("  mv fp, sp\n");
+    } else {
+      // write sp to fp
+      emit("  # 将sp的值写入fp\n");
+      emit("  mv fp, sp\n");
+
+      // the offset is the size of the stack used by the actual variable
+      emit("  # sp腾出StackSize大小的栈空间\n");
+      emit("  addi sp, sp, -%d\n", fn->stackSize);
+    }
+    if (InstrumentFunctions)
+      genInstrumentEntry();
+
+    // self tail calls jump here with the new arguments in the registers
+    emit("# %s的尾递归入口\n", fn->name);
+    emit(".L.tailcall.%s:\n", fn->name);
 
     int i = 0;
-    for (Obj *var = fn->params; var; var = var->next) {
-      printf("  # 将%s寄存器的值存入%s的栈地址\n", ArgReg[i], var->name);
-      printf("  sd %s, %d(fp)\n", ArgReg[i++], var->offSet);
+    for (Obj *var = fn->params; var && i < NARGREG; var = var->next) {
+      emit("  # 将%s寄存器的值存入%s的栈地址\n", ArgReg[i], var->name);
+      emit("  %s %s, %d(fp)\n", storeOp(var->dataType), ArgReg[i++],
+           frameOffset(var->offSet));
     }
 
-    printf("\n# ===============%s段主体===============\n", fn->name);
+    emit("\n# ===============%s段主体===============\n", fn->name);
     genStmt(fn->body);
     assert(StackDepth == 0);
 
     // epilogue
 
     // return segment tag
-    printf("\n# ===============%s段结束===============\n", fn->name);
-    printf("# return段标签\n");
-    printf(".L.return.%s:\n", fn->name);
-
-    // write fp to sp
-    printf("  # 将fp的值写回sp\n");
-    printf("  mv sp, fp\n");
-    // pop the stack of the earliest fp saved values and restore fp.
-    printf("  # 将最早fp保存的值弹栈, 恢复fp和sp\n");
-    printf("  ld fp, 0(sp)\n");
-    // 将ra寄存器弹栈,恢复ra的值
-    printf("  # 将ra寄存器弹栈,恢复ra的值\n");
-    printf("  ld ra, 8(sp)\n");
-    printf("  addi sp, sp, 16\n");
-    printf("  # 返回a0值给系统调用\n");
-    printf("  ret\n");
+    emit("\n# ===============%s段结束===============\n", fn->name);
+    emit("# return段标签\n");
+    emit(".L.return.%s:\n", fn->name);
+    if (InstrumentFunctions)
+      genInstrumentExit(fn);
+    if (ProfileGenerate && !strcmp(fn->name, "main"))
+      genDump("__rvcc_profile_dump", "__rvcc_profile_counts",
+              "__rvcc_profile_keys", "__rvcc_profile_size");
+    epilogue();
+    emit("  # 返回a0值给系统调用\n");
+    emit("  ret\n");
+    genColdBlocks();
+    flushInsts();
+
+    if (out) {
+      setOutput(NULL);
+      fclose(out);
+      printf("%s", text);
+      cacheStore(fn, text);
+      free(text);
+    }
   }
+
+  if (ProfileGenerate)
+    genCounters();
+  if (InstrumentFunctions)
+    genInstrumentTable(prog);
 }
\ No newline at end of file
@@ -0,0 +1,284 @@
+/*
+ *  Compressed instructions
+ *
+ *  With -march=rv64gc, the instructions of a function which have a 2 byte
+ *  form in the C extension are written with it, once the peephole
+ *  optimizer is done with them: "addi sp, sp, -8" becomes
+ *  "c.addi sp, -8". Most forms only take the registers x8 to x15 (fp, s1
+ *  and a0 to a5), which are the ones the stack machine uses, and small
+ *  immediates; codegen.c lays the frame out so that the offsets of the
+ *  locals are small and positive.
+ *
+ *  Jumps and branches to a label of the function are compressed when the
+ *  label is within reach. The distance is measured with every instruction
+ *  which is not compressed yet at its largest size, and compressing more
+ *  only makes the distances shorter.
+ */
+
+#include "rvcc.h"
+
+// emit compressed instructions, set by -march
+bool IsaC;
+
+static int CompressCnt;
+static int InstCnt;
+
+// the registers of the 3 bit register fields, x8 to x15
+static bool isCReg(char *reg) {
+  static char *regs[] = {"fp", "s0", "s1", "a0", "a1", "a2", "a3", "a4", "a5"};
+  for (int i = 0; i < sizeof(regs) / sizeof(*regs); i++)
+    if (!strcmp(reg, regs[i]))
+      return true;
+  return false;
+}
+
+static bool isZero(char *reg) { return !strcmp(reg, "zero"); }
+
+static bool isSp(char *reg) { return !strcmp(reg, "sp"); }
+
+// the value of an immediate operand, false if it is not a number
+static bool immValue(char *s, long *val) {
+  char *end;
+  *val = strtol(s, &end, 10);
+  return end != s && *end == '\0';
+}
+
+// whether val is a multiple of align in [min, max]
+static bool inRange(long val, long min, long max, int align) {
+  return min <= val && val <= max && val % align == 0;
+}
+
+// "off(base)" into its parts
+static bool memOperand(char *s, long *off, char *base) {
+  char *end;
+  *off = strtol(s, &end, 10);
+  if (end == s || *end != '(')
+    return false;
+  int len = strlen(end + 1);
+  if (len < 2 || len > 7 || end[len] != ')')
+    return false;
+  memcpy(base, end + 1, len - 1);
+  base[len - 1] = '\0';
+  return true;
+}
+
+static bool isOp(Inst *inst, char *op) { return !strcmp(inst->op, op); }
+
+static void respell(Inst *inst, char *op, int nargs, char *a0, char *a1,
+                    char *a2) {
+  char *args[] = {a0, a1, a2};
+  respellInst(inst, op, nargs, args);
+  CompressCnt++;
+}
+
+// the C form of an instruction which reads and writes its first operand,
+// for "op rd, rs1, x": rd must be rs1, or rs2 when op commutes
+static bool twoOperand(Inst *inst, char *cop, bool commutes, bool cregs) {
+  char *rd = inst->args[0], *rs1 = inst->args[1], *rs2 = inst->args[2];
+  if (strcmp(rd, rs1)) {
+    if (!commutes || strcmp(rd, rs2))
+      return false;
+    rs2 = rs1;
+  }
+  if (cregs ? !isCReg(rd) || !isCReg(rs2) : isZero(rd) || isZero(rs2))
+    return false;
+  respell(inst, cop, 2, rd, rs2, NULL);
+  return true;
+}
+
+// loads and stores, from sp or from a register in x8 to x15
+static bool compressMem(Inst *inst, int size) {
+  long off;
+  char base[8];
+  if (!memOperand(inst->args[1], &off, base))
+    return false;
+  char *reg = inst->args[0];
+  bool load = inst->op[0] == 'l';
+  char *name = inst->op;
+
+  if (isSp(base)) {
+    // ld, lw rd, uimm(sp) with rd not zero, sd, sw rs2, uimm(sp)
+    if ((load && isZero(reg)) || !inRange(off, 0, 64 * size - 1, size))
+      return false;
+    char *op = size == 8 ? (load ? "c.ldsp" : "c.sdsp")
+                         : (load ? "c.lwsp" : "c.swsp");
+    respell(inst, op, 2, reg, inst->args[1], NULL);
+    return true;
+  }
+
+  if (!isCReg(base) || !isCReg(reg) || !inRange(off, 0, 32 * size - 1, size))
+    return false;
+  char op[8];
+  snprintf(op, sizeof(op), "c.%s", name);
+  respell(inst, op, 2, reg, inst->args[1], NULL);
+  return true;
+}
+
+static bool compress(Inst *inst) {
+  long imm;
+  char *rd = inst->args[0];
+
+  if (isOp(inst, "ret")) {
+    respell(inst, "c.jr", 1, "ra", NULL, NULL);
+    return true;
+  }
+  if (isOp(inst, "nop")) {
+    respell(inst, "c.nop", 0, NULL, NULL, NULL);
+    return true;
+  }
+  if (isOp(inst, "li")) {
+    if (isZero(rd) || !immValue(inst->args[1], &imm) ||
+        !inRange(imm, -32, 31, 1))
+      return false;
+    respell(inst, "c.li", 2, rd, inst->args[1], NULL);
+    return true;
+  }
+  // sext.w rd, rd is addiw rd, rd, 0
+  if (isOp(inst, "sext.w")) {
+    if (isZero(rd) || strcmp(rd, inst->args[1]))
+      return false;
+    respell(inst, "c.addiw", 2, rd, "0", NULL);
+    return true;
+  }
+  if (isOp(inst, "mv")) {
+    if (isZero(rd) || isZero(inst->args[1]))
+      return false;
+    respell(inst, "c.mv", 2, rd, inst->args[1], NULL);
+    return true;
+  }
+
+  if (isOp(inst, "addi") || isOp(inst, "addiw") || isOp(inst, "andi") ||
+      isOp(inst, "slli") || isOp(inst, "srli") || isOp(inst, "srai")) {
+    char *rs1 = inst->args[1];
+    if (!immValue(inst->args[2], &imm))
+      return false;
+    // addi rd', sp, nzuimm
+    if (isOp(inst, "addi") && isCReg(rd) && isSp(rs1) &&
+        inRange(imm, 4, 1020, 4)) {
+      respell(inst, "c.addi4spn", 3, rd, "sp", inst->args[2]);
+      return true;
+    }
+    // addi rd, rs1, 0 is a move
+    if (isOp(inst, "addi") && imm == 0 && !isZero(rd) && !isZero(rs1)) {
+      respell(inst, "c.mv", 2, rd, rs1, NULL);
+      return true;
+    }
+    if (strcmp(rd, rs1) || isZero(rd))
+      return false;
+    // addi sp, sp, nzimm, in steps of 16 up to 512
+    if (isOp(inst, "addi") && isSp(rd) && !inRange(imm, -32, 31, 1) &&
+        imm && inRange(imm, -512, 496, 16)) {
+      respell(inst, "c.addi16sp", 2, "sp", inst->args[2], NULL);
+      return true;
+    }
+
+    bool ok;
+    if (isOp(inst, "addi"))
+      ok = imm && inRange(imm, -32, 31, 1);
+    else if (isOp(inst, "addiw"))
+      ok = inRange(imm, -32, 31, 1);
+    else if (isOp(inst, "andi"))
+      ok = isCReg(rd) && inRange(imm, -32, 31, 1);
+    else if (isOp(inst, "slli"))
+      ok = inRange(imm, 1, 63, 1);
+    else
+      ok = isCReg(rd) && inRange(imm, 1, 63, 1);
+    if (!ok)
+      return false;
+    char op[16];
+    snprintf(op, sizeof(op), "c.%s", inst->op);
+    respell(inst, op, 2, rd, inst->args[2], NULL);
+    return true;
+  }
+
+  if (isOp(inst, "add"))
+    return twoOperand(inst, "c.add", true, false);
+  if (isOp(inst, "addw"))
+    return twoOperand(inst, "c.addw", true, true);
+  if (isOp(inst, "and"))
+    return twoOperand(inst, "c.and", true, true);
+  if (isOp(inst, "or"))
+    return twoOperand(inst, "c.or", true, true);
+  if (isOp(inst, "xor"))
+    return twoOperand(inst, "c.xor", true, true);
+  if (isOp(inst, "sub"))
+    return twoOperand(inst, "c.sub", false, true);
+  if (isOp(inst, "subw"))
+    return twoOperand(inst, "c.subw", false, true);
+
+  if (isOp(inst, "ld") || isOp(inst, "sd"))
+    return compressMem(inst, 8);
+  if (isOp(inst, "lw") || isOp(inst, "sw"))
+    return compressMem(inst, 4);
+  return false;
+}
+
+// the most bytes the assembler may turn the line into
+static int maxSize(Inst *inst) {
+  long imm;
+  if (!inst->op)
+    return 0;
+  if (!strncmp(inst->op, "c.", 2))
+    return 2;
+  if (isOp(inst, "li") && immValue(inst->args[1], &imm) &&
+      !inRange(imm, -2048, 2047, 1))
+    return inRange(imm, INT32_MIN, INT32_MAX, 1) ? 8 : 32;
+  if (isOp(inst, "la") || isOp(inst, "call") || isOp(inst, "tail"))
+    return 8;
+  return 4;
+}
+
+// j, beqz and bnez to the labels of the function which are within reach
+static void compressJumps(Inst *insts) {
+  int n = 0;
+  for (Inst *inst = insts; inst; inst = inst->next)
+    n++;
+  // the address of each line, and the labels
+  int *addr = calloc(n, sizeof(int));
+  Inst **lines = calloc(n, sizeof(Inst *));
+  int i = 0, pc = 0;
+  for (Inst *inst = insts; inst; inst = inst->next, i++) {
+    lines[i] = inst;
+    addr[i] = pc;
+    pc += maxSize(inst);
+  }
+
+  for (i = 0; i < n; i++) {
+    Inst *inst = lines[i];
+    if (!inst->op)
+      continue;
+    bool jump = isOp(inst, "j");
+    if (!jump && !((isOp(inst, "beqz") || isOp(inst, "bnez")) &&
+                   isCReg(inst->args[0])))
+      continue;
+
+    char *label = inst->args[jump ? 0 : 1];
+    for (int j = 0; j < n; j++) {
+      if (!lines[j]->label || strcmp(lines[j]->label, label))
+        continue;
+      long dist = addr[j] - addr[i];
+      if (jump && inRange(dist, -2048, 2046, 2))
+        respell(inst, "c.j", 1, label, NULL, NULL);
+      else if (!jump && inRange(dist, -256, 254, 2))
+        respell(inst, isOp(inst, "beqz") ? "c.beqz" : "c.bnez", 2,
+                inst->args[0], label, NULL);
+      break;
+    }
+  }
+  free(addr);
+  free(lines);
+}
+
+void compressInsts(Inst *insts) {
+  for (Inst *inst = insts; inst; inst = inst->next) {
+    if (!inst->op)
+      continue;
+    InstCnt++;
+    compress(inst);
+  }
+  compressJumps(insts);
+}
+
+void reportCompress() {
+  fprintf(stderr, "compress: %d of %d instructions\n", CompressCnt, InstCnt);
+}
@@ -0,0 +1,497 @@
+/*
+ *  Local value numbering and common subexpression elimination
+ *
+ *  The expressions of a region, a run of statements without branches, are
+ *  numbered in the order codegen evaluates them: equal numbers mean equal
+ *  values. A variable gets a new number when it is assigned, a load
+ *  through a pointer when memory is stored to or a function is called.
+ *
+ *  If an expression is computed again, its first evaluation is turned into
+ *  tmp = expr, and the others read tmp. The largest expressions go first,
+ *  so the parts of an expression that is not evaluated anymore are not
+ *  counted as repeats.
+ */
+
+#include "rvcc.h"
+
+// number of expressions replaced by a read of an earlier result
+static int CseCnt;
+
+// whether the function takes the address of a local. Memory may then hold
+// any local, see the *(&x+1) tests.
+static bool AddrTaken;
+static Function *CurrentFn;
+
+// the value of an expression, as a function of the values of its operands
+typedef struct {
+  NodeType type;
+  Type *dataType; // tells pointer arithmetic from integer arithmetic
+  int val;
+  Obj *var;
+  int ver;   // version of the variable, or of memory for ND_DEREF
+  int left;  // value numbers of the operands
+  int right;
+  int chain; // next entry in the same hash bucket
+} Value;
+
+// an expression that may be replaced
+typedef struct {
+  Node *node;
+  int vn;
+  int size;  // number of nodes
+  int start; // the occurrences under node are at [start, this one)
+  bool dropped;
+} Occurrence;
+
+// versions of the variables written in the region
+typedef struct {
+  Obj *var;
+  int ver;
+} VarVersion;
+
+typedef struct {
+  Value *values;
+  int valueCnt;
+  int *buckets;
+  int bucketCnt;
+
+  Occurrence *occs;
+  int occCnt;
+
+  VarVersion *vers;
+  int verCnt;
+  int mem;   // version of memory
+  int epoch; // changes when any variable may have been written
+} Region;
+
+static void initRegion(Region *r) {
+  memset(r, 0, sizeof(Region));
+  r->bucketCnt = 64;
+  r->buckets = malloc(sizeof(int) * r->bucketCnt);
+  for (int i = 0; i < r->bucketCnt; i++)
+    r->buckets[i] = -1;
+}
+
+static void freeRegion(Region *r) {
+  free(r->values);
+  free(r->buckets);
+  free(r->occs);
+  free(r->vers);
+}
+
+static int varVersion(Region *r, Obj *var) {
+  for (int i = 0; i < r->verCnt; i++)
+    if (r->vers[i].var == var)
+      return r->vers[i].ver;
+  return 0;
+}
+
+static void killVar(Region *r, Obj *var) {
+  for (int i = 0; i < r->verCnt; i++) {
+    if (r->vers[i].var == var) {
+      r->vers[i].ver++;
+      return;
+    }
+  }
+  r->vers = realloc(r->vers, sizeof(VarVersion) * (r->verCnt + 1));
+  r->vers[r->verCnt++] = (VarVersion){var, 1};
+}
+
+// a store through a pointer or a call
+static void killMemory(Region *r) {
+  r->mem++;
+  if (AddrTaken)
+    r->epoch++;
+}
+
+static unsigned hashValue(Value *v) {
+  unsigned h = v->type;
+  h = h * 31 + v->val;
+  h = h * 31 + (unsigned)(uintptr_t)v->var;
+  h = h * 31 + (unsigned)(uintptr_t)v->dataType;
+  h = h * 31 + v->ver;
+  h = h * 31 + v->left;
+  h = h * 31 + v->right;
+  return h;
+}
+
+static bool equalValue(Value *a, Value *b) {
+  return a->type == b->type && a->dataType == b->dataType &&
+         a->val == b->val && a->var == b->var &&
+         a->ver == b->ver && a->left == b->left && a->right == b->right;
+}
+
+static void rehash(Region *r) {
+  free(r->buckets);
+  r->bucketCnt *= 2;
+  r->buckets = malloc(sizeof(int) * r->bucketCnt);
+  for (int i = 0; i < r->bucketCnt; i++)
+    r->buckets[i] = -1;
+  for (int i = 0; i < r->valueCnt; i++) {
+    unsigned b = hashValue(&r->values[i]) % r->bucketCnt;
+    r->values[i].chain = r->buckets[b];
+    r->buckets[b] = i;
+  }
+}
+
+// the number of the value, a new one if it has not been seen
+static int valueNumber(Region *r, Value v) {
+  unsigned b = hashValue(&v) % r->bucketCnt;
+  for (int i = r->buckets[b]; i != -1; i = r->values[i].chain)
+    if (equalValue(&r->values[i], &v))
+      return i;
+
+  if (r->valueCnt >= r->bucketCnt * 2) {
+    rehash(r);
+    b = hashValue(&v) % r->bucketCnt;
+  }
+  r->values = realloc(r->values, sizeof(Value) * (r->valueCnt + 1));
+  v.chain = r->buckets[b];
+  r->values[r->valueCnt] = v;
+  r->buckets[b] = r->valueCnt;
+  return r->valueCnt++;
+}
+
+static void addOccurrence(Region *r, Node *node, int vn, int size,
+                          int start) {
+  r->occs = realloc(r->occs, sizeof(Occurrence) * (r->occCnt + 1));
+  r->occs[r->occCnt++] = (Occurrence){node, vn, size, start, false};
+}
+
+static void cseStmt(Region *r, Node *node);
+static void flushRegion(Region *r);
+
+// as codegen's isSimple(), arguments that are loaded after the others
+static bool isSimpleArg(Node *node) {
+  return node->nodeType == ND_NUM || node->nodeType == ND_VAR ||
+         (node->nodeType == ND_ADDR && node->left->nodeType == ND_VAR);
+}
+
+// the value number of a binary node from the ones of its operands, -1 if
+// one of them has side effects
+static int cseBinary(Region *r, Node *node, int left, int right) {
+  if (left == -1 || right == -1)
+    return -1;
+  // a + b and b + a are the same value
+  if ((node->nodeType == ND_ADD || node->nodeType == ND_MUL ||
+       node->nodeType == ND_EQ || node->nodeType == ND_NE) &&
+      left > right) {
+    int tmp = left;
+    left = right;
+    right = tmp;
+  }
+  Value v = {node->nodeType, node->dataType};
+  v.left = left;
+  v.right = right;
+  return valueNumber(r, v);
+}
+
+// the right operand of a binary node, numbered before the left one
+typedef struct {
+  int vn;
+  int size;
+  int start; // where the occurrences of the binary node start
+} Operand;
+
+// number the expression, returns its value number or -1 if it has side
+// effects. *size gets the number of nodes.
+static int cseExpr(Region *r, Node *node, int *size) {
+  int start = r->occCnt;
+  int lsize = 0, rsize = 0;
+  int vn = -1;
+  Value v = {node->nodeType};
+
+  switch (node->nodeType) {
+  case ND_NUM:
+    v.val = node->val;
+    *size = 1;
+    return valueNumber(r, v);
+  case ND_VAR:
+    v.var = node->var;
+    v.ver = varVersion(r, node->var);
+    // a store to memory may have changed any variable
+    if (AddrTaken)
+      v.left = r->epoch;
+    *size = 1;
+    return valueNumber(r, v);
+  case ND_ADDR:
+    if (node->left->nodeType == ND_VAR) {
+      v.var = node->left->var;
+      *size = 2;
+      return valueNumber(r, v);
+    }
+    // &*p
+    cseExpr(r, node->left->left, &lsize);
+    *size = lsize + 2;
+    return -1;
+  case ND_ASSIGN:
+    // the address is computed first, then the value
+    if (node->left->nodeType == ND_DEREF)
+      cseExpr(r, node->left->left, &lsize);
+    cseExpr(r, node->right, &rsize);
+    if (node->left->nodeType == ND_VAR) {
+      killVar(r, node->left->var);
+      if (AddrTaken)
+        r->mem++;
+    } else {
+      killMemory(r);
+    }
+    *size = lsize + rsize + 2;
+    return -1;
+  case ND_FUNCALL: {
+    // in the order of genArgs(): arguments passed on the stack from the
+    // last one, then the other ones which are not simple
+    int nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+      nargs++;
+    Node **args = calloc(nargs, sizeof(Node *));
+    int i = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+      args[i++] = arg;
+
+    *size = 1;
+    for (i = nargs - 1; i >= NARGREG; i--) {
+      cseExpr(r, args[i], &lsize);
+      *size += lsize;
+    }
+    for (i = 0; i < nargs && i < NARGREG; i++) {
+      if (isSimpleArg(args[i]))
+        continue;
+      cseExpr(r, args[i], &lsize);
+      *size += lsize;
+    }
+    free(args);
+    killMemory(r);
+    return -1;
+  }
+  case ND_INLINE: {
+    // the inlined body has branches, it is a region of its own
+    Region inner;
+    initRegion(&inner);
+    for (Node *n = node->body; n; n = n->next)
+      cseStmt(&inner, n);
+    flushRegion(&inner);
+    freeRegion(&inner);
+
+    r->mem++;
+    r->epoch++;
+    for (Obj *var = CurrentFn->locals; var; var = var->next)
+      killVar(r, var);
+    *size = countNodes(node);
+    return -1;
+  }
+  case ND_NEG:
+    v.left = cseExpr(r, node->left, &lsize);
+    if (v.left != -1)
+      vn = valueNumber(r, v);
+    break;
+  case ND_DEREF:
+    v.left = cseExpr(r, node->left, &lsize);
+    v.ver = r->mem;
+    if (v.left != -1)
+      vn = valueNumber(r, v);
+    break;
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE: {
+    // the right operand is evaluated first, a chain like a+b+c+... in a
+    // loop (see node.c). The occurrences are added in the order of the
+    // recursion: the ones of the operands, then the chain bottom up.
+    Node **chain;
+    int cnt = leftChain(node, isBinary, &chain);
+    Operand *right = calloc(cnt, sizeof(Operand));
+    for (int i = 0; i < cnt; i++) {
+      right[i].start = r->occCnt;
+      right[i].vn = cseExpr(r, chain[i]->right, &right[i].size);
+    }
+    vn = cseExpr(r, chain[cnt - 1]->left, size);
+    for (int i = cnt - 1; i >= 0; i--) {
+      vn = cseBinary(r, chain[i], vn, right[i].vn);
+      *size += right[i].size + 1;
+      if (vn != -1)
+        addOccurrence(r, chain[i], vn, *size, right[i].start);
+    }
+    free(right);
+    free(chain);
+    return vn;
+  }
+  default:
+    *size = countNodes(node);
+    return -1;
+  }
+
+  *size = lsize + rsize + 1;
+  if (vn != -1)
+    addOccurrence(r, node, vn, *size, start);
+  return vn;
+}
+
+static int compareOccurrence(const void *a, const void *b) {
+  const Occurrence *x = *(Occurrence **)a;
+  const Occurrence *y = *(Occurrence **)b;
+  if (x->size != y->size)
+    return y->size - x->size;
+  if (x->vn != y->vn)
+    return x->vn - y->vn;
+  return x < y ? -1 : 1;
+}
+
+// node = tmp
+static void readTmp(Node *node, Obj *tmp) {
+  Node *next = node->next;
+  Token *tok = node->tok;
+  memset(node, 0, sizeof(Node));
+  node->nodeType = ND_VAR;
+  node->var = tmp;
+  node->dataType = tmp->dataType;
+  node->tok = tok;
+  node->next = next;
+}
+
+// node = (tmp = node)
+static void assignTmp(Node *node, Obj *tmp) {
+  Node *expr = calloc(1, sizeof(Node));
+  *expr = *node;
+  expr->next = NULL;
+
+  Node *var = calloc(1, sizeof(Node));
+  var->nodeType = ND_VAR;
+  var->var = tmp;
+  var->dataType = tmp->dataType;
+  var->tok = node->tok;
+
+  node->nodeType = ND_ASSIGN;
+  node->left = var;
+  node->right = expr;
+  node->body = node->args = node->cond = node->then = node->els = NULL;
+  node->init = node->inc = NULL;
+}
+
+// replace the repeated expressions of the region, and start a new one
+static void flushRegion(Region *r) {
+  int n = r->occCnt;
+  Occurrence **sorted = calloc(n, sizeof(Occurrence *));
+  for (int i = 0; i < n; i++)
+    sorted[i] = &r->occs[i];
+  qsort(sorted, n, sizeof(Occurrence *), compareOccurrence);
+
+  // the first evaluation of each repeated value and the repeats, largest
+  // values first. The expressions under a repeat are not evaluated anymore.
+  Occurrence **firsts = calloc(n, sizeof(Occurrence *));
+  Occurrence **repeats = calloc(n, sizeof(Occurrence *));
+  int firstCnt = 0, repeatCnt = 0;
+  for (int i = 0, j; i < n; i = j) {
+    int live = 0;
+    for (j = i; j < n && sorted[j]->vn == sorted[i]->vn; j++)
+      live += !sorted[j]->dropped;
+    if (live < 2)
+      continue;
+
+    Occurrence *first = NULL;
+    for (int k = i; k < j; k++) {
+      Occurrence *o = sorted[k];
+      if (o->dropped)
+        continue;
+      if (!first) {
+        first = firsts[firstCnt++] = o;
+        continue;
+      }
+      repeats[repeatCnt++] = o;
+      for (int l = o->start; l < o - r->occs; l++)
+        r->occs[l].dropped = true;
+    }
+  }
+
+  // a tmp for each value, then the nodes are rewritten
+  Obj **tmps = calloc(r->valueCnt, sizeof(Obj *));
+  for (int i = 0; i < firstCnt; i++) {
+    Obj *tmp = calloc(1, sizeof(Obj));
+    tmp->name = "cse.tmp";
+    tmp->dataType = firsts[i]->node->dataType;
+    tmp->next = CurrentFn->locals;
+    CurrentFn->locals = tmp;
+    tmps[firsts[i]->vn] = tmp;
+  }
+  for (int i = 0; i < repeatCnt; i++)
+    if (!repeats[i]->dropped) {
+      readTmp(repeats[i]->node, tmps[repeats[i]->vn]);
+      CseCnt++;
+    }
+  for (int i = 0; i < firstCnt; i++)
+    assignTmp(firsts[i]->node, tmps[firsts[i]->vn]);
+
+  free(sorted);
+  free(firsts);
+  free(repeats);
+  free(tmps);
+
+  freeRegion(r);
+  initRegion(r);
+}
+
+// statements without branches extend the region, a branch ends it
+static void cseStmt(Region *r, Node *node) {
+  int size;
+  switch (node->nodeType) {
+  case ND_EXPR_STMT:
+    cseExpr(r, node->left, &size);
+    return;
+  case ND_RETURN:
+    cseExpr(r, node->left, &size);
+    flushRegion(r);
+    return;
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      cseStmt(r, n);
+    return;
+  case ND_IF:
+    cseExpr(r, node->cond, &size);
+    flushRegion(r);
+    cseStmt(r, node->then);
+    flushRegion(r);
+    if (node->els) {
+      cseStmt(r, node->els);
+      flushRegion(r);
+    }
+    return;
+  case ND_LOOP:
+    // cond, then and inc run one after the other in each iteration
+    if (node->init)
+      cseStmt(r, node->init);
+    flushRegion(r);
+    // a tmp would hide the arrays of a loop which runs on vectors
+    if (node->vectorize)
+      return;
+    if (node->cond)
+      cseExpr(r, node->cond, &size);
+    cseStmt(r, node->then);
+    if (node->inc)
+      cseExpr(r, node->inc, &size);
+    flushRegion(r);
+    return;
+  default:
+    return;
+  }
+}
+
+void eliminateCommonSubexprs(Function *prog) {
+  for (Function *fn = prog; fn; fn = fn->next) {
+    CurrentFn = fn;
+    AddrTaken = takesAddr(fn->body);
+
+    Region r;
+    initRegion(&r);
+    cseStmt(&r, fn->body);
+    flushRegion(&r);
+    freeRegion(&r);
+  }
+}
+
+void reportCse() {
+  fprintf(stderr, "cse: %d expressions eliminated\n", CseCnt);
+}
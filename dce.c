@@ -0,0 +1,179 @@
+/*
+ *  Dead code elimination
+ *
+ *  With the control flow graph of a function (see cfg.c):
+ *
+ *  - statements in blocks which can not be reached from the entry, such as
+ *    the ones after a return, are removed;
+ *  - an assignment to a local which is not live after it is replaced by its
+ *    value, or dropped with the statement when the value has no side
+ *    effects. Removing one store may make others dead, so liveness is
+ *    computed again until nothing changes;
+ *  - locals which are not used anymore give their stack slot back.
+ */
+
+#include "rvcc.h"
+
+// number of statements, stores and locals removed
+static int UnreachableCnt;
+static int DeadStoreCnt;
+static int UnusedCnt;
+
+// turn the statement into an empty block
+static void removeStmt(Node *node) {
+  Node *next = node->next;
+  Token *tok = node->tok;
+  memset(node, 0, sizeof(Node));
+  node->nodeType = ND_BLOCK;
+  node->tok = tok;
+  node->next = next;
+}
+
+static void removeUnreachable(CFG *cfg) {
+  for (int i = 0; i < cfg->blockCnt; i++) {
+    BasicBlock *bb = cfg->blocks[i];
+    if (bb->reachable)
+      continue;
+
+    for (int j = 0; j < bb->itemCnt; j++) {
+      Item *item = &bb->items[j];
+      // the if or loop of the condition goes as a whole
+      if (item->kind == IT_INC) {
+        item->stmt->inc = NULL;
+      } else {
+        if (item->stmt->nodeType == ND_BLOCK && !item->stmt->body)
+          continue;
+        removeStmt(item->stmt);
+      }
+      UnreachableCnt++;
+    }
+  }
+}
+
+// drop the assignment of the item, keeping what its value is needed for
+static void removeStore(Item *item) {
+  Node *value = (*item->expr)->right;
+  DeadStoreCnt++;
+
+  if (!isPureExpr(value) || item->kind == IT_COND ||
+      item->stmt->nodeType == ND_RETURN) {
+    *item->expr = value;
+    return;
+  }
+  if (item->kind == IT_INC)
+    item->stmt->inc = NULL;
+  else
+    removeStmt(item->stmt);
+}
+
+// walk the items of each block backwards from the locals live at its end,
+// returns whether a store has been removed
+static bool removeDeadStores(CFG *cfg) {
+  bool changed = false;
+  BitSet live = newBitSet(cfg->varCnt);
+  BitSet use = newBitSet(cfg->varCnt);
+  BitSet def = newBitSet(cfg->varCnt);
+  int words = (cfg->varCnt + 63) / 64;
+
+  for (int i = 0; i < cfg->blockCnt; i++) {
+    BasicBlock *bb = cfg->blocks[i];
+    if (!bb->reachable)
+      continue;
+    memcpy(live, bb->liveOut, words * sizeof(uint64_t));
+
+    for (int j = bb->itemCnt - 1; j >= 0; j--) {
+      Item *item = &bb->items[j];
+      Node *expr = *item->expr;
+      if (!expr)
+        continue;
+
+      if (expr->nodeType == ND_ASSIGN && expr->left->nodeType == ND_VAR &&
+          cfg->tracked[expr->left->var->idx] &&
+          !inBitSet(live, expr->left->var->idx)) {
+        removeStore(item);
+        changed = true;
+        // the statement may be gone
+        expr = *item->expr;
+        if (!expr)
+          continue;
+      }
+
+      // live = use | (live & ~def)
+      memset(use, 0, words * sizeof(uint64_t));
+      memset(def, 0, words * sizeof(uint64_t));
+      exprUseDef(cfg, expr, use, def);
+      for (int k = 0; k < words; k++)
+        live[k] = use[k] | (live[k] & ~def[k]);
+    }
+  }
+
+  free(live);
+  free(use);
+  free(def);
+  return changed;
+}
+
+// whether the tree reads or writes var
+static bool usesVar(Node *node, Obj *var) {
+  // down the left operands in a loop, see node.c
+  for (; node; node = node->left) {
+    if (node->nodeType == ND_VAR && node->var == var)
+      return true;
+    if (usesVar(node->right, var) || usesVar(node->cond, var) ||
+        usesVar(node->then, var) || usesVar(node->els, var) ||
+        usesVar(node->init, var) || usesVar(node->inc, var))
+      return true;
+    for (Node *n = node->body; n; n = n->next)
+      if (usesVar(n, var))
+        return true;
+    for (Node *n = node->args; n; n = n->next)
+      if (usesVar(n, var))
+        return true;
+  }
+  return false;
+}
+
+static bool isParam(Function *fn, Obj *var) {
+  for (Obj *param = fn->params; param; param = param->next)
+    if (param == var)
+      return true;
+  return false;
+}
+
+static void removeUnusedLocals(Function *fn) {
+  Obj head = {};
+  Obj *cur = &head;
+  for (Obj *var = fn->locals; var; var = var->next) {
+    if (!isParam(fn, var) && !usesVar(fn->body, var)) {
+      UnusedCnt++;
+      continue;
+    }
+    cur = cur->next = var;
+  }
+  cur->next = NULL;
+  fn->locals = head.next;
+}
+
+void eliminateDeadCode(Function *prog) {
+  for (Function *fn = prog; fn; fn = fn->next) {
+    CFG *cfg = buildCFG(fn);
+    removeUnreachable(cfg);
+    freeCFG(cfg);
+
+    for (bool changed = true; changed;) {
+      cfg = buildCFG(fn);
+      computeLiveness(cfg);
+      changed = removeDeadStores(cfg);
+      freeCFG(cfg);
+    }
+
+    // the locals around the one a pointer points to may be read
+    if (!takesAddr(fn->body))
+      removeUnusedLocals(fn);
+  }
+}
+
+void reportDeadCode() {
+  fprintf(stderr, "dce: %d unreachable, %d dead stores, %d unused locals\n",
+          UnreachableCnt, DeadStoreCnt, UnusedCnt);
+}
@@ -0,0 +1,206 @@
+/*
+ *  Emission of assembly
+ *
+ *  With optimization or compressed instructions on, the lines of a function
+ *  are kept in a list until the function is complete, so that they can
+ *  still be rewritten (by the peephole optimizer and compressInsts()) before
+ *  they are printed.
+ */
+
+#include "rvcc.h"
+
+// the lines of the current function, Head is a sentinel
+static Inst Head;
+static Inst *Tail = &Head;
+
+// where the lines are printed, NULL for stdout
+static FILE *Out;
+
+void setOutput(FILE *out) { Out = out; }
+
+static FILE *output() { return Out ? Out : stdout; }
+
+// whether lines are kept until flushInsts(), or printed right away
+static bool isBuffered() { return OptLevel >= 1 || IsaC; }
+
+// split "a0, 0(sp)" into operands. The third one takes the rest of the
+// line, "e32, m1, ta, ma" of vsetvli.
+static void parseArgs(Inst *inst, char *p) {
+  while (*p && inst->nargs < 3) {
+    while (isspace(*p))
+      p++;
+    char *end = inst->nargs < 2 ? strchr(p, ',') : NULL;
+    if (!end)
+      end = p + strlen(p);
+    char *last = end;
+    while (last > p && isspace(last[-1]))
+      last--;
+    inst->args[inst->nargs++] = strndup(p, last - p);
+    p = *end ? end + 1 : end;
+  }
+}
+
+// classify a line of assembly
+static Inst *newInst(char *line) {
+  Inst *inst = calloc(1, sizeof(Inst));
+  inst->text = line;
+
+  char *p = line;
+  while (isspace(*p))
+    p++;
+  // blank lines and comments
+  if (*p == '\0' || *p == '#')
+    return inst;
+
+  int len = strlen(line);
+  if (p == line && line[len - 1] == ':') {
+    inst->label = strndup(line, len - 1);
+    return inst;
+  }
+
+  // directives such as .global
+  if (*p == '.')
+    return inst;
+
+  char *end = p;
+  while (*end && !isspace(*end))
+    end++;
+  inst->op = strndup(p, end - p);
+  parseArgs(inst, end);
+  return inst;
+}
+
+static void append(char *line) {
+  Inst *inst = newInst(line);
+  inst->prev = Tail;
+  Tail->next = inst;
+  Tail = inst;
+}
+
+// emit formatted assembly, which may contain several lines
+void emit(char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  if (!isBuffered()) {
+    vfprintf(output(), fmt, va);
+    va_end(va);
+    return;
+  }
+
+  char *buf;
+  size_t size;
+  FILE *out = open_memstream(&buf, &size);
+  vfprintf(out, fmt, va);
+  fclose(out);
+  va_end(va);
+
+  char *p = buf;
+  for (char *nl = strchr(p, '\n'); nl; nl = strchr(p, '\n')) {
+    append(strndup(p, nl - p));
+    p = nl + 1;
+  }
+  if (*p)
+    append(strdup(p));
+  free(buf);
+}
+
+static void freeInst(Inst *inst) {
+  free(inst->text);
+  free(inst->op);
+  free(inst->label);
+  for (int i = 0; i < inst->nargs; i++)
+    free(inst->args[i]);
+  free(inst);
+}
+
+// comments right before an instruction describe it, they go with it
+static void dropComments(Inst *inst) {
+  while (inst->prev != &Head && !inst->prev->op && !inst->prev->label &&
+         inst->prev->text && !strncmp(inst->prev->text, "  #", 3)) {
+    Inst *comment = inst->prev;
+    comment->prev->next = inst;
+    inst->prev = comment->prev;
+    if (Tail == comment)
+      Tail = inst;
+    freeInst(comment);
+  }
+}
+
+// replace an instruction with "op args...", its arguments are copied
+void rewriteInst(Inst *inst, char *op, int nargs, char **args) {
+  dropComments(inst);
+  respellInst(inst, op, nargs, args);
+}
+
+// write an instruction in another way, which does the same, so the comments
+// describing it stay
+void respellInst(Inst *inst, char *op, int nargs, char **args) {
+  // the new operands may be the old ones, copy them before freeing
+  char *newOp = strdup(op);
+  char *newArgs[3];
+  for (int i = 0; i < nargs; i++)
+    newArgs[i] = strdup(args[i]);
+
+  for (int i = 0; i < inst->nargs; i++)
+    free(inst->args[i]);
+  free(inst->op);
+  free(inst->text);
+
+  inst->op = newOp;
+  inst->nargs = nargs;
+  for (int i = 0; i < nargs; i++)
+    inst->args[i] = newArgs[i];
+
+  char *buf;
+  size_t size;
+  FILE *out = open_memstream(&buf, &size);
+  fprintf(out, "  %s", inst->op);
+  for (int i = 0; i < nargs; i++)
+    fprintf(out, "%s%s", i ? ", " : " ", inst->args[i]);
+  fclose(out);
+  inst->text = buf;
+}
+
+// removed instructions, freed when the list is flushed
+static Inst *Removed;
+
+// unlink an instruction from the list. It is not freed until the list is
+// flushed, and its next pointer is left as it is, so a walk over the list
+// can continue from it.
+void removeInst(Inst *inst) {
+  dropComments(inst);
+  inst->prev->next = inst->next;
+  if (inst->next)
+    inst->next->prev = inst->prev;
+  if (Tail == inst)
+    Tail = inst->prev;
+  inst->removed = true;
+  inst->link = Removed;
+  Removed = inst;
+}
+
+// optimize and print the lines emitted so far
+void flushInsts() {
+  if (!isBuffered())
+    return;
+
+  if (OptLevel >= 1)
+    peephole(Head.next);
+  if (IsaC)
+    compressInsts(Head.next);
+
+  for (Inst *inst = Head.next; inst; inst = inst->next)
+    fprintf(output(), "%s\n", inst->text);
+
+  for (Inst *inst = Head.next, *next; inst; inst = next) {
+    next = inst->next;
+    freeInst(inst);
+  }
+  for (Inst *inst = Removed, *next; inst; inst = next) {
+    next = inst->link;
+    freeInst(inst);
+  }
+  Head.next = NULL;
+  Tail = &Head;
+  Removed = NULL;
+}
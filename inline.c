@@ -0,0 +1,164 @@
+/*
+ *  Function inlining
+ *
+ *  A call to a small function defined in the same program is replaced by an
+ *  ND_INLINE node: the arguments are assigned to copies of the callee's
+ *  parameters, which live in the caller's frame, followed by a copy of the
+ *  callee's body. Every return in that body jumps to the end of the ND_INLINE
+ *  node (the join point) with the value in a0, just like a call would.
+ */
+
+#include "rvcc.h"
+
+// functions of at most this many nodes are inlined
+int InlineLimit = 20;
+
+static Function *Prog;
+
+// functions whose calls have been inlined, or are being inlined
+static Function **Visited;
+static int VisitedCnt;
+
+static Function *findFunction(char *name) {
+  for (Function *fn = Prog; fn; fn = fn->next)
+    if (!strcmp(fn->name, name))
+      return fn;
+  return NULL;
+}
+
+static bool shouldInline(Function *caller, Function *callee, Node *call) {
+  // recursion is left to tail call optimization
+  if (!callee || callee == caller)
+    return false;
+
+  int nargs = 0, nparams = 0;
+  for (Node *arg = call->args; arg; arg = arg->next)
+    nargs++;
+  for (Obj *param = callee->params; param; param = param->next)
+    nparams++;
+  if (nargs != nparams)
+    return false;
+
+  // with a profile, a call which never ran is not worth the code, and one
+  // of the hottest is worth more
+  long calls = profileCount(call, PROF_CALL);
+  if (calls == 0)
+    return false;
+  int limit = InlineLimit;
+  if (calls > 0 && calls * 8 >= maxProfileCount(PROF_CALL))
+    limit *= 4;
+  return countNodes(callee->body) <= limit;
+}
+
+static Node *newInlineNode(NodeType type, Token *tok) {
+  Node *node = calloc(1, sizeof(Node));
+  node->nodeType = type;
+  node->tok = tok;
+  return node;
+}
+
+// replace the call with the body of callee
+static void inlineCall(Function *caller, Function *callee, Node *call) {
+  // every local of callee gets a copy in the frame of caller
+  int nvars = 0;
+  for (Obj *var = callee->locals; var; var = var->next)
+    nvars++;
+
+  Obj **from = calloc(nvars, sizeof(Obj *));
+  Obj **to = calloc(nvars, sizeof(Obj *));
+  int i = 0;
+  for (Obj *var = callee->locals; var; var = var->next, i++) {
+    from[i] = var;
+    to[i] = calloc(1, sizeof(Obj));
+    to[i]->name = var->name;
+    to[i]->dataType = var->dataType;
+    to[i]->next = caller->locals;
+    caller->locals = to[i];
+  }
+
+  // param = arg, in the order of the arguments
+  Node head = {};
+  Node *cur = &head;
+  Node *arg = call->args;
+  for (Obj *param = callee->params; param; param = param->next) {
+    Node *next = arg->next;
+    arg->next = NULL;
+
+    Node *var = newInlineNode(ND_VAR, arg->tok);
+    for (i = 0; i < nvars; i++)
+      if (from[i] == param)
+        var->var = to[i];
+    var->dataType = param->dataType;
+
+    Node *assign = newInlineNode(ND_ASSIGN, arg->tok);
+    assign->left = var;
+    assign->right = arg;
+    assign->dataType = param->dataType;
+
+    cur = cur->next = newInlineNode(ND_EXPR_STMT, arg->tok);
+    cur->left = assign;
+    arg = next;
+  }
+  cur->next = copyNode(callee->body, from, to, nvars);
+
+  call->nodeType = ND_INLINE;
+  call->args = NULL;
+  call->body = head.next;
+  free(from);
+  free(to);
+}
+
+static void inlineFunction(Function *fn);
+
+// inline the calls under node, callees are handled first so that what gets
+// copied into fn has its own calls inlined already
+static void inlineCalls(Function *fn, Node *node) {
+  // the left operands come first, the nodes down them are visited bottom up
+  // in a loop (see node.c)
+  Node **chain;
+  int cnt = leftChain(node, NULL, &chain);
+  for (int i = cnt - 1; i >= 0; i--) {
+    node = chain[i];
+    inlineCalls(fn, node->right);
+    inlineCalls(fn, node->cond);
+    inlineCalls(fn, node->then);
+    inlineCalls(fn, node->els);
+    inlineCalls(fn, node->init);
+    inlineCalls(fn, node->inc);
+    for (Node *n = node->body; n; n = n->next)
+      inlineCalls(fn, n);
+    for (Node *n = node->args; n; n = n->next)
+      inlineCalls(fn, n);
+
+    if (node->nodeType != ND_FUNCALL)
+      continue;
+
+    Function *callee = findFunction(node->funcName);
+    if (callee)
+      inlineFunction(callee);
+    if (shouldInline(fn, callee, node))
+      inlineCall(fn, callee, node);
+  }
+  free(chain);
+}
+
+static void inlineFunction(Function *fn) {
+  // a function on the current call chain is recursive, use it as it is
+  for (int i = 0; i < VisitedCnt; i++)
+    if (Visited[i] == fn)
+      return;
+
+  Visited = realloc(Visited, sizeof(Function *) * (VisitedCnt + 1));
+  Visited[VisitedCnt++] = fn;
+  inlineCalls(fn, fn->body);
+}
+
+void inlineFunctions(Function *prog) {
+  Prog = prog;
+  for (Function *fn = prog; fn; fn = fn->next)
+    inlineFunction(fn);
+
+  free(Visited);
+  Visited = NULL;
+  VisitedCnt = 0;
+}
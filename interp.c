@@ -0,0 +1,731 @@
+/*
+ *  Interpreter for -run
+ *
+ *  Instead of emitting assembly, each function is lowered to code for a
+ *  small stack machine which is run right away. The result of main is the
+ *  exit status, as if the program had been compiled and run.
+ *
+ *  Values are 64 bits wide on the operand stack, ints are kept sign
+ *  extended like the w instructions do. Locals live in frames laid out by
+ *  assignLVarOffset(), at the same offsets from fp as in the compiled code,
+ *  so pointers into the frame behave the same. The variable accesses are
+ *  resolved to those offsets when lowering, and every instruction holds
+ *  the address of its handler, so that dispatching the next one is a
+ *  single indirect jump.
+ *
+ *  Calls to functions which are not defined in the program go to the
+ *  builtins below, the helpers test.sh otherwise links from tmp2.o.
+ */
+
+#include "rvcc.h"
+
+#define OPS(X)                                                                 \
+  X(IMM)        /* push a */                                                   \
+  X(ADDR)       /* push fp + a */                                              \
+  X(LOAD_VAR_W) /* push the int at fp + a */                                   \
+  X(LOAD_VAR_D) /* push the 8 bytes at fp + a */                               \
+  X(STORE_VAR_W)                                                               \
+  X(STORE_VAR_D)                                                               \
+  X(LOAD_W) /* replace the address on top by the value it points to */         \
+  X(LOAD_D)                                                                    \
+  X(STORE_W) /* store the top into the address below, keep the value */       \
+  X(STORE_D)                                                                   \
+  X(ADD)                                                                       \
+  X(SUB)                                                                       \
+  X(MUL)                                                                       \
+  X(DIV)                                                                       \
+  X(NEG)                                                                       \
+  X(ADDW)                                                                      \
+  X(SUBW)                                                                      \
+  X(MULW)                                                                      \
+  X(DIVW)                                                                      \
+  X(NEGW)                                                                      \
+  X(EQ)                                                                        \
+  X(NE)                                                                        \
+  X(LT)                                                                        \
+  X(LE)                                                                        \
+  X(POP)                                                                       \
+  X(PUT_ARG) /* pop into the slot a below the top */                          \
+  X(JMP)     /* go to a */                                                     \
+  X(JZ)      /* pop, go to a if it is zero */                                  \
+  X(CALL)    /* call function a with the b values on top as arguments */      \
+  X(TAIL_CALL) /* call, and return what the callee returns */                 \
+  X(RET)       /* return the top */                                            \
+  X(COUNT)     /* add one to counter a of -fprofile-generate */
+
+typedef enum {
+#define X(name) OP_##name,
+  OPS(X)
+#undef X
+} OpCode;
+
+typedef struct {
+  OpCode op;
+  void *label; // the handler of op, for threaded dispatch
+  long a;
+  int b;
+} Code;
+
+// a function lowered to code, or a builtin
+typedef struct {
+  char *name;
+  Function *fn;
+  Code *code;
+  int codeCnt;
+  int codeCap;
+  bool resolved; // the labels of the code are set
+  int maxDepth;  // of the operand stack
+  long (*builtin)(long *args);
+} Callee;
+
+static Callee *Callees;
+static int CalleeCnt;
+
+// =================================================================
+// builtins
+
+static long builtinRet3(long *args) { return 3; }
+static long builtinRet5(long *args) { return 5; }
+static long builtinAdd(long *args) { return (int)(args[0] + args[1]); }
+static long builtinSub(long *args) { return (int)(args[0] - args[1]); }
+
+static long sum(long *args, int n) {
+  long v = 0;
+  for (int i = 0; i < n; i++)
+    v += args[i];
+  return (int)v;
+}
+
+static long builtinAdd6(long *args) { return sum(args, 6); }
+static long builtinAdd8(long *args) { return sum(args, 8); }
+static long builtinAdd10(long *args) { return sum(args, 10); }
+
+static struct {
+  char *name;
+  long (*fn)(long *args);
+} Builtins[] = {
+    {"ret3", builtinRet3}, {"ret5", builtinRet5},   {"add", builtinAdd},
+    {"sub", builtinSub},   {"add6", builtinAdd6},   {"add8", builtinAdd8},
+    {"add10", builtinAdd10},
+};
+
+// =================================================================
+// lowering
+
+static Callee *Cur;
+// number of values on the operand stack at the code being lowered
+static int Depth;
+// whether an inlined body is being lowered, its returns are jumps to -1
+// until the end of the body is known
+static bool InInline;
+// whether `return f(...)` reuses the frame, as genTailCall() does
+static bool TailCalls;
+
+static int findCallee(char *name) {
+  for (int i = 0; i < CalleeCnt; i++)
+    if (!strcmp(Callees[i].name, name))
+      return i;
+  error("undefined function %s", name);
+  return -1;
+}
+
+static void addCallee(Callee c) {
+  Callees = realloc(Callees, sizeof(Callee) * ++CalleeCnt);
+  Callees[CalleeCnt - 1] = c;
+}
+
+// the stack effect of each op, given b for calls
+static int stackEffect(OpCode op, int b) {
+  switch (op) {
+  case OP_IMM:
+  case OP_ADDR:
+  case OP_LOAD_VAR_W:
+  case OP_LOAD_VAR_D:
+    return 1;
+  case OP_STORE_VAR_W:
+  case OP_STORE_VAR_D:
+  case OP_LOAD_W:
+  case OP_LOAD_D:
+  case OP_NEG:
+  case OP_NEGW:
+  case OP_JMP:
+  case OP_COUNT:
+    return 0;
+  case OP_CALL:
+    return 1 - b;
+  case OP_TAIL_CALL:
+    return -b;
+  default:
+    return -1;
+  }
+}
+
+// returns the index of the code
+static int lower(OpCode op, long a, int b) {
+  if (Cur->codeCnt == Cur->codeCap) {
+    Cur->codeCap = Cur->codeCap ? Cur->codeCap * 2 : 64;
+    Cur->code = realloc(Cur->code, sizeof(Code) * Cur->codeCap);
+  }
+  Cur->code[Cur->codeCnt] = (Code){op, NULL, a, b};
+  Depth += stackEffect(op, b);
+  if (Depth > Cur->maxDepth)
+    Cur->maxDepth = Depth;
+  return Cur->codeCnt++;
+}
+
+static void lowerCount(Node *node, ProfKind kind) {
+  if (ProfileGenerate)
+    lower(OP_COUNT, newCounter(node, kind), 0);
+}
+
+// the jump at index goes to the next code
+static void patch(int index) { Cur->code[index].a = Cur->codeCnt; }
+
+static bool isWord(Type *ty) { return ty->kind == TY_INT; }
+
+static void lowerExpr(Node *node);
+static void lowerStmt(Node *node);
+
+// as codegen's isSimple(), such arguments are evaluated last
+static bool isSimpleArg(Node *node) {
+  return node->nodeType == ND_NUM || node->nodeType == ND_VAR ||
+         (node->nodeType == ND_ADDR && node->left->nodeType == ND_VAR);
+}
+
+// the arguments are evaluated in the order of genArgs() into slots
+// reserved on the operand stack, op is OP_CALL or OP_TAIL_CALL
+static void lowerCall(Node *node, OpCode op) {
+  lowerCount(node, PROF_CALL);
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    nargs++;
+  Node **args = calloc(nargs, sizeof(Node *));
+  int i = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    args[i++] = arg;
+
+  int base = Depth;
+  for (i = 0; i < nargs; i++)
+    lower(OP_IMM, 0, 0);
+
+  // the slot of args[i] is Depth - base - i - 1 below the value on top
+  for (i = nargs - 1; i >= NARGREG; i--) {
+    lowerExpr(args[i]);
+    lower(OP_PUT_ARG, Depth - base - i - 1, 0);
+  }
+  for (i = 0; i < nargs && i < NARGREG; i++) {
+    if (isSimpleArg(args[i]))
+      continue;
+    lowerExpr(args[i]);
+    lower(OP_PUT_ARG, Depth - base - i - 1, 0);
+  }
+  for (i = 0; i < nargs && i < NARGREG; i++) {
+    if (!isSimpleArg(args[i]))
+      continue;
+    lowerExpr(args[i]);
+    lower(OP_PUT_ARG, Depth - base - i - 1, 0);
+  }
+  free(args);
+
+  lower(op, findCallee(node->funcName), nargs);
+}
+
+static void lowerBinary(Node *node);
+
+static void lowerExpr(Node *node) {
+  switch (node->nodeType) {
+  case ND_NUM:
+    lower(OP_IMM, node->val, 0);
+    return;
+  case ND_VAR:
+    lower(isWord(node->dataType) ? OP_LOAD_VAR_W : OP_LOAD_VAR_D,
+          node->var->offSet, 0);
+    return;
+  case ND_ADDR:
+    if (node->left->nodeType == ND_VAR)
+      lower(OP_ADDR, node->left->var->offSet, 0);
+    else
+      lowerExpr(node->left->left);
+    return;
+  case ND_DEREF:
+    lowerExpr(node->left);
+    lower(isWord(node->dataType) ? OP_LOAD_W : OP_LOAD_D, 0, 0);
+    return;
+  case ND_ASSIGN:
+    if (node->left->nodeType == ND_VAR) {
+      lowerExpr(node->right);
+      lower(isWord(node->dataType) ? OP_STORE_VAR_W : OP_STORE_VAR_D,
+            node->left->var->offSet, 0);
+      return;
+    }
+    // the address is computed first, then the value
+    lowerExpr(node->left->left);
+    lowerExpr(node->right);
+    lower(isWord(node->dataType) ? OP_STORE_W : OP_STORE_D, 0, 0);
+    return;
+  case ND_NEG:
+    lowerExpr(node->left);
+    lower(isWord(node->dataType) ? OP_NEGW : OP_NEG, 0, 0);
+    return;
+  case ND_FUNCALL:
+    lowerCall(node, OP_CALL);
+    return;
+  case ND_INLINE: {
+    bool outer = InInline;
+    int depth = Depth;
+    int start = Cur->codeCnt;
+    InInline = true;
+    lowerCount(node, PROF_CALL);
+    for (Node *n = node->body; n; n = n->next)
+      lowerStmt(n);
+    // falling off the end of the body returns nothing in particular
+    lower(OP_IMM, 0, 0);
+    // the other jumps in the body are resolved already
+    for (int i = start; i < Cur->codeCnt; i++)
+      if (Cur->code[i].op == OP_JMP && Cur->code[i].a == -1)
+        patch(i);
+    InInline = outer;
+    Depth = depth + 1;
+    return;
+  }
+  default:
+    break;
+  }
+
+  // the right operand is evaluated first, the left one ends up on top. A
+  // chain like a+b+c+... is lowered in a loop, as in genExpr().
+  Node **chain;
+  int cnt = leftChain(node, isBinary, &chain);
+  if (!cnt)
+    errorTok(node->tok, "invalid expression");
+  for (int i = 0; i < cnt; i++)
+    lowerExpr(chain[i]->right);
+  lowerExpr(chain[cnt - 1]->left);
+  for (int i = cnt - 1; i >= 0; i--)
+    lowerBinary(chain[i]);
+  free(chain);
+}
+
+// the operator of a binary node, with its operands on top
+static void lowerBinary(Node *node) {
+  bool word = isWord(node->dataType);
+  switch (node->nodeType) {
+  case ND_ADD:
+    lower(word ? OP_ADDW : OP_ADD, 0, 0);
+    return;
+  case ND_SUB:
+    lower(word ? OP_SUBW : OP_SUB, 0, 0);
+    return;
+  case ND_MUL:
+    lower(word ? OP_MULW : OP_MUL, 0, 0);
+    return;
+  case ND_DIV:
+    lower(word ? OP_DIVW : OP_DIV, 0, 0);
+    return;
+  case ND_EQ:
+    lower(OP_EQ, 0, 0);
+    return;
+  case ND_NE:
+    lower(OP_NE, 0, 0);
+    return;
+  case ND_LT:
+    lower(OP_LT, 0, 0);
+    return;
+  case ND_LE:
+    lower(OP_LE, 0, 0);
+    return;
+  default:
+    break;
+  }
+  errorTok(node->tok, "invalid expression");
+}
+
+static void lowerStmt(Node *node) {
+  switch (node->nodeType) {
+  case ND_EXPR_STMT:
+    lowerExpr(node->left);
+    lower(OP_POP, 0, 0);
+    return;
+  case ND_RETURN:
+    if (!InInline && TailCalls && node->left->nodeType == ND_FUNCALL) {
+      lowerCall(node->left, OP_TAIL_CALL);
+      return;
+    }
+    lowerExpr(node->left);
+    if (!InInline) {
+      lower(OP_RET, 0, 0);
+      return;
+    }
+    // the value is left on the stack for the end of the inlined body
+    lower(OP_JMP, -1, 0);
+    Depth--;
+    return;
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      lowerStmt(n);
+    return;
+  case ND_IF: {
+    lowerCount(node, PROF_IF);
+    lowerExpr(node->cond);
+    int jz = lower(OP_JZ, 0, 0);
+    lowerCount(node, PROF_THEN);
+    lowerStmt(node->then);
+    if (!node->els) {
+      patch(jz);
+      return;
+    }
+    int jmp = lower(OP_JMP, 0, 0);
+    patch(jz);
+    lowerStmt(node->els);
+    patch(jmp);
+    return;
+  }
+  case ND_LOOP: {
+    lowerCount(node, PROF_LOOP);
+    if (node->init)
+      lowerStmt(node->init);
+    int head = Cur->codeCnt;
+    int jz = -1;
+    if (node->cond) {
+      lowerExpr(node->cond);
+      jz = lower(OP_JZ, 0, 0);
+    }
+    lowerCount(node, PROF_BODY);
+    lowerStmt(node->then);
+    if (node->inc) {
+      lowerExpr(node->inc);
+      lower(OP_POP, 0, 0);
+    }
+    lower(OP_JMP, head, 0);
+    if (jz != -1)
+      patch(jz);
+    return;
+  }
+  default:
+    break;
+  }
+  errorTok(node->tok, "invalid Statement");
+}
+
+// =================================================================
+// execution
+
+// frames are taken from here, growing downwards like the real stack
+#define FRAME_STACK_SIZE (8 << 20)
+static char *FrameStack;
+static char *FrameTop;
+
+// the counters of -fprofile-generate
+static long *Counts;
+
+#define OPERAND_STACK_SIZE (1 << 20)
+static long *Operands;
+static long *OperandEnd;
+
+static long readMem(long addr, int size) {
+  if (size == 4) {
+    int v;
+    memcpy(&v, (void *)addr, 4);
+    return v;
+  }
+  long v;
+  memcpy(&v, (void *)addr, 8);
+  return v;
+}
+
+static void writeMem(long addr, long val, int size) {
+  if (size == 4) {
+    int v = val;
+    memcpy((void *)addr, &v, 4);
+    return;
+  }
+  memcpy((void *)addr, &val, 8);
+}
+
+// division as RISC-V does it: x / 0 is -1, and the overflow of
+// INT_MIN / -1 gives INT_MIN
+static long divide(long l, long r, bool word) {
+  if (r == 0)
+    return -1;
+  if (word)
+    return (l == INT32_MIN && r == -1) ? l : (int)(l / r);
+  return (l == INT64_MIN && r == -1) ? l : l / r;
+}
+
+static long call(int callee, long *args, int nargs);
+
+// the frame holds the locals below fp, and the arguments past the 8th
+// above the saved ra and fp, as codegen lays them out. Returns fp.
+static char *enterFrame(Callee *c, long *args, int nargs) {
+  Function *fn = c->fn;
+  if (args + nargs + c->maxDepth >= OperandEnd)
+    error("operand stack overflow in %s", fn->name);
+  int above = 16 + (nargs > NARGREG ? (nargs - NARGREG) * 8 : 0);
+  char *top = FrameTop;
+  char *fp = FrameTop - above;
+  FrameTop = fp - fn->stackSize;
+  if (FrameTop < FrameStack)
+    error("stack overflow in %s", fn->name);
+  memset(FrameTop, 0, top - FrameTop);
+
+  int i = 0;
+  for (Obj *var = fn->params; var; var = var->next, i++) {
+    if (i >= nargs)
+      break;
+    if (i < NARGREG)
+      writeMem((long)(fp + var->offSet), args[i], var->dataType->size);
+    else
+      writeMem((long)(fp + var->offSet), args[i], 8);
+  }
+  return fp;
+}
+
+// run the callee with the arguments, its operand stack starts right after
+// them
+static long exec(int callee, long *args, int nargs) {
+#ifdef __GNUC__
+  static void *labels[] = {
+#define X(name) &&L_##name,
+      OPS(X)
+#undef X
+  };
+#define CASE(name) L_##name:
+#define DISPATCH() goto *pc->label
+#else
+#define CASE(name) case OP_##name:
+#define DISPATCH() goto dispatch
+#endif
+
+  char *top = FrameTop;
+  Callee *c;
+  Code *code, *pc;
+  char *fp;
+  long *sp;
+  long v;
+
+enter:
+  c = &Callees[callee];
+  if (c->builtin)
+    return c->builtin(args);
+#ifdef __GNUC__
+  if (!c->resolved) {
+    for (int i = 0; i < c->codeCnt; i++)
+      c->code[i].label = labels[c->code[i].op];
+    c->resolved = true;
+  }
+#endif
+  FrameTop = top;
+  fp = enterFrame(c, args, nargs);
+  code = pc = c->code;
+  sp = args + nargs;
+
+#ifdef __GNUC__
+  DISPATCH();
+#else
+dispatch:
+  switch (pc->op) {
+#endif
+  CASE(IMM)
+  *sp++ = pc->a;
+  pc++;
+  DISPATCH();
+  CASE(ADDR)
+  *sp++ = (long)(fp + pc->a);
+  pc++;
+  DISPATCH();
+  CASE(LOAD_VAR_W)
+  *sp++ = readMem((long)(fp + pc->a), 4);
+  pc++;
+  DISPATCH();
+  CASE(LOAD_VAR_D)
+  *sp++ = readMem((long)(fp + pc->a), 8);
+  pc++;
+  DISPATCH();
+  CASE(STORE_VAR_W)
+  writeMem((long)(fp + pc->a), sp[-1], 4);
+  pc++;
+  DISPATCH();
+  CASE(STORE_VAR_D)
+  writeMem((long)(fp + pc->a), sp[-1], 8);
+  pc++;
+  DISPATCH();
+  CASE(LOAD_W)
+  sp[-1] = readMem(sp[-1], 4);
+  pc++;
+  DISPATCH();
+  CASE(LOAD_D)
+  sp[-1] = readMem(sp[-1], 8);
+  pc++;
+  DISPATCH();
+  CASE(STORE_W)
+  writeMem(sp[-2], sp[-1], 4);
+  sp[-2] = sp[-1];
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(STORE_D)
+  writeMem(sp[-2], sp[-1], 8);
+  sp[-2] = sp[-1];
+  sp--;
+  pc++;
+  DISPATCH();
+  // the left operand is on top
+  CASE(ADD)
+  sp[-2] = sp[-1] + sp[-2];
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(SUB)
+  sp[-2] = sp[-1] - sp[-2];
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(MUL)
+  sp[-2] = sp[-1] * sp[-2];
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(DIV)
+  sp[-2] = divide(sp[-1], sp[-2], false);
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(NEG)
+  sp[-1] = -sp[-1];
+  pc++;
+  DISPATCH();
+  CASE(ADDW)
+  sp[-2] = (int)(uint32_t)(sp[-1] + sp[-2]);
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(SUBW)
+  sp[-2] = (int)(uint32_t)(sp[-1] - sp[-2]);
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(MULW)
+  sp[-2] = (int)(uint32_t)((uint64_t)sp[-1] * (uint64_t)sp[-2]);
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(DIVW)
+  sp[-2] = divide((int)sp[-1], (int)sp[-2], true);
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(NEGW)
+  sp[-1] = (int)(uint32_t)(-(uint64_t)sp[-1]);
+  pc++;
+  DISPATCH();
+  CASE(EQ)
+  sp[-2] = sp[-1] == sp[-2];
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(NE)
+  sp[-2] = sp[-1] != sp[-2];
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(LT)
+  sp[-2] = sp[-1] < sp[-2];
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(LE)
+  sp[-2] = sp[-1] <= sp[-2];
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(POP)
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(PUT_ARG)
+  sp[-1 - pc->a] = sp[-1];
+  sp--;
+  pc++;
+  DISPATCH();
+  CASE(JMP)
+  pc = code + pc->a;
+  DISPATCH();
+  CASE(JZ)
+  v = *--sp;
+  pc = v ? pc + 1 : code + pc->a;
+  DISPATCH();
+  CASE(CALL)
+  sp -= pc->b;
+  *sp = call(pc->a, sp, pc->b);
+  sp++;
+  pc++;
+  DISPATCH();
+  CASE(TAIL_CALL)
+  // the frame is released, the arguments take the place of ours
+  sp -= pc->b;
+  callee = pc->a;
+  nargs = pc->b;
+  memmove(args, sp, nargs * sizeof(long));
+  goto enter;
+  CASE(RET)
+  return sp[-1];
+  CASE(COUNT)
+  Counts[pc->a]++;
+  pc++;
+  DISPATCH();
+#ifndef __GNUC__
+  }
+#endif
+#undef CASE
+#undef DISPATCH
+  return 0;
+}
+
+static long call(int callee, long *args, int nargs) {
+  char *top = FrameTop;
+  long ret = exec(callee, args, nargs);
+  FrameTop = top;
+  return ret;
+}
+
+int runProgram(Function *prog) {
+  assignLVarOffset(prog);
+
+  for (Function *fn = prog; fn; fn = fn->next)
+    addCallee((Callee){fn->name, fn});
+  int fnCnt = CalleeCnt;
+  // a function of the program replaces the builtin of the same name
+  for (int i = 0; i < sizeof(Builtins) / sizeof(*Builtins); i++) {
+    bool defined = false;
+    for (int j = 0; j < fnCnt; j++)
+      defined |= !strcmp(Callees[j].name, Builtins[i].name);
+    if (!defined)
+      addCallee((Callee){Builtins[i].name, .builtin = Builtins[i].fn});
+  }
+
+  for (int i = 0; i < fnCnt; i++) {
+    Cur = &Callees[i];
+    Depth = 0;
+    // a pointer into the frame may be passed on
+    TailCalls = OptLevel >= 1 && !takesAddr(Cur->fn->body);
+    lowerStmt(Cur->fn->body);
+    // falling off the end of a function returns 0
+    lower(OP_IMM, 0, 0);
+    lower(OP_RET, 0, 0);
+  }
+
+  FrameStack = calloc(1, FRAME_STACK_SIZE);
+  FrameTop = FrameStack + FRAME_STACK_SIZE;
+  Operands = calloc(OPERAND_STACK_SIZE, sizeof(long));
+  OperandEnd = Operands + OPERAND_STACK_SIZE;
+
+  Counts = calloc(counterCnt(), sizeof(long));
+
+  int entry = findCallee("main");
+  if (!Callees[entry].fn)
+    error("main is not defined");
+  int ret = call(entry, Operands, 0);
+  if (ProfileGenerate)
+    writeProfile(Counts);
+  return ret;
+}
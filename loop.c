@@ -0,0 +1,946 @@
+/*
+ *  Loop optimizations
+ *
+ *  Loop-invariant code motion: an expression in the cond, body or inc of an
+ *  ND_LOOP whose value cannot change while the loop runs is computed once,
+ *  into a new local, right after the init statement of the loop (the
+ *  preheader), and the loop reads that local instead.
+ *
+ *  Only expressions without side effects are moved, and no loads through
+ *  pointers: the preheader runs even if the loop does not, and the pointer
+ *  may not be valid then. Divisions are fine, they do not trap on RISC-V.
+ *
+ *  Induction variable strength reduction: in a loop whose counter i only
+ *  changes by i = i + c in inc, the pointer p + i*k that newAdd builds is
+ *  replaced by a local q = p + i*k, set in the preheader and bumped by c*k
+ *  at the end of every iteration. A test of i against an invariant bound
+ *  becomes a test of q against an end pointer, and if nothing else reads i
+ *  in the loop, the counter is dropped and only set once after the loop.
+ *
+ *  Unrolling (-funroll-loops): a loop over such a counter with constant
+ *  bounds is replaced by copies of its body, if they fit in the budget.
+ *  Other loops tested against an invariant bound get a main loop running
+ *  2, 4 or 8 copies of the body per test, followed by the original loop,
+ *  which runs the remaining iterations.
+ *
+ *  With -march=rv64gcv, the loops vector.c can run on vectors are marked
+ *  first and left alone.
+ */
+
+#include "rvcc.h"
+
+// variables assigned inside the loop being optimized
+static Obj **Written;
+static int WrittenCnt;
+// whether the loop may store to memory, through a pointer or in a call
+static bool MemWrite;
+// whether the address of some local is taken in the function. A store
+// through a pointer may then change any local, since the pointer can be
+// moved from one local to another (*(&x+1)).
+static bool AddrTaken;
+
+// new statements of the preheader
+static Node *Hoisted;
+static Node *HoistedTail;
+
+static Function *CurrentFn;
+
+// number of expressions moved out of loops
+static int HoistCnt;
+// number of induction expressions and counters replaced by pointers
+static int ReduceCnt;
+static int CounterCnt;
+// number of loops unrolled partially and fully
+static int UnrollCnt;
+static int PeelCnt;
+// number of loops left to run on vectors
+static int VectorCnt;
+
+// unroll loops, set by -funroll-loops
+bool UnrollLoops;
+// an unrolled loop takes at most this many nodes, set by -funroll-limit=<n>
+int UnrollLimit = 128;
+
+// find the writes in a loop
+static void collectWrites(Node *node) {
+  // down the left operands in a loop, see node.c
+  for (; node; node = node->left) {
+    if (node->nodeType == ND_ASSIGN) {
+      if (node->left->nodeType == ND_VAR) {
+        Written = realloc(Written, sizeof(Obj *) * (WrittenCnt + 1));
+        Written[WrittenCnt++] = node->left->var;
+      } else {
+        MemWrite = true;
+      }
+    }
+    if (node->nodeType == ND_FUNCALL)
+      MemWrite = true;
+
+    collectWrites(node->right);
+    collectWrites(node->cond);
+    collectWrites(node->then);
+    collectWrites(node->els);
+    collectWrites(node->init);
+    collectWrites(node->inc);
+    for (Node *n = node->body; n; n = n->next)
+      collectWrites(n);
+    for (Node *n = node->args; n; n = n->next)
+      collectWrites(n);
+  }
+}
+
+static bool isWritten(Obj *var) {
+  if (MemWrite && AddrTaken)
+    return true;
+  for (int i = 0; i < WrittenCnt; i++)
+    if (Written[i] == var)
+      return true;
+  return false;
+}
+
+// whether the value of the expression is the same on every iteration
+static bool isInvariant(Node *node) {
+  while (true) {
+    switch (node->nodeType) {
+    case ND_NUM:
+      return true;
+    case ND_VAR:
+      return !isWritten(node->var);
+    case ND_ADDR:
+      // the address of a local never changes
+      return node->left->nodeType == ND_VAR;
+    case ND_NEG:
+      node = node->left;
+      continue;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+      if (!isInvariant(node->right))
+        return false;
+      node = node->left;
+      continue;
+    default:
+      return false;
+    }
+  }
+}
+
+// only expressions that take more than one instruction are worth a local
+static bool isComposite(Node *node) {
+  switch (node->nodeType) {
+  case ND_NUM:
+  case ND_VAR:
+  case ND_ADDR:
+    return false;
+  default:
+    return true;
+  }
+}
+
+static Node *newLoopNode(NodeType type, Node *left, Token *tok) {
+  Node *node = calloc(1, sizeof(Node));
+  node->nodeType = type;
+  node->left = left;
+  node->tok = tok;
+  return node;
+}
+
+static Node *newLoopBinary(NodeType type, Node *left, Node *right,
+                           Type *dataType) {
+  Node *node = newLoopNode(type, left, left->tok);
+  node->right = right;
+  node->dataType = dataType;
+  return node;
+}
+
+static Node *newLoopNum(int val, Token *tok) {
+  Node *node = newLoopNode(ND_NUM, NULL, tok);
+  node->val = val;
+  node->dataType = TyInt;
+  return node;
+}
+
+static Node *newLoopVar(Obj *var, Token *tok) {
+  Node *node = newLoopNode(ND_VAR, NULL, tok);
+  node->var = var;
+  node->dataType = var->dataType;
+  return node;
+}
+
+static Obj *newTmp(char *name, Type *dataType) {
+  Obj *tmp = calloc(1, sizeof(Obj));
+  tmp->name = name;
+  tmp->dataType = dataType;
+  tmp->next = CurrentFn->locals;
+  CurrentFn->locals = tmp;
+  return tmp;
+}
+
+// var = expr;
+static Node *newAssignStmt(Obj *var, Node *expr) {
+  Node *assign =
+      newLoopBinary(ND_ASSIGN, newLoopVar(var, expr->tok), expr, var->dataType);
+  return newLoopNode(ND_EXPR_STMT, assign, expr->tok);
+}
+
+static void addHoisted(Node *stmt) {
+  if (HoistedTail)
+    HoistedTail = HoistedTail->next = stmt;
+  else
+    Hoisted = HoistedTail = stmt;
+}
+
+// { init; hoisted statements... }
+static void addPreheader(Node *loop) {
+  if (!Hoisted)
+    return;
+
+  Node *block = newLoopNode(ND_BLOCK, NULL, loop->tok);
+  if (loop->init) {
+    block->body = loop->init;
+    loop->init->next = Hoisted;
+  } else {
+    block->body = Hoisted;
+  }
+  loop->init = block;
+}
+
+// tmp = expr in the preheader, returns a read of tmp
+static Node *hoistExpr(Node *expr) {
+  Obj *tmp = newTmp("licm.tmp", expr->dataType);
+  addHoisted(newAssignStmt(tmp, expr));
+  HoistCnt++;
+  return newLoopVar(tmp, expr->tok);
+}
+
+// move the expression at *link to the preheader
+static void hoistAt(Node **link) {
+  Node *node = *link;
+  Node *next = node->next;
+  node->next = NULL;
+  *link = hoistExpr(node);
+  (*link)->next = next;
+}
+
+static void hoist(Node **link);
+static void hoistList(Node **list);
+
+// hoist() for a chain like a+b+c+... (see node.c). The chain is invariant
+// from the bottom up to some level, which is found in one pass instead of
+// checking every level again.
+static void hoistChain(Node **link) {
+  Node **chain;
+  int cnt = leftChain(*link, isBinary, &chain);
+  // chain[top] and everything under it are invariant
+  int top = cnt;
+  if (isInvariant(chain[cnt - 1]->left))
+    while (top > 0 && isInvariant(chain[top - 1]->right))
+      top--;
+
+  if (top == cnt)
+    hoist(&chain[cnt - 1]->left);
+  else
+    hoistAt(top ? &chain[top - 1]->left : link);
+  for (int i = top - 1; i >= 0; i--)
+    hoist(&chain[i]->right);
+  free(chain);
+}
+
+// move the largest invariant expressions under *link out of the loop
+static void hoist(Node **link) {
+  Node *node = *link;
+  if (!node)
+    return;
+
+  if (isBinary(node)) {
+    hoistChain(link);
+    return;
+  }
+  if (isComposite(node) && isInvariant(node)) {
+    hoistAt(link);
+    return;
+  }
+
+  // the variable being assigned stays where it is
+  if (!(node->nodeType == ND_ASSIGN && node->left->nodeType == ND_VAR))
+    hoist(&node->left);
+  hoist(&node->right);
+  hoist(&node->cond);
+  hoist(&node->then);
+  hoist(&node->els);
+  hoist(&node->init);
+  hoist(&node->inc);
+  hoistList(&node->body);
+  hoistList(&node->args);
+}
+
+static void hoistList(Node **list) {
+  for (Node **link = list; *link; link = &(*link)->next)
+    hoist(link);
+}
+
+static void moveInvariants(Node *loop) {
+  WrittenCnt = 0;
+  MemWrite = false;
+  collectWrites(loop->cond);
+  collectWrites(loop->then);
+  collectWrites(loop->inc);
+
+  Hoisted = HoistedTail = NULL;
+  hoist(&loop->cond);
+  hoist(&loop->then);
+  hoist(&loop->inc);
+  addPreheader(loop);
+}
+
+// turn a node into a block of the statements in body
+static void replaceWithBlock(Node *node, Node *body) {
+  Node *next = node->next;
+  Token *tok = node->tok;
+  memset(node, 0, sizeof(Node));
+  node->nodeType = ND_BLOCK;
+  node->tok = tok;
+  node->body = body;
+  node->next = next;
+}
+
+// the counter of the loop being reduced, and its step
+static Obj *Counter;
+static int Step;
+
+// a pointer derived from the counter, p + i*k
+typedef struct Derived {
+  struct Derived *next;
+  Node *base; // p
+  int scale;  // k
+  Obj *ptr;   // q, equal to p + i*k on every iteration
+  Obj *start; // p, computed once
+} Derived;
+
+static Derived *DerivedList;
+
+static bool isCounter(Node *node) {
+  return node->nodeType == ND_VAR && node->var == Counter;
+}
+
+// i or i + d, the offset d is stored in *offset
+static bool counterPlus(Node *node, int *offset) {
+  *offset = 0;
+  if (isCounter(node))
+    return true;
+  if (node->nodeType == ND_ADD && isCounter(node->left) &&
+      node->right->nodeType == ND_NUM) {
+    *offset = node->right->val;
+    return true;
+  }
+  return false;
+}
+
+// (i + d)*k or k*(i + d), returns k or 0, d*k is stored in *offset
+static int counterScale(Node *node, int *offset) {
+  if (node->nodeType != ND_MUL)
+    return 0;
+
+  int d;
+  if (counterPlus(node->left, &d) && node->right->nodeType == ND_NUM) {
+    *offset = d * node->right->val;
+    return node->right->val;
+  }
+  if (counterPlus(node->right, &d) && node->left->nodeType == ND_NUM) {
+    *offset = d * node->left->val;
+    return node->left->val;
+  }
+  return 0;
+}
+
+// i = i + c, i = c + i or i = i - c, returns the step or 0
+static int counterStep(Node *inc) {
+  if (!inc || inc->nodeType != ND_ASSIGN || !isCounter(inc->left))
+    return 0;
+
+  Node *rhs = inc->right;
+  if (rhs->nodeType == ND_ADD && isCounter(rhs->left) &&
+      rhs->right->nodeType == ND_NUM)
+    return rhs->right->val;
+  if (rhs->nodeType == ND_ADD && isCounter(rhs->right) &&
+      rhs->left->nodeType == ND_NUM)
+    return rhs->left->val;
+  if (rhs->nodeType == ND_SUB && isCounter(rhs->left) &&
+      rhs->right->nodeType == ND_NUM)
+    return -rhs->right->val;
+  return 0;
+}
+
+// find the counter of the loop and its step, the counter must only change
+// in inc. The writes of the loop are collected on the way.
+static bool findCounter(Node *loop) {
+  Counter = loop->inc && loop->inc->nodeType == ND_ASSIGN &&
+                    loop->inc->left->nodeType == ND_VAR
+                ? loop->inc->left->var
+                : NULL;
+  Step = counterStep(loop->inc);
+  if (!Counter || !Step || !isInteger(Counter->dataType))
+    return false;
+
+  WrittenCnt = 0;
+  MemWrite = false;
+  collectWrites(loop->cond);
+  collectWrites(loop->then);
+  if (isWritten(Counter))
+    return false;
+  // the counter is written by inc itself
+  collectWrites(loop->inc);
+  return true;
+}
+
+// p + (i + d)*k with p invariant, p is a pointer as built by newAdd
+static bool isDerived(Node *node) {
+  int offset;
+  return node->nodeType == ND_ADD && node->dataType &&
+         node->dataType->base && counterScale(node->right, &offset) > 0 &&
+         isInvariant(node->left);
+}
+
+static Derived *findDerived(Node *base, int scale) {
+  for (Derived *d = DerivedList; d; d = d->next)
+    if (d->scale == scale && sameExpr(d->base, base))
+      return d;
+  return NULL;
+}
+
+// replace the node at *link by its local if it is a derived pointer
+static bool reduceAt(Node **link) {
+  Node *node = *link;
+  if (isDerived(node)) {
+    int offset;
+    int scale = counterScale(node->right, &offset);
+    Derived *d = findDerived(node->left, scale);
+    if (!d) {
+      d = calloc(1, sizeof(Derived));
+      d->base = node->left;
+      d->scale = scale;
+      d->ptr = newTmp("iv.ptr", node->dataType);
+      d->start = newTmp("iv.start", node->dataType);
+      d->next = DerivedList;
+      DerivedList = d;
+    }
+    // q + d*k
+    Node *read = newLoopVar(d->ptr, node->tok);
+    if (offset)
+      read = newLoopBinary(ND_ADD, read, newLoopNum(offset, node->tok),
+                           d->ptr->dataType);
+    read->next = node->next;
+    *link = read;
+    ReduceCnt++;
+    return true;
+  }
+  return false;
+}
+
+static void reduceList(Node **list);
+
+// replace the derived pointers under *link by their locals
+static void reduce(Node **link) {
+  // the left operands come first: they are replaced down the chain in a
+  // loop (see node.c), then the other children are visited bottom up
+  Node **chain = NULL;
+  int cnt = 0, cap = 0;
+  for (Node *node; (node = *link) && !reduceAt(link); link = &node->left) {
+    if (cnt == cap) {
+      cap = cap ? cap * 2 : 16;
+      chain = realloc(chain, sizeof(Node *) * cap);
+    }
+    chain[cnt++] = node;
+    // the variable being assigned stays where it is
+    if (node->nodeType == ND_ASSIGN && node->left->nodeType == ND_VAR)
+      break;
+  }
+
+  for (int i = cnt - 1; i >= 0; i--) {
+    Node *node = chain[i];
+    reduce(&node->right);
+    reduce(&node->cond);
+    reduce(&node->then);
+    reduce(&node->els);
+    reduce(&node->init);
+    reduce(&node->inc);
+    reduceList(&node->body);
+    reduceList(&node->args);
+  }
+  free(chain);
+}
+
+static void reduceList(Node **list) {
+  for (Node **link = list; *link; link = &(*link)->next)
+    reduce(link);
+}
+
+// whether var is read in the tree, skipping the subtree skip
+static bool readsVar(Node *node, Obj *var, Node *skip) {
+  // down the left operands in a loop, see node.c
+  for (; node && node != skip; node = node->left) {
+    if (node->nodeType == ND_VAR && node->var == var)
+      return true;
+    if (readsVar(node->right, var, skip) || readsVar(node->cond, var, skip) ||
+        readsVar(node->then, var, skip) || readsVar(node->els, var, skip) ||
+        readsVar(node->init, var, skip) || readsVar(node->inc, var, skip))
+      return true;
+    for (Node *n = node->body; n; n = n->next)
+      if (readsVar(n, var, skip))
+        return true;
+    for (Node *n = node->args; n; n = n->next)
+      if (readsVar(n, var, skip))
+        return true;
+    // the variable being assigned is not read
+    if (node->nodeType == ND_ASSIGN && node->left->nodeType == ND_VAR)
+      return false;
+  }
+  return false;
+}
+
+// i < n, i <= n, i != n (or n < i ...) becomes the same test of q against
+// p + n*k, and i + d < n a test of q + d*k. Returns whether the test was
+// rewritten.
+static bool reduceExitTest(Node *loop, Derived *d) {
+  Node *cond = loop->cond;
+  if (!cond)
+    return false;
+
+  // k > 0, so the order of p + i*k is the order of i
+  NodeType type = cond->nodeType;
+  if (type != ND_LT && type != ND_LE && type != ND_NE)
+    return false;
+
+  int offset;
+  bool counterLeft = counterPlus(cond->left, &offset);
+  Node *bound = counterLeft ? cond->right : cond->left;
+  if (!(counterLeft || counterPlus(cond->right, &offset)) ||
+      !isInvariant(bound) || readsVar(bound, Counter, NULL))
+    return false;
+
+  // end = p + n*k
+  Obj *end = newTmp("iv.end", d->ptr->dataType);
+  Node *size =
+      newLoopBinary(ND_MUL, bound, newLoopNum(d->scale, bound->tok), TyInt);
+  addHoisted(newAssignStmt(
+      end, newLoopBinary(ND_ADD, newLoopVar(d->start, bound->tok), size,
+                         end->dataType)));
+
+  Node *q = newLoopVar(d->ptr, cond->tok);
+  if (offset)
+    q = newLoopBinary(ND_ADD, q, newLoopNum(offset * d->scale, cond->tok),
+                      d->ptr->dataType);
+  Node *e = newLoopVar(end, cond->tok);
+  cond->left = counterLeft ? q : e;
+  cond->right = counterLeft ? e : q;
+  return true;
+}
+
+// returns the loop, which is moved into a block if code is added after it
+static Node *reduceInductionVars(Node *loop) {
+  if (!findCounter(loop))
+    return loop;
+
+  DerivedList = NULL;
+  reduce(&loop->cond);
+  reduce(&loop->then);
+  if (!DerivedList)
+    return loop;
+
+  // p is computed once, q starts at p + i*k and is bumped with i
+  Hoisted = HoistedTail = NULL;
+  Node *bumps = NULL;
+  for (Derived *d = DerivedList; d; d = d->next) {
+    Token *tok = d->base->tok;
+    addHoisted(newAssignStmt(d->start, d->base));
+    Node *offset = newLoopBinary(ND_MUL, newLoopVar(Counter, tok),
+                                 newLoopNum(d->scale, tok), TyInt);
+    addHoisted(newAssignStmt(
+        d->ptr, newLoopBinary(ND_ADD, newLoopVar(d->start, tok), offset,
+                              d->ptr->dataType)));
+
+    Node *bump =
+        newLoopBinary(ND_ADD, newLoopVar(d->ptr, tok),
+                      newLoopNum(Step * d->scale, tok), d->ptr->dataType);
+    Node *stmt = newAssignStmt(d->ptr, bump);
+    stmt->next = bumps;
+    bumps = stmt;
+  }
+
+  // { then; q = q + c*k; ... }, there is no continue, inc always comes
+  // right after the end of then
+  Node *block = newLoopNode(ND_BLOCK, NULL, loop->tok);
+  block->body = loop->then;
+  if (loop->then)
+    loop->then->next = bumps;
+  else
+    block->body = bumps;
+  loop->then = block;
+
+  // a pointer to the counter may read it where readsVar() does not see
+  Derived *d = DerivedList;
+  if (!reduceExitTest(loop, d) || readsVar(loop->cond, Counter, NULL) ||
+      readsVar(loop->then, Counter, NULL) ||
+      takesAddrOf(CurrentFn->body, Counter)) {
+    addPreheader(loop);
+    return loop;
+  }
+
+  // the counter is not needed in the loop anymore
+  loop->inc = NULL;
+  CounterCnt++;
+  addPreheader(loop);
+  if (!readsVar(CurrentFn->body, Counter, loop))
+    return loop;
+
+  // it is still read after the loop: i = (q - p) / k
+  Token *tok = loop->tok;
+  Node *diff = newLoopBinary(ND_SUB, newLoopVar(d->ptr, tok),
+                             newLoopVar(d->start, tok), TyInt);
+  Node *fixup = newAssignStmt(
+      Counter, newLoopBinary(ND_DIV, diff, newLoopNum(d->scale, tok), TyInt));
+
+  Node *inner = calloc(1, sizeof(Node));
+  *inner = *loop;
+  inner->next = fixup;
+  replaceWithBlock(loop, inner);
+  return inner;
+}
+
+// the bound n of i < n, i <= n, n < i, n <= i or i != n, NULL if the loop
+// does not test its counter that way
+static Node *counterBound(Node *cond) {
+  if (!cond ||
+      (cond->nodeType != ND_LT && cond->nodeType != ND_LE &&
+       cond->nodeType != ND_NE))
+    return NULL;
+
+  Node *bound;
+  if (isCounter(cond->left))
+    bound = cond->right;
+  else if (isCounter(cond->right))
+    bound = cond->left;
+  else
+    return NULL;
+
+  if (!isInvariant(bound) || readsVar(bound, Counter, NULL))
+    return NULL;
+  return bound;
+}
+
+// number of iterations of for (i = k; i < n; i = i + c) with k and n
+// constants, -1 if it is not known
+static long tripCount(Node *loop) {
+  Node *init = loop->init;
+  if (!init || init->nodeType != ND_EXPR_STMT ||
+      init->left->nodeType != ND_ASSIGN || !isCounter(init->left->left) ||
+      init->left->right->nodeType != ND_NUM)
+    return -1;
+
+  Node *bound = counterBound(loop->cond);
+  if (!bound || bound->nodeType != ND_NUM)
+    return -1;
+
+  long k = init->left->right->val;
+  long n = bound->val;
+  if (loop->cond->nodeType == ND_NE) {
+    if ((n - k) % Step || (n - k) / Step < 0)
+      return -1;
+    return (n - k) / Step;
+  }
+
+  // the loop runs while dist > 0, each iteration takes step from it
+  bool counterLeft = isCounter(loop->cond->left);
+  long dist = counterLeft ? n - k : k - n;
+  long step = counterLeft ? Step : -Step;
+  if (loop->cond->nodeType == ND_LE)
+    dist++;
+  if (dist <= 0)
+    return 0;
+  if (step <= 0)
+    return -1;
+  return (dist + step - 1) / step;
+}
+
+// whether the tree may read memory, other than the locals it names
+static bool readsMemory(Node *node) {
+  for (; node; node = node->left) {
+    if (node->nodeType == ND_DEREF || node->nodeType == ND_FUNCALL)
+      return true;
+    if (readsMemory(node->right) || readsMemory(node->cond) ||
+        readsMemory(node->then) || readsMemory(node->els) ||
+        readsMemory(node->init) || readsMemory(node->inc))
+      return true;
+    for (Node *n = node->body; n; n = n->next)
+      if (readsMemory(n))
+        return true;
+    for (Node *n = node->args; n; n = n->next)
+      if (readsMemory(n))
+        return true;
+  }
+  return false;
+}
+
+static void substList(Node **list, int d);
+
+// replace the reads of the counter i under *link by i + d
+static void substCounter(Node **link, int d) {
+  // down the left operands in a loop, see node.c
+  for (Node *node; (node = *link); link = &node->left) {
+    if (isCounter(node)) {
+      Node *plus =
+          newLoopBinary(ND_ADD, node, newLoopNum(d, node->tok), TyInt);
+      plus->next = node->next;
+      node->next = NULL;
+      *link = plus;
+      return;
+    }
+
+    substCounter(&node->right, d);
+    substCounter(&node->cond, d);
+    substCounter(&node->then, d);
+    substCounter(&node->els, d);
+    substCounter(&node->init, d);
+    substCounter(&node->inc, d);
+    substList(&node->body, d);
+    substList(&node->args, d);
+    // the variable being assigned stays where it is, and so does the one
+    // whose address is taken
+    if (node->nodeType == ND_ASSIGN && node->left->nodeType == ND_VAR)
+      return;
+    if (node->nodeType == ND_ADDR && node->left->nodeType == ND_VAR)
+      return;
+  }
+}
+
+static void substList(Node **list, int d) {
+  for (Node **link = list; *link; link = &(*link)->next)
+    substCounter(link, d);
+}
+
+// appends a statement to a list, returns the new tail
+static Node *appendStmt(Node *tail, Node *stmt) {
+  tail->next = stmt;
+  while (tail->next)
+    tail = tail->next;
+  return tail;
+}
+
+static Node *copyStmt(Node *node) {
+  return node ? copyNode(node, NULL, NULL, 0) : NULL;
+}
+
+static Node *incStmt(Node *loop) {
+  return newLoopNode(ND_EXPR_STMT, copyNode(loop->inc, NULL, NULL, 0),
+                     loop->tok);
+}
+
+// for (i = k; i < n; i = i + c) body  =>  { i = k; body; i = i + c; ... }
+static void unrollFully(Node *loop, long trips) {
+  Node head = {};
+  Node *tail = appendStmt(&head, loop->init);
+  for (long t = 0; t < trips; t++) {
+    if (loop->then)
+      tail = appendStmt(tail, copyStmt(loop->then));
+    tail = appendStmt(tail, incStmt(loop));
+  }
+  replaceWithBlock(loop, head.next);
+  PeelCnt++;
+}
+
+// for (init; i < n; i = i + c) body  =>
+//   init;
+//   if (n - (f-1)*c < n)
+//     for (; i < n - (f-1)*c; i = i + f*c) { body[i]; body[i+c]; ... }
+//   for (; i < n; i = i + c) body
+// the copies of the body see i + j*c instead of i. If memory may hold the
+// value of i, i is incremented between the copies instead. The bound of the
+// main loop is moved rather than i, which may be anything on entry: i +
+// (f-1)*c could wrap around. n - (f-1)*c wraps only for n within (f-1)*c of
+// the end of int, then the main loop is skipped.
+static void unrollBy(Node *loop, int factor, bool subst) {
+  Node *main = newLoopNode(ND_LOOP, NULL, loop->tok);
+  Node *rest = newLoopNode(ND_LOOP, NULL, loop->tok);
+  rest->cond = loop->cond;
+  rest->then = loop->then;
+  rest->inc = loop->inc;
+
+  int k = (factor - 1) * Step;
+  main->cond = copyNode(loop->cond, NULL, NULL, 0);
+  Node **link =
+      isCounter(main->cond->left) ? &main->cond->right : &main->cond->left;
+  Node *bound = *link;
+  *link = newLoopBinary(ND_SUB, bound, newLoopNum(k, bound->tok), TyInt);
+  Node *moved = newLoopBinary(ND_SUB, copyNode(bound, NULL, NULL, 0),
+                              newLoopNum(k, bound->tok), TyInt);
+  Node *guard = newLoopNode(ND_IF, NULL, loop->tok);
+  guard->cond = k > 0 ? newLoopBinary(ND_LT, moved,
+                                      copyNode(bound, NULL, NULL, 0), TyInt)
+                      : newLoopBinary(ND_LT, copyNode(bound, NULL, NULL, 0),
+                                      moved, TyInt);
+  guard->then = main;
+
+  Node head = {};
+  Node *tail = &head;
+  for (int j = 0; j < factor; j++) {
+    Node *body = copyStmt(loop->then);
+    if (subst && j > 0)
+      substCounter(&body, j * Step);
+    if (body)
+      tail = appendStmt(tail, body);
+    if (!subst && j < factor - 1)
+      tail = appendStmt(tail, incStmt(loop));
+  }
+  main->then = newLoopNode(ND_BLOCK, NULL, loop->tok);
+  main->then->body = head.next;
+
+  if (subst) {
+    Node *step =
+        newLoopBinary(ND_ADD, newLoopVar(Counter, loop->tok),
+                      newLoopNum(factor * Step, loop->tok), TyInt);
+    main->inc = newLoopBinary(ND_ASSIGN, newLoopVar(Counter, loop->tok),
+                              step, Counter->dataType);
+  } else {
+    main->inc = copyNode(loop->inc, NULL, NULL, 0);
+  }
+
+  guard->next = rest;
+  if (loop->init) {
+    loop->init->next = guard;
+    replaceWithBlock(loop, loop->init);
+  } else {
+    replaceWithBlock(loop, guard);
+  }
+  UnrollCnt++;
+}
+
+// unroll the loop if it fits in the budget, returns whether it did
+static bool unrollLoop(Node *loop) {
+  if (!UnrollLoops || !findCounter(loop))
+    return false;
+
+  int size = countNodes(loop->then) + countNodes(loop->inc);
+  long trips = tripCount(loop);
+  if (trips >= 0 && trips * size <= UnrollLimit) {
+    unrollFully(loop, trips);
+    return true;
+  }
+
+  // the test of the main loop only covers all the copies if i moves
+  // towards n
+  Node *cond = loop->cond;
+  if (!counterBound(cond) || cond->nodeType == ND_NE ||
+      (isCounter(cond->left) ? Step < 0 : Step > 0))
+    return false;
+
+  for (int factor = 8; factor >= 2; factor /= 2) {
+    if (factor * size > UnrollLimit || (trips >= 0 && trips < factor))
+      continue;
+    // a pointer to i reads it as it is, not as i + j*c
+    unrollBy(loop, factor,
+             (!AddrTaken || !readsMemory(loop->then)) &&
+                 !takesAddrOf(CurrentFn->body, Counter));
+    return true;
+  }
+  return false;
+}
+
+// while (...) { ...; i = i + c; }  =>  for (; ...; i = i + c) { ... }
+// there is no continue, so the last statement of the body is always
+// followed by the test
+static void moveIncrement(Node *loop) {
+  if (loop->inc || !loop->then || loop->then->nodeType != ND_BLOCK ||
+      !loop->then->body)
+    return;
+
+  Node **link = &loop->then->body;
+  while ((*link)->next)
+    link = &(*link)->next;
+  Node *last = *link;
+  if (last->nodeType != ND_EXPR_STMT || last->left->nodeType != ND_ASSIGN ||
+      last->left->left->nodeType != ND_VAR)
+    return;
+
+  Counter = last->left->left->var;
+  if (!counterStep(last->left))
+    return;
+  *link = NULL;
+  loop->inc = last->left;
+}
+
+static void optimizeLoopBody(Node *loop) {
+  moveInvariants(reduceInductionVars(loop));
+}
+
+// inner loops come first, what they move out may move out further
+static void optimizeLoop(Node *node) {
+  // the left operands come first, the nodes down them are visited bottom up
+  // in a loop (see node.c)
+  Node **chain;
+  int cnt = leftChain(node, NULL, &chain);
+  for (int i = cnt - 1; i >= 0; i--) {
+    node = chain[i];
+    optimizeLoop(node->right);
+    optimizeLoop(node->cond);
+    optimizeLoop(node->then);
+    optimizeLoop(node->els);
+    optimizeLoop(node->init);
+    optimizeLoop(node->inc);
+    for (Node *n = node->body; n; n = n->next)
+      optimizeLoop(n);
+    for (Node *n = node->args; n; n = n->next)
+      optimizeLoop(n);
+
+    if (node->nodeType != ND_LOOP)
+      continue;
+
+    moveIncrement(node);
+    // a loop which runs on vectors keeps its shape, see vector.c
+    VecLoop *vl = vectorLoop(CurrentFn, node);
+    if (vl) {
+      node->vectorize = true;
+      VectorCnt++;
+      free(vl);
+      continue;
+    }
+    if (!unrollLoop(node)) {
+      optimizeLoopBody(node);
+      continue;
+    }
+
+    // the main and remainder loops of a partially unrolled loop, the main
+    // one under the test of its bound
+    for (Node *n = node->body; n; n = n->next) {
+      Node *l = n->nodeType == ND_IF ? n->then : n;
+      if (l->nodeType == ND_LOOP)
+        optimizeLoopBody(l);
+    }
+  }
+  free(chain);
+}
+
+void optimizeLoops(Function *prog) {
+  for (Function *fn = prog; fn; fn = fn->next) {
+    CurrentFn = fn;
+    AddrTaken = takesAddr(fn->body);
+    optimizeLoop(fn->body);
+  }
+
+  free(Written);
+  Written = NULL;
+  WrittenCnt = 0;
+}
+
+void reportLoops() {
+  fprintf(stderr, "licm: %d expressions moved out of loops\n", HoistCnt);
+  fprintf(stderr, "ivs: %d induction expressions reduced, %d counters removed\n",
+          ReduceCnt, CounterCnt);
+  fprintf(stderr, "unroll: %d loops unrolled, %d fully\n", UnrollCnt + PeelCnt,
+          PeelCnt);
+  fprintf(stderr, "vectorize: %d loops vectorized\n", VectorCnt);
+}
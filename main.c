@@ -1,18 +1,255 @@
 #include "rvcc.h"
 
+// optimization level, set by -O<n>
+int OptLevel;
+// print statistics of the optimization passes
+bool OptReport;
+// interpret the program instead of compiling it, set by -run
+static bool Run;
+// write the AST to this file instead of compiling, set by -emit-ast <file>
+static char *ASTPath;
+
+static void usage(char *prog, int status) {
+  fprintf(stderr,
+          "%s [ -O<n> ] [ -finline-limit=<n> ] [ -funroll-loops ] "
+          "[ -funroll-limit=<n> ] [ -fopt-report ] [ -fcache-dir=<dir> ] "
+          "[ -fcache-limit=<n> ] [ -fprofile-generate ] "
+          "[ -fprofile-use=<file> ] [ -finstrument-functions ] "
+          "[ -fwhole-program ] "
+          "[ -march=<isa> ] [ -run ] [ -emit-ast <file> ] "
+          "<program | file.c | file.rast>\n",
+          prog);
+  exit(status);
+}
+
+// the extensions of -march=rv64<letters>_<name>_<name>..., G stands for
+// IMAFD
+static void parseMarch(char *isa) {
+  if (strncmp(isa, "rv64", 4))
+    error("-march=%s: only rv64 is supported", isa);
+  char *p = isa + 4;
+  for (; *p && *p != '_'; p++) {
+    if (*p == 'c')
+      IsaC = true;
+    else if (*p == 'v')
+      IsaV = true;
+    else if (!strchr("gimafd", *p))
+      error("-march=%s: unsupported extension '%c'", isa, *p);
+  }
+
+  while (*p == '_') {
+    char *name = ++p;
+    int len = strcspn(name, "_");
+    p += len;
+    if (len == 3 && !strncmp(name, "zba", 3))
+      IsaZba = true;
+    else if (len == 3 && !strncmp(name, "zbb", 3))
+      IsaZbb = true;
+    else
+      error("-march=%s: unsupported extension '%.*s'", isa, len, name);
+  }
+}
+
+// whether the input names a file holding the program, for programs too
+// long for the command line
+static bool isSourceFile(char *path) {
+  int len = strlen(path);
+  return len > 2 && !strcmp(path + len - 2, ".c");
+}
+
+static char *readFile(char *path) {
+  FILE *in = fopen(path, "r");
+  if (!in)
+    error("cannot open %s", path);
+
+  char *buf;
+  size_t size;
+  FILE *out = open_memstream(&buf, &size);
+  char line[4096];
+  for (size_t n; (n = fread(line, 1, sizeof(line), in));)
+    fwrite(line, 1, n, out);
+  fclose(out);
+  fclose(in);
+  return buf;
+}
+
+// parse the command line options, returns the program to be compiled
+static char *parseArgs(int argc, char **argv) {
+  char *input = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--help"))
+      usage(argv[0], 0);
+
+    // -O, -O0, -O1, -O2 ...
+    if (!strncmp(argv[i], "-O", 2)) {
+      OptLevel = argv[i][2] ? atoi(argv[i] + 2) : 1;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-run")) {
+      Run = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fopt-report")) {
+      OptReport = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-finline-limit=", 15)) {
+      InlineLimit = atoi(argv[i] + 15);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-funroll-loops")) {
+      UnrollLoops = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-funroll-limit=", 15)) {
+      UnrollLimit = atoi(argv[i] + 15);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fcache-dir=", 12)) {
+      CacheDir = argv[i] + 12;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fcache-limit=", 14)) {
+      CacheLimit = atol(argv[i] + 14);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fprofile-generate")) {
+      ProfileGenerate = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fprofile-use=", 14)) {
+      ProfileUse = argv[i] + 14;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-finstrument-functions")) {
+      InstrumentFunctions = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fwhole-program")) {
+      WholeProgram = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-march=", 7)) {
+      parseMarch(argv[i] + 7);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-emit-ast")) {
+      if (++i == argc)
+        usage(argv[0], 1);
+      ASTPath = argv[i];
+      continue;
+    }
+
+    if (input)
+      error("%s: Invalid number of arguments %d", argv[0], argc);
+    input = argv[i];
+  }
+
+  if (!input)
+    usage(argv[0], 1);
+  // the interpreter has no cycle counter to read
+  if (Run && InstrumentFunctions)
+    error("%s: -finstrument-functions can not be used with -run", argv[0]);
+  return input;
+}
+
+static bool hasMain(Function *prog) {
+  for (Function *fn = prog; fn; fn = fn->next)
+    if (!strcmp(fn->name, "main"))
+      return true;
+  return false;
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    error("%s: Invalid number of arguments %d", argv[0], argc);
+  char *input = parseArgs(argc, argv);
+
+  Function *prog;
+  if (isASTFile(input)) {
+    // the program has been parsed already
+    prog = readAST(input);
+  } else {
+    if (isSourceFile(input))
+      input = readFile(input);
+
+    // parse the input to generate a stream of tokens
+    Token *tok = tokenize(input);
+
+    // parse the stream of tokens, the whole program is needed to run it
+    // or to write its AST. The counters of an instrumented program are
+    // numbered across all of its functions, and -fwhole-program looks at
+    // the calls of every function.
+    prog = CacheDir && !Run && !ASTPath && !ProfileGenerate && !WholeProgram
+               ? parseCached(tok)
+               : parse(tok);
   }
 
-  // parse argv[1] to generate a stream of tokens
-  Token *tok = tokenize(argv[1]);
+  if (ASTPath) {
+    writeAST(prog, input, ASTPath);
+    return 0;
+  }
 
-  // parse the stream of tokens
-  Function *prog = parse(tok);
+  // the counters are written when main returns, and a profile holds the
+  // offsets of a single source file: the other files of a program would
+  // be left out
+  if (ProfileGenerate && !hasMain(prog))
+    error("%s: -fprofile-generate needs the file which defines main",
+          argv[0]);
+
+  if (ProfileUse)
+    readProfile();
+
+  // optimize
+  if (OptLevel >= 2)
+    inlineFunctions(prog);
+  // after inlining, which may leave a function no calls
+  prog = optimizeCalls(prog);
+  if (OptLevel >= 1) {
+    propagateConstants(prog);
+    optimizeLoops(prog);
+    // unrolled loops have constant counters
+    propagateConstants(prog);
+    eliminateCommonSubexprs(prog);
+    eliminateDeadCode(prog);
+    colorStackSlots(prog);
+  }
+
+  // the exit status is the value of main
+  if (Run)
+    return runProgram(prog);
 
   // codegen
   codegen(prog);
+  if (CacheDir)
+    evictCache();
+
+  if (OptReport && OptLevel >= 1) {
+    reportPropagate();
+    reportLoops();
+    reportCse();
+    reportDeadCode();
+    reportStackSlots();
+    reportPeephole();
+  }
+  if (OptReport && WholeProgram)
+    reportCalls();
+  if (OptReport && IsaC)
+    reportCompress();
+  if (OptReport && CacheDir)
+    reportCache();
 
   return 0;
-}
\ No newline at end of file
+}
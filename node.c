@@ -0,0 +1,200 @@
+/*
+ *  Helpers for walking and rewriting the AST, shared by the optimization
+ *  passes
+ *
+ *  A chain like a+b+c+... nests to the left, one level for each operator,
+ *  so it is as deep as it is long. The walks below loop down the left
+ *  operands and only recurse into the other children, and the ones which
+ *  have to visit such a chain bottom up collect it with leftChain() first:
+ *  the native stack they take does not grow with the length of a chain.
+ */
+
+#include "rvcc.h"
+
+// the children of node other than left, copied into cp
+static void copyChildren(Node *cp, Node *node, Obj **from, Obj **to,
+                         int nvars) {
+  cp->right = copyNode(node->right, from, to, nvars);
+  cp->cond = copyNode(node->cond, from, to, nvars);
+  cp->then = copyNode(node->then, from, to, nvars);
+  cp->els = copyNode(node->els, from, to, nvars);
+  cp->init = copyNode(node->init, from, to, nvars);
+  cp->inc = copyNode(node->inc, from, to, nvars);
+
+  Node head = {};
+  Node *cur = &head;
+  for (Node *n = node->body; n; n = n->next)
+    cur = cur->next = copyNode(n, from, to, nvars);
+  cp->body = head.next;
+
+  head.next = NULL;
+  cur = &head;
+  for (Node *n = node->args; n; n = n->next)
+    cur = cur->next = copyNode(n, from, to, nvars);
+  cp->args = head.next;
+}
+
+// deep copy of a node and everything under it, the variables in from[i]
+// are replaced by to[i]
+Node *copyNode(Node *node, Obj **from, Obj **to, int nvars) {
+  Node *ret = NULL;
+  Node **link = &ret;
+  for (; node; node = node->left) {
+    Node *cp = calloc(1, sizeof(Node));
+    *cp = *node;
+    cp->next = NULL;
+
+    for (int i = 0; i < nvars; i++)
+      if (cp->var == from[i])
+        cp->var = to[i];
+
+    copyChildren(cp, node, from, to, nvars);
+    *link = cp;
+    link = &cp->left;
+  }
+  *link = NULL;
+  return ret;
+}
+
+// number of nodes in the tree, used as a size estimate of generated code
+int countNodes(Node *node) {
+  int cnt = 0;
+  for (; node; node = node->left) {
+    cnt += 1 + countNodes(node->right) + countNodes(node->cond) +
+           countNodes(node->then) + countNodes(node->els) +
+           countNodes(node->init) + countNodes(node->inc);
+    for (Node *n = node->body; n; n = n->next)
+      cnt += countNodes(n);
+    for (Node *n = node->args; n; n = n->next)
+      cnt += countNodes(n);
+  }
+  return cnt;
+}
+
+// whether the address of a local variable is taken anywhere in the tree
+bool takesAddr(Node *node) {
+  for (; node; node = node->left) {
+    if (node->nodeType == ND_ADDR)
+      return true;
+    if (takesAddr(node->right) || takesAddr(node->cond) ||
+        takesAddr(node->then) || takesAddr(node->els) ||
+        takesAddr(node->init) || takesAddr(node->inc))
+      return true;
+    for (Node *n = node->body; n; n = n->next)
+      if (takesAddr(n))
+        return true;
+    for (Node *n = node->args; n; n = n->next)
+      if (takesAddr(n))
+        return true;
+  }
+  return false;
+}
+
+// whether the tree takes the address of var
+bool takesAddrOf(Node *node, Obj *var) {
+  for (; node; node = node->left) {
+    if (node->nodeType == ND_ADDR && node->left->nodeType == ND_VAR &&
+        node->left->var == var)
+      return true;
+    if (takesAddrOf(node->right, var) || takesAddrOf(node->cond, var) ||
+        takesAddrOf(node->then, var) || takesAddrOf(node->els, var) ||
+        takesAddrOf(node->init, var) || takesAddrOf(node->inc, var))
+      return true;
+    for (Node *n = node->body; n; n = n->next)
+      if (takesAddrOf(n, var))
+        return true;
+    for (Node *n = node->args; n; n = n->next)
+      if (takesAddrOf(n, var))
+        return true;
+  }
+  return false;
+}
+
+// whether the expression can be dropped without changing anything
+bool isPureExpr(Node *node) {
+  while (true) {
+    switch (node->nodeType) {
+    case ND_NUM:
+    case ND_VAR:
+      return true;
+    case ND_ADDR:
+      return node->left->nodeType == ND_VAR;
+    case ND_NEG:
+      node = node->left;
+      continue;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+      if (!isPureExpr(node->right))
+        return false;
+      node = node->left;
+      continue;
+    default:
+      return false;
+    }
+  }
+}
+
+bool sameExpr(Node *a, Node *b) {
+  for (;; a = a->left, b = b->left) {
+    if (a->nodeType != b->nodeType)
+      return false;
+
+    switch (a->nodeType) {
+    case ND_NUM:
+      return a->val == b->val;
+    case ND_VAR:
+      return a->var == b->var;
+    case ND_ADDR:
+    case ND_NEG:
+      continue;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+      if (!sameExpr(a->right, b->right))
+        return false;
+      continue;
+    default:
+      return false;
+    }
+  }
+}
+
+bool isBinary(Node *node) {
+  switch (node->nodeType) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+int leftChain(Node *node, bool (*inChain)(Node *node), Node ***chain) {
+  int cnt = 0, cap = 16;
+  *chain = malloc(sizeof(Node *) * cap);
+  for (; node && (!inChain || inChain(node)); node = node->left) {
+    if (cnt == cap) {
+      cap *= 2;
+      *chain = realloc(*chain, sizeof(Node *) * cap);
+    }
+    (*chain)[cnt++] = node;
+  }
+  return cnt;
+}
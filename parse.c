@@ -357,22 +357,22 @@ Node *relational(Token **rest, Token *tok) {
     Token *start = tok;
 
     if (tokenCompare(tok, "<")) {
-      node = newBinary(ND_LT, node, relational(&tok, tok->next), start);
+      node = newBinary(ND_LT, node, add(&tok, tok->next), start);
       continue;
     }
 
     if (tokenCompare(tok, "<=")) {
-      node = newBinary(ND_LE, node, relational(&tok, tok->next), start);
+      node = newBinary(ND_LE, node, add(&tok, tok->next), start);
       continue;
     }
 
     if (tokenCompare(tok, ">")) {
-      node = newBinary(ND_LT, relational(&tok, tok->next), node, start);
+      node = newBinary(ND_LT, add(&tok, tok->next), node, start);
       continue;
     }
 
     if (tokenCompare(tok, ">=")) {
-      node = newBinary(ND_LE, relational(&tok, tok->next), node, start);
+      node = newBinary(ND_LE, add(&tok, tok->next), node, start);
       continue;
     }
 
@@ -403,8 +403,9 @@ static Node *newAdd(Node *left, Node *right, Token *tok) {
   }
 
   // ptr + num
-  right = newBinary(ND_MUL, right, newNum(8, tok),
-                    tok); // ptr + 1 (1 means 8 bytes, so need to MUL 8 first)
+  // ptr + 1 means the next element, so scale by the size of the base type
+  right = newBinary(ND_MUL, right, newNum(left->dataType->base->size, tok),
+                    tok);
   return newBinary(ND_ADD, left, right, tok);
 }
 
@@ -419,7 +420,8 @@ static Node *newSub(Node *left, Node *right, Token *tok) {
 
   // ptr - num
   if (left->dataType->base && isInteger(right->dataType)) {
-    right = newBinary(ND_MUL, right, newNum(8, tok), tok);
+    right = newBinary(ND_MUL, right, newNum(left->dataType->base->size, tok),
+                      tok);
     addType(right);
     Node *node = newBinary(ND_SUB, left, right, tok);
     node->dataType = left->dataType;
@@ -430,7 +432,8 @@ static Node *newSub(Node *left, Node *right, Token *tok) {
   if (left->dataType->base && right->dataType->base) {
     Node *node = newBinary(ND_SUB, left, right, tok);
     node->dataType = TyInt;
-    return newBinary(ND_DIV, node, newNum(8, tok), tok);
+    return newBinary(ND_DIV, node, newNum(left->dataType->base->size, tok),
+                     tok);
   }
 
   errorTok(tok, "invalid operands");
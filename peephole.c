@@ -0,0 +1,625 @@
+/*
+ *  Peephole optimization
+ *
+ *  The stack machine in codegen.c produces many short, obviously redundant
+ *  sequences. The rules below rewrite them on the instruction list of a
+ *  function (see emit.c) before it is printed. Rules only look within a
+ *  basic block, a label ends the block.
+ */
+
+#include "rvcc.h"
+
+// =================================================================
+// what instructions read and write
+
+static bool isOp(Inst *inst, char *op) {
+  return inst->op && !strcmp(inst->op, op);
+}
+
+static bool isReg(char *s) {
+  static char *regs[] = {
+      "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "fp", "s0", "s1",
+      "a0",   "a1", "a2", "a3", "a4", "a5", "a6", "a7", "s2", "s3", "s4",
+      "s5",   "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6",
+  };
+  for (int i = 0; i < sizeof(regs) / sizeof(*regs); i++)
+    if (!strcmp(s, regs[i]))
+      return true;
+  return false;
+}
+
+// for a memory operand "off(base)", returns the base register and the offset
+static char *memBase(char *arg, int *off) {
+  char *lp = strchr(arg, '(');
+  if (!lp)
+    return NULL;
+  static char base[8];
+  snprintf(base, sizeof(base), "%.*s", (int)strcspn(lp + 1, ")"), lp + 1);
+  *off = atoi(arg);
+  return base;
+}
+
+static bool isLoad(Inst *inst) {
+  return isOp(inst, "ld") || isOp(inst, "lw") || isOp(inst, "lwu") ||
+         isOp(inst, "lb") || isOp(inst, "lbu") || isOp(inst, "lh") ||
+         isOp(inst, "lhu");
+}
+
+static bool isStore(Inst *inst) {
+  return isOp(inst, "sd") || isOp(inst, "sw") || isOp(inst, "sh") ||
+         isOp(inst, "sb");
+}
+
+// vse32.v and the like, which store a vector register to memory
+static bool isVectorStore(Inst *inst) {
+  return !strncmp(inst->op, "vse", 3) && isdigit(inst->op[3]);
+}
+
+static bool isCall(Inst *inst) { return isOp(inst, "call"); }
+
+// instructions after which the next one to run is not the next in the list
+static bool isJump(Inst *inst) {
+  return isOp(inst, "j") || isOp(inst, "jr") || isOp(inst, "ret") ||
+         isOp(inst, "tail") || !strncmp(inst->op, "b", 1);
+}
+
+static bool isArgReg(char *reg) { return reg[0] == 'a' && isdigit(reg[1]); }
+
+// registers a call may overwrite
+static bool isCallerSaved(char *reg) {
+  return isArgReg(reg) || (reg[0] == 't' && isdigit(reg[1])) ||
+         !strcmp(reg, "ra");
+}
+
+// ALU instructions and loads write their first operand
+static bool writesFirst(Inst *inst) {
+  return !isStore(inst) && !isJump(inst) && !isCall(inst) &&
+         inst->nargs > 0 && isReg(inst->args[0]);
+}
+
+static bool reads(Inst *inst, char *reg) {
+  if (isCall(inst) || isOp(inst, "tail"))
+    return isArgReg(reg);
+  if (isOp(inst, "ret"))
+    return !strcmp(reg, "a0") || !strcmp(reg, "ra");
+
+  for (int i = writesFirst(inst) ? 1 : 0; i < inst->nargs; i++) {
+    int off;
+    char *base = memBase(inst->args[i], &off);
+    if (!strcmp(inst->args[i], reg) || (base && !strcmp(base, reg)))
+      return true;
+  }
+  return false;
+}
+
+static bool writes(Inst *inst, char *reg) {
+  if (isCall(inst))
+    return isCallerSaved(reg);
+  return writesFirst(inst) && !strcmp(inst->args[0], reg);
+}
+
+// whether the instruction uses the register at all
+static bool touches(Inst *inst, char *reg) {
+  return reads(inst, reg) || writes(inst, reg);
+}
+
+// the next instruction in the same basic block, NULL at the end of the block
+static Inst *nextInBlock(Inst *inst) {
+  if (isJump(inst))
+    return NULL;
+  for (Inst *i = inst->next; i; i = i->next) {
+    if (i->label)
+      return NULL;
+    if (i->op)
+      return i;
+  }
+  return NULL;
+}
+
+// labels of the function being optimized
+static Inst **Labels;
+static int LabelCnt;
+
+static Inst *findLabel(char *name) {
+  for (int i = 0; i < LabelCnt; i++)
+    if (!strcmp(Labels[i]->label, name))
+      return Labels[i];
+  return NULL;
+}
+
+// whether the value of reg is never read after inst on any path. Jumps are
+// followed up to depth times, beyond that the value is assumed to be used.
+static bool isDeadFrom(Inst *inst, char *reg, int depth) {
+  for (Inst *i = inst->next; i; i = i->next) {
+    if (!i->op)
+      continue;
+    if (reads(i, reg))
+      return false;
+    if (writes(i, reg))
+      return true;
+    // only a0 and the callee saved registers matter to our caller
+    if (isOp(i, "ret"))
+      return isCallerSaved(reg);
+    if (isOp(i, "tail") || isOp(i, "jr"))
+      return false;
+    if (isJump(i)) {
+      Inst *target = findLabel(i->args[i->nargs - 1]);
+      if (depth == 0 || !target || !isDeadFrom(target, reg, depth - 1))
+        return false;
+      if (isOp(i, "j"))
+        return true;
+    }
+  }
+  return false;
+}
+
+static bool isDeadAfter(Inst *inst, char *reg) {
+  return isDeadFrom(inst, reg, 4);
+}
+
+// the previous instruction in the same basic block
+static Inst *prevInBlock(Inst *inst) {
+  for (Inst *i = inst->prev; i && !i->label; i = i->prev) {
+    if (i->op)
+      return isJump(i) ? NULL : i;
+  }
+  return NULL;
+}
+
+// instructions that compute their first operand and do nothing else
+static bool isPure(Inst *inst) {
+  static char *pure[] = {
+      "li",     "mv",     "neg",    "negw",   "addi", "addiw", "add",
+      "addw",   "sub",    "subw",   "mul",    "mulw", "div",   "divw",
+      "xor",    "xori",   "slt",    "seqz",   "snez", "ld",    "lw",
+      "slli",   "srli",   "srai",   "srliw",  "sraiw", "sh1add", "sh2add",
+      "sh3add", "sext.w", "min",    "max",
+  };
+  for (int i = 0; i < sizeof(pure) / sizeof(*pure); i++)
+    if (isOp(inst, pure[i]))
+      return writesFirst(inst);
+  return false;
+}
+
+static char *format(char *fmt, ...) {
+  char *buf;
+  size_t size;
+  FILE *out = open_memstream(&buf, &size);
+  va_list va;
+  va_start(va, fmt);
+  vfprintf(out, fmt, va);
+  va_end(va);
+  fclose(out);
+  return buf;
+}
+
+static void rewrite(Inst *inst, char *op, char *a0, char *a1, char *a2) {
+  char *args[] = {a0, a1, a2};
+  int nargs = a2 ? 3 : a1 ? 2 : a0 ? 1 : 0;
+  rewriteInst(inst, op, nargs, args);
+}
+
+// =================================================================
+// rules, each gets the first instruction of the sequence it may rewrite and
+// returns whether it did
+
+// addi sp, sp, -8; sd rX, 0(sp); ... ; ld rY, 0(sp); addi sp, sp, 8
+// => mv rY, rX; ...
+// if the instructions in between leave sp and rY alone
+static bool pushPop(Inst *inst) {
+  if (!isOp(inst, "addi") || strcmp(inst->args[0], "sp") ||
+      strcmp(inst->args[1], "sp") || strcmp(inst->args[2], "-8"))
+    return false;
+
+  Inst *sd = nextInBlock(inst);
+  if (!sd || !isOp(sd, "sd") || strcmp(sd->args[1], "0(sp)"))
+    return false;
+
+  Inst *ld = nextInBlock(sd);
+  for (int n = 0; ld && n < 16; n++, ld = nextInBlock(ld)) {
+    if (isCall(ld) || touches(ld, "sp"))
+      break;
+  }
+  if (!ld || !isOp(ld, "ld") || strcmp(ld->args[1], "0(sp)"))
+    return false;
+  Inst *addi = nextInBlock(ld);
+  if (!addi || !isOp(addi, "addi") || strcmp(addi->args[0], "sp") ||
+      strcmp(addi->args[1], "sp") || strcmp(addi->args[2], "8"))
+    return false;
+
+  char *rY = ld->args[0];
+
+  // a frame address or a constant is computed again instead of saved
+  Inst *def = prevInBlock(inst);
+  if (def && writes(def, sd->args[0]) &&
+      (isOp(def, "li") || (isOp(def, "addi") && !strcmp(def->args[1], "fp")))) {
+    char *args[] = {rY, def->args[1], def->args[2]};
+    rewriteInst(ld, def->op, def->nargs, args);
+    removeInst(inst);
+    removeInst(sd);
+    removeInst(addi);
+    return true;
+  }
+
+  for (Inst *i = nextInBlock(sd); i != ld; i = nextInBlock(i))
+    if (touches(i, rY))
+      return false;
+
+  if (strcmp(rY, sd->args[0]))
+    rewrite(inst, "mv", rY, sd->args[0], NULL);
+  else
+    removeInst(inst);
+  removeInst(sd);
+  removeInst(ld);
+  removeInst(addi);
+  return true;
+}
+
+// addi rA, rB, off; ... ; ld rC, imm(rA)  =>  ld rC, off+imm(rB)
+// the same for stores. rB is usually fp, or a pointer in a loop.
+static bool addrOffset(Inst *inst) {
+  if (!isOp(inst, "addi") || !strcmp(inst->args[0], "sp") ||
+      !strcmp(inst->args[0], "fp"))
+    return false;
+
+  char *rA = inst->args[0];
+  char *rB = inst->args[1];
+  Inst *use = nextInBlock(inst);
+  while (use && !reads(use, rA)) {
+    if (writes(use, rA) || writes(use, rB))
+      return false;
+    use = nextInBlock(use);
+  }
+  if (!use || !(isLoad(use) || isStore(use)))
+    return false;
+
+  int off;
+  char *base = memBase(use->args[1], &off);
+  if (strcmp(base, rA) || (isStore(use) && !strcmp(use->args[0], rA)))
+    return false;
+  off += atoi(inst->args[2]);
+  if (off < -2048 || off > 2047)
+    return false;
+  if (!(isLoad(use) && !strcmp(use->args[0], rA)) && !isDeadAfter(use, rA))
+    return false;
+
+  char *mem = format("%d(%s)", off, rB);
+  char *op = strdup(use->op);
+  char *reg = strdup(use->args[0]);
+  rewrite(use, op, reg, mem, NULL);
+  free(mem);
+  free(op);
+  free(reg);
+  removeInst(inst);
+  return true;
+}
+
+// op rA, ...; mv rB, rA  =>  op rB, ...  if rA is not needed afterwards
+static bool forwardMove(Inst *inst) {
+  if (!isPure(inst) || !strcmp(inst->args[0], "sp") ||
+      !strcmp(inst->args[0], "fp"))
+    return false;
+
+  Inst *mv = nextInBlock(inst);
+  if (!mv || !isOp(mv, "mv") || strcmp(mv->args[1], inst->args[0]) ||
+      !strcmp(mv->args[0], "sp") || !isDeadAfter(mv, inst->args[0]))
+    return false;
+
+  char *args[3];
+  args[0] = mv->args[0];
+  for (int i = 1; i < inst->nargs; i++)
+    args[i] = inst->args[i];
+  rewriteInst(mv, inst->op, inst->nargs, args);
+  removeInst(inst);
+  return true;
+}
+
+// mv rA, rB; op ..., rA, ...  =>  mv rA, rB; op ..., rB, ...
+// the mv is removed as dead code if rA is not read anymore
+static bool propagateMove(Inst *inst) {
+  if (!isOp(inst, "mv") || !strcmp(inst->args[0], inst->args[1]))
+    return false;
+
+  char *rA = inst->args[0];
+  char *rB = inst->args[1];
+  Inst *use = nextInBlock(inst);
+  if (!use || !reads(use, rA) || isCall(use) || isOp(use, "ret") ||
+      isOp(use, "tail") || !strcmp(rB, "sp") || !strcmp(rB, "fp"))
+    return false;
+
+  char *args[3];
+  char *mem = NULL;
+  for (int i = 0; i < use->nargs; i++) {
+    int off;
+    char *base = memBase(use->args[i], &off);
+    args[i] = use->args[i];
+    if (i == 0 && writesFirst(use))
+      continue;
+    if (!strcmp(use->args[i], rA))
+      args[i] = rB;
+    else if (base && !strcmp(base, rA))
+      args[i] = mem = format("%d(%s)", off, rB);
+  }
+  rewriteInst(use, use->op, use->nargs, args);
+  free(mem);
+  return true;
+}
+
+// a comparison whose only use is a beqz becomes a compare-and-branch:
+//   slt rX, rA, rB; beqz rX, L                 =>  bge rA, rB, L
+//   slt rX, rA, rB; xori rX, rX, 1; beqz rX, L =>  blt rA, rB, L
+//   xor rX, rA, rB; seqz rX, rX; beqz rX, L    =>  bne rA, rB, L
+//   xor rX, rA, rB; snez rX, rX; beqz rX, L    =>  beq rA, rB, L
+// and a bnez gets the opposite branch.
+static bool fuseBranch(Inst *inst) {
+  if (!isOp(inst, "slt") && !isOp(inst, "xor"))
+    return false;
+
+  char *rX = inst->args[0];
+  Inst *test = nextInBlock(inst);
+  if (!test)
+    return false;
+
+  char *op = NULL;
+  Inst *mid = NULL;
+  if (isOp(inst, "slt")) {
+    op = "bge";
+    if (isOp(test, "xori") && !strcmp(test->args[2], "1")) {
+      op = "blt";
+      mid = test;
+    }
+  } else if (isOp(test, "seqz") || isOp(test, "snez")) {
+    op = isOp(test, "seqz") ? "bne" : "beq";
+    mid = test;
+  }
+  if (!op)
+    return false;
+
+  if (mid) {
+    if (strcmp(mid->args[0], rX) || strcmp(mid->args[1], rX))
+      return false;
+    test = nextInBlock(mid);
+  }
+  if (!test || !(isOp(test, "beqz") || isOp(test, "bnez")) ||
+      strcmp(test->args[0], rX) || !isDeadAfter(test, rX))
+    return false;
+  if (isOp(test, "bnez")) {
+    static char *opposite[][2] = {
+        {"bge", "blt"}, {"blt", "bge"}, {"bne", "beq"}, {"beq", "bne"}};
+    for (int i = 0; i < 4; i++)
+      if (!strcmp(op, opposite[i][0])) {
+        op = opposite[i][1];
+        break;
+      }
+  }
+
+  char *args[] = {inst->args[1], inst->args[2], test->args[1]};
+  rewriteInst(test, op, 3, args);
+  if (mid)
+    removeInst(mid);
+  removeInst(inst);
+  return true;
+}
+
+// j L; L:  =>  L:
+static bool jumpNext(Inst *inst) {
+  if (!isOp(inst, "j"))
+    return false;
+
+  for (Inst *i = inst->next; i && !i->op; i = i->next) {
+    if (i->label && !strcmp(i->label, inst->args[0])) {
+      removeInst(inst);
+      return true;
+    }
+  }
+  return false;
+}
+
+// li rB, v; add rD, rA, rB  =>  addi rD, rA, v  (and sub with -v) when v
+// fits in an immediate and rB is not needed afterwards. addw and subw
+// become addiw.
+static bool addImm(Inst *inst) {
+  if (!isOp(inst, "li"))
+    return false;
+
+  Inst *add = nextInBlock(inst);
+  if (!add || add->nargs != 3 ||
+      !(isOp(add, "add") || isOp(add, "sub") || isOp(add, "addw") ||
+        isOp(add, "subw")))
+    return false;
+  bool word = isOp(add, "addw") || isOp(add, "subw");
+
+  char *rB = inst->args[0];
+  // only sub's second operand can take the immediate
+  bool second = !strcmp(add->args[2], rB);
+  bool sub = isOp(add, "sub") || isOp(add, "subw");
+  if (!second && (sub || strcmp(add->args[1], rB)))
+    return false;
+  char *rA = second ? add->args[1] : add->args[2];
+  if (!strcmp(rA, rB) || (strcmp(add->args[0], rB) && !isDeadAfter(add, rB)))
+    return false;
+
+  long v = strtol(inst->args[1], NULL, 0);
+  if (sub)
+    v = -v;
+  if (v < -2048 || v > 2047)
+    return false;
+
+  char *imm = format("%ld", v);
+  rewrite(add, word ? "addiw" : "addi", add->args[0], rA, imm);
+  free(imm);
+  removeInst(inst);
+  return true;
+}
+
+// bytes read or written by a load or store
+static int accessSize(Inst *inst) {
+  switch (inst->op[1]) {
+  case 'd':
+    return 8;
+  case 'w':
+    return 4;
+  case 'h':
+    return 2;
+  default:
+    return 1;
+  }
+}
+
+// ld rX, off(fp) when rY got the value of that slot earlier in the block
+// and still holds it  =>  mv rX, rY
+static bool reuseLoad(Inst *inst) {
+  if (!isLoad(inst))
+    return false;
+
+  int off;
+  if (strcmp(memBase(inst->args[1], &off), "fp"))
+    return false;
+  int size = accessSize(inst);
+
+  int n = 0;
+  for (Inst *i = prevInBlock(inst); i && n < 32; i = prevInBlock(i), n++) {
+    if (isCall(i) || writes(i, "fp") || isVectorStore(i))
+      return false;
+    if (!isLoad(i) && !isStore(i))
+      continue;
+
+    int o;
+    char *base = memBase(i->args[1], &o);
+    // the stack of temporaries is below the locals, anything else may point
+    // into the frame
+    if (!strcmp(base, "sp"))
+      continue;
+    if (strcmp(base, "fp")) {
+      if (isStore(i))
+        return false;
+      continue;
+    }
+
+    if (o == off && accessSize(i) == size) {
+      // a word is stored from a register holding an int, which is kept
+      // sign extended, so lw gives back the same register value
+      if (!isOp(i, inst->op) && !(isOp(i, "sd") && isOp(inst, "ld")) &&
+          !(isOp(i, "sw") && isOp(inst, "lw")))
+        return false;
+      char *rY = i->args[0];
+      for (Inst *j = i->next; j != inst; j = j->next)
+        if (j->op && writes(j, rY))
+          return false;
+
+      if (!strcmp(rY, inst->args[0]))
+        removeInst(inst);
+      else
+        rewrite(inst, "mv", inst->args[0], rY, NULL);
+      return true;
+    }
+
+    // another store to an overlapping part of the slot
+    if (isStore(i) && o < off + size && off < o + accessSize(i))
+      return false;
+  }
+  return false;
+}
+
+// li rX, v  when rX holds v already
+static bool knownValue(Inst *inst) {
+  if (!isOp(inst, "li"))
+    return false;
+
+  for (Inst *i = inst->prev; i && !i->label; i = i->prev) {
+    if (!i->op)
+      continue;
+    if (isJump(i) || writes(i, inst->args[0])) {
+      if (!isOp(i, "li") || strcmp(i->args[0], inst->args[0]) ||
+          strcmp(i->args[1], inst->args[1]))
+        return false;
+      removeInst(inst);
+      return true;
+    }
+  }
+  return false;
+}
+
+// mv rX, rX; addi rX, rX, 0
+static bool noEffect(Inst *inst) {
+  bool nop = (isOp(inst, "mv") && !strcmp(inst->args[0], inst->args[1])) ||
+             (isOp(inst, "addi") && !strcmp(inst->args[0], inst->args[1]) &&
+              atoi(inst->args[2]) == 0);
+  if (nop)
+    removeInst(inst);
+  return nop;
+}
+
+// an instruction without side effects whose result is never read
+static bool deadCode(Inst *inst) {
+  if (!isPure(inst))
+    return false;
+
+  char *rd = inst->args[0];
+  if (!strcmp(rd, "sp") || !strcmp(rd, "fp") || !strcmp(rd, "ra") ||
+      !strcmp(rd, "zero") || !isDeadAfter(inst, rd))
+    return false;
+  removeInst(inst);
+  return true;
+}
+
+typedef struct {
+  char *name;
+  bool (*apply)(Inst *inst);
+  int hits;
+} Rule;
+
+static Rule Rules[] = {
+    {"push-pop", pushPop},
+    {"addr-offset", addrOffset},
+    {"forward-move", forwardMove},
+    {"fuse-branch", fuseBranch},
+    {"add-imm", addImm},
+    {"reuse-load", reuseLoad},
+    {"propagate-move", propagateMove},
+    {"jump-next", jumpNext},
+    {"known-value", knownValue},
+    {"no-effect", noEffect},
+    {"dead-code", deadCode},
+};
+
+// =================================================================
+
+void peephole(Inst *insts) {
+  LabelCnt = 0;
+  for (Inst *inst = insts; inst; inst = inst->next) {
+    if (!inst->label)
+      continue;
+    Labels = realloc(Labels, sizeof(Inst *) * (LabelCnt + 1));
+    Labels[LabelCnt++] = inst;
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    Inst *inst = insts;
+    while (inst) {
+      bool hit = false;
+      if (inst->op) {
+        for (int i = 0; i < sizeof(Rules) / sizeof(*Rules); i++) {
+          if (Rules[i].apply(inst)) {
+            Rules[i].hits++;
+            hit = changed = true;
+            break;
+          }
+        }
+      }
+      // stay here, the rewritten instruction may match again
+      if (!hit)
+        inst = inst->next;
+      else if (inst->removed)
+        inst = inst->prev;
+    }
+  }
+}
+
+void reportPeephole() {
+  for (int i = 0; i < sizeof(Rules) / sizeof(*Rules); i++)
+    fprintf(stderr, "peephole: %-14s %d\n", Rules[i].name, Rules[i].hits);
+}
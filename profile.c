@@ -0,0 +1,147 @@
+/*
+ *  Profile guided optimization
+ *
+ *  With -fprofile-generate, the generated code (or the interpreter) counts
+ *  how many times each if, loop and call runs:
+ *
+ *  - "if" and "then" count an if statement and its then branch, the else
+ *    branch ran the difference;
+ *  - "loop" counts the times a loop is entered, "body" its iterations;
+ *  - "call" counts a call, inlined or not.
+ *
+ *  When main returns, the counts are written to the file named by the
+ *  RVCC_PROFILE environment variable, or rvcc.prof. Each line holds the
+ *  offset of the token of the node in the source, the kind of the counter
+ *  and the count. The same location may appear more than once, when its
+ *  code has been copied by inlining or unrolling; the counts add up.
+ *
+ *  The offsets are those of one source file, so only the file which
+ *  defines main can be built with -fprofile-generate.
+ *
+ *  -fprofile-use=<file> reads such a file back. Nodes find their counts
+ *  through the offset of their token, so the profile of a program applies
+ *  to the same program at any optimization level.
+ */
+
+#include "rvcc.h"
+
+// instrument the code, set by -fprofile-generate
+bool ProfileGenerate;
+// the profile to optimize with, set by -fprofile-use=<file>
+char *ProfileUse;
+
+static char *ProfKindNames[] = {"if", "then", "loop", "body", "call"};
+
+// the key of each counter of the program
+static long *Keys;
+static int KeyCnt;
+
+static long keyOf(Node *node, ProfKind kind) {
+  return (long)sourceOffset(node->tok) * 8 + kind;
+}
+
+int newCounter(Node *node, ProfKind kind) {
+  Keys = realloc(Keys, sizeof(long) * (KeyCnt + 1));
+  Keys[KeyCnt] = keyOf(node, kind);
+  return KeyCnt++;
+}
+
+int counterCnt() { return KeyCnt; }
+
+long counterKey(int i) { return Keys[i]; }
+
+static char *profilePath() {
+  char *path = getenv("RVCC_PROFILE");
+  return path && *path ? path : "rvcc.prof";
+}
+
+void writeProfile(long *counts) {
+  FILE *out = fopen(profilePath(), "w");
+  if (!out)
+    error("cannot open %s", profilePath());
+  for (int i = 0; i < KeyCnt; i++)
+    fprintf(out, "%ld %s %ld\n", Keys[i] / 8, ProfKindNames[Keys[i] % 8],
+            counts[i]);
+  fclose(out);
+}
+
+// =================================================================
+// -fprofile-use
+
+// the counts read from the profile, an open addressing hash table from key
+// to count, Cap is a power of two
+typedef struct {
+  long key; // -1 for an empty slot
+  long count;
+} Entry;
+
+static Entry *Entries;
+static int EntryCnt;
+static int Cap;
+// the largest count of each kind
+static long MaxCount[PROF_KINDS];
+
+static Entry *slotOf(long key) {
+  uint64_t h = (uint64_t)key * 0x9e3779b97f4a7c15;
+  int i = (h >> 32) & (Cap - 1);
+  while (Entries[i].key != -1 && Entries[i].key != key)
+    i = (i + 1) & (Cap - 1);
+  return &Entries[i];
+}
+
+static void grow() {
+  Entry *old = Entries;
+  int oldCap = Cap;
+  Cap = Cap ? Cap * 2 : 256;
+  Entries = malloc(sizeof(Entry) * Cap);
+  for (int i = 0; i < Cap; i++)
+    Entries[i].key = -1;
+  for (int i = 0; i < oldCap; i++)
+    if (old[i].key != -1)
+      *slotOf(old[i].key) = old[i];
+  free(old);
+}
+
+static void addCount(long key, long count) {
+  if ((EntryCnt + 1) * 2 > Cap)
+    grow();
+  Entry *e = slotOf(key);
+  if (e->key == -1) {
+    e->key = key;
+    e->count = 0;
+    EntryCnt++;
+  }
+  e->count += count;
+  if (e->count > MaxCount[key % 8])
+    MaxCount[key % 8] = e->count;
+}
+
+void readProfile() {
+  FILE *in = fopen(ProfileUse, "r");
+  if (!in)
+    error("cannot open %s", ProfileUse);
+
+  long offset, count;
+  char kind[16];
+  for (int line = 1;; line++) {
+    int n = fscanf(in, "%ld %15s %ld", &offset, kind, &count);
+    if (n == EOF)
+      break;
+    int k = 0;
+    while (k < PROF_KINDS && strcmp(ProfKindNames[k], kind))
+      k++;
+    if (n != 3 || offset < 0 || count < 0 || k == PROF_KINDS)
+      error("%s:%d: invalid profile", ProfileUse, line);
+    addCount(offset * 8 + k, count);
+  }
+  fclose(in);
+}
+
+long profileCount(Node *node, ProfKind kind) {
+  if (!Cap || !node->tok)
+    return -1;
+  Entry *e = slotOf(keyOf(node, kind));
+  return e->key == -1 ? -1 : e->count;
+}
+
+long maxProfileCount(ProfKind kind) { return MaxCount[kind]; }
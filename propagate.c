@@ -0,0 +1,554 @@
+/*
+ *  Constant and copy propagation
+ *
+ *  A forward dataflow analysis over the control flow of ND_BLOCK, ND_IF and
+ *  ND_LOOP: the state before each statement tells, for every local, whether
+ *  it holds a known constant, the same value as another local (a copy), or
+ *  anything. Paths join after an if and at the head of a loop, where the
+ *  analysis is repeated until the state does not change anymore. A return
+ *  ends its path, or goes to the join point of the inlined call it is in.
+ *
+ *  With the final states, reads of constant locals become numbers, reads of
+ *  copies read the original, constant expressions are folded, and an if or
+ *  loop whose condition is constant keeps only the code that can run. The
+ *  condition is evaluated on the way, so the branch that cannot run does
+ *  not spoil the state after the if.
+ *
+ *  If the function takes the address of a local, that local is not tracked,
+ *  and a store through a pointer or a call may change every other local as
+ *  well (see the *(&x+1) tests).
+ */
+
+#include "rvcc.h"
+
+// number of reads replaced, expressions folded and branches removed
+static int ConstCnt;
+static int CopyCnt;
+static int FoldCnt;
+static int BranchCnt;
+
+typedef enum {
+  LAT_UNDEF, // no value reaches this point yet
+  LAT_CONST, // always val
+  LAT_COPY,  // always the value of var
+  LAT_ANY,   // not known
+} LatKind;
+
+typedef struct {
+  LatKind kind;
+  int val;
+  Obj *var;
+} Lat;
+
+typedef struct {
+  bool reachable;
+  Lat *vals; // indexed by Obj.idx
+} State;
+
+static Function *CurrentFn;
+static int VarCnt;
+// whether a local is tracked: its address is never taken
+static bool *Tracked;
+static bool AddrTaken;
+
+// whether statements are rewritten, or only analyzed
+static bool Rewrite;
+
+// states at the returns of the inlined call being analyzed, NULL outside
+static State *ReturnState;
+
+static State newState() {
+  return (State){false, calloc(VarCnt, sizeof(Lat))};
+}
+
+static State copyState(State *st) {
+  State cp = newState();
+  cp.reachable = st->reachable;
+  memcpy(cp.vals, st->vals, sizeof(Lat) * VarCnt);
+  return cp;
+}
+
+static void assignState(State *to, State *from) {
+  to->reachable = from->reachable;
+  memcpy(to->vals, from->vals, sizeof(Lat) * VarCnt);
+}
+
+static bool equalLat(Lat a, Lat b) {
+  return a.kind == b.kind && (a.kind != LAT_CONST || a.val == b.val) &&
+         (a.kind != LAT_COPY || a.var == b.var);
+}
+
+static bool equalState(State *a, State *b) {
+  if (a->reachable != b->reachable)
+    return false;
+  for (int i = 0; i < VarCnt; i++)
+    if (!equalLat(a->vals[i], b->vals[i]))
+      return false;
+  return true;
+}
+
+static Lat meet(Lat a, Lat b) {
+  if (a.kind == LAT_UNDEF)
+    return b;
+  if (b.kind == LAT_UNDEF)
+    return a;
+  if (equalLat(a, b))
+    return a;
+  return (Lat){LAT_ANY};
+}
+
+// the join of two paths, into st
+static void meetState(State *st, State *other) {
+  if (!other->reachable)
+    return;
+  if (!st->reachable) {
+    assignState(st, other);
+    return;
+  }
+  for (int i = 0; i < VarCnt; i++)
+    st->vals[i] = meet(st->vals[i], other->vals[i]);
+}
+
+static bool isTracked(Obj *var) { return Tracked[var->idx]; }
+
+// var gets a new value, the copies of its old value are not copies anymore
+static void setVar(State *st, Obj *var, Lat val) {
+  for (int i = 0; i < VarCnt; i++)
+    if (st->vals[i].kind == LAT_COPY && st->vals[i].var == var)
+      st->vals[i] = (Lat){LAT_ANY};
+  st->vals[var->idx] = val;
+}
+
+// a store through a pointer, or a call, may change any local
+static void killAll(State *st) {
+  if (!AddrTaken)
+    return;
+  for (int i = 0; i < VarCnt; i++)
+    st->vals[i] = (Lat){LAT_ANY};
+}
+
+// node = val
+static void replaceWithNum(Node *node, int val) {
+  Node *next = node->next;
+  Token *tok = node->tok;
+  memset(node, 0, sizeof(Node));
+  node->nodeType = ND_NUM;
+  node->val = val;
+  node->dataType = TyInt;
+  node->tok = tok;
+  node->next = next;
+}
+
+// node = child, which keeps its own type
+static void replaceWithChild(Node *node, Node *child) {
+  Node *next = node->next;
+  *node = *child;
+  node->next = next;
+}
+
+// turn a statement into a block of the statement stmt, or an empty one
+static void replaceWithStmt(Node *node, Node *stmt) {
+  Node *next = node->next;
+  Token *tok = node->tok;
+  memset(node, 0, sizeof(Node));
+  node->nodeType = ND_BLOCK;
+  node->tok = tok;
+  node->body = stmt;
+  if (stmt)
+    stmt->next = NULL;
+  node->next = next;
+}
+
+// the value of l op r as an int, which wraps around like the instructions
+// with a w suffix do. Returns false if it can not be folded.
+static bool foldBinary(NodeType op, long l, long r, int *val) {
+  long v;
+  switch (op) {
+  case ND_ADD:
+    v = l + r;
+    break;
+  case ND_SUB:
+    v = l - r;
+    break;
+  case ND_MUL:
+    v = l * r;
+    break;
+  case ND_DIV:
+    // division by zero gives -1 on RISC-V, leave it to the hardware
+    if (r == 0)
+      return false;
+    v = l / r;
+    break;
+  case ND_EQ:
+    v = l == r;
+    break;
+  case ND_NE:
+    v = l != r;
+    break;
+  case ND_LT:
+    v = l < r;
+    break;
+  case ND_LE:
+    v = l <= r;
+    break;
+  default:
+    return false;
+  }
+  *val = (int32_t)(uint32_t)v;
+  return true;
+}
+
+// x + 0, x - 0, x * 1, x / 1  =>  x, and x * 0  =>  0
+static void simplify(Node *node) {
+  Node *l = node->left;
+  Node *r = node->right;
+  bool lnum = l->nodeType == ND_NUM;
+  bool rnum = r->nodeType == ND_NUM;
+
+  switch (node->nodeType) {
+  case ND_ADD:
+    if (rnum && r->val == 0)
+      replaceWithChild(node, l);
+    else if (lnum && l->val == 0 && node->dataType == r->dataType)
+      replaceWithChild(node, r);
+    else
+      return;
+    break;
+  case ND_SUB:
+    if (!(rnum && r->val == 0))
+      return;
+    replaceWithChild(node, l);
+    break;
+  case ND_MUL:
+    if (rnum && r->val == 1)
+      replaceWithChild(node, l);
+    else if (lnum && l->val == 1)
+      replaceWithChild(node, r);
+    else if ((rnum && r->val == 0 && isPureExpr(l)) ||
+             (lnum && l->val == 0 && isPureExpr(r)))
+      replaceWithNum(node, 0);
+    else
+      return;
+    break;
+  case ND_DIV:
+    if (!(rnum && r->val == 1))
+      return;
+    replaceWithChild(node, l);
+    break;
+  default:
+    return;
+  }
+  FoldCnt++;
+}
+
+static Lat propExpr(Node *node, State *st);
+static void propStmt(Node *node, State *st);
+
+// the value of a binary node from the values of its operands. It is only
+// replaced with the value if its operands are pure: (x=3)+1 is 4, but it
+// stores to x too.
+static Lat propBinary(Node *node, Lat l, Lat r, bool pure) {
+  int val;
+  // pointer arithmetic has a pointer operand, it is never constant
+  if (l.kind == LAT_CONST && r.kind == LAT_CONST &&
+      isInteger(node->dataType) &&
+      foldBinary(node->nodeType, l.val, r.val, &val)) {
+    if (Rewrite && pure) {
+      replaceWithNum(node, val);
+      FoldCnt++;
+    }
+    return (Lat){LAT_CONST, val};
+  }
+  if (Rewrite)
+    simplify(node);
+  return (Lat){LAT_ANY};
+}
+
+// in the order of genArgs(), see cse.c
+static void propArgs(Node *node, State *st) {
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    nargs++;
+  Node **args = calloc(nargs, sizeof(Node *));
+  int i = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    args[i++] = arg;
+
+  for (i = nargs - 1; i >= NARGREG; i--)
+    propExpr(args[i], st);
+  for (int simple = 0; simple < 2; simple++) {
+    for (i = 0; i < nargs && i < NARGREG; i++) {
+      Node *arg = args[i];
+      bool isSimple = arg->nodeType == ND_NUM || arg->nodeType == ND_VAR ||
+                      (arg->nodeType == ND_ADDR &&
+                       arg->left->nodeType == ND_VAR);
+      if (isSimple == simple)
+        propExpr(arg, st);
+    }
+  }
+  free(args);
+}
+
+// the value of the expression, rewriting it with what st knows
+static Lat propExpr(Node *node, State *st) {
+  switch (node->nodeType) {
+  case ND_NUM:
+    return (Lat){LAT_CONST, node->val};
+  case ND_VAR: {
+    if (!isTracked(node->var))
+      return (Lat){LAT_ANY};
+    Lat v = st->vals[node->var->idx];
+    if (v.kind == LAT_CONST && isInteger(node->dataType)) {
+      if (Rewrite) {
+        replaceWithNum(node, v.val);
+        ConstCnt++;
+      }
+      return v;
+    }
+    if (v.kind == LAT_COPY) {
+      if (Rewrite) {
+        node->var = v.var;
+        CopyCnt++;
+      }
+      return v;
+    }
+    // the value of this variable, as it is now
+    return (Lat){LAT_COPY, 0, node->var};
+  }
+  case ND_ASSIGN: {
+    if (node->left->nodeType == ND_DEREF)
+      propExpr(node->left->left, st);
+    Lat v = propExpr(node->right, st);
+    if (node->left->nodeType != ND_VAR) {
+      killAll(st);
+      return (Lat){LAT_ANY};
+    }
+
+    Obj *var = node->left->var;
+    if (!isTracked(var))
+      return v;
+    if (v.kind == LAT_COPY && (v.var == var || !isTracked(v.var)))
+      v = (Lat){LAT_ANY};
+    if (v.kind == LAT_CONST && !isInteger(var->dataType))
+      v = (Lat){LAT_ANY};
+    setVar(st, var, v);
+    return v;
+  }
+  case ND_FUNCALL:
+    propArgs(node, st);
+    killAll(st);
+    return (Lat){LAT_ANY};
+  case ND_INLINE: {
+    // every return of the body goes to the end of the node
+    State *outer = ReturnState;
+    State returns = newState();
+    ReturnState = &returns;
+    for (Node *n = node->body; n; n = n->next)
+      propStmt(n, st);
+    meetState(&returns, st);
+    assignState(st, &returns);
+    free(returns.vals);
+    ReturnState = outer;
+    return (Lat){LAT_ANY};
+  }
+  case ND_ADDR:
+    if (node->left->nodeType == ND_DEREF)
+      propExpr(node->left->left, st);
+    return (Lat){LAT_ANY};
+  case ND_DEREF:
+    propExpr(node->left, st);
+    return (Lat){LAT_ANY};
+  case ND_NEG: {
+    Lat v = propExpr(node->left, st);
+    if (v.kind != LAT_CONST || v.val == INT32_MIN)
+      return (Lat){LAT_ANY};
+    if (Rewrite && isPureExpr(node->left)) {
+      replaceWithNum(node, -v.val);
+      FoldCnt++;
+    }
+    return (Lat){LAT_CONST, -v.val};
+  }
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE: {
+    // the right operand is evaluated first, a chain like a+b+c+... in a
+    // loop (see node.c)
+    Node **chain;
+    int cnt = leftChain(node, isBinary, &chain);
+    Lat *r = calloc(cnt, sizeof(Lat));
+    for (int i = 0; i < cnt; i++)
+      r[i] = propExpr(chain[i]->right, st);
+    Lat l = propExpr(chain[cnt - 1]->left, st);
+    // whether the chain up to chain[i] is free of side effects, tested
+    // operand by operand rather than from each node down
+    bool pure = isPureExpr(chain[cnt - 1]->left);
+    for (int i = cnt - 1; i >= 0; i--) {
+      pure = pure && isPureExpr(chain[i]->right);
+      l = propBinary(chain[i], l, r[i], pure);
+    }
+    free(r);
+    free(chain);
+    return l;
+  }
+  default:
+    return (Lat){LAT_ANY};
+  }
+}
+
+static void propLoop(Node *node, State *st) {
+  if (node->init)
+    propStmt(node->init, st);
+
+  // the state at the head is the join of the entry and the back edge,
+  // repeat until it does not change
+  bool rewrite = Rewrite;
+  Rewrite = false;
+  State head = copyState(st);
+  State cur = newState();
+  for (int iter = 0;; iter++) {
+    // a safety net, nothing is known in a loop that does not settle
+    if (iter == 32) {
+      for (int i = 0; i < VarCnt; i++)
+        head.vals[i] = (Lat){LAT_ANY};
+      break;
+    }
+
+    assignState(&cur, &head);
+    if (node->cond) {
+      Lat c = propExpr(node->cond, &cur);
+      if (c.kind == LAT_CONST && c.val == 0)
+        break;
+    }
+    propStmt(node->then, &cur);
+    if (node->inc)
+      propExpr(node->inc, &cur);
+
+    State next = copyState(st);
+    meetState(&next, &cur);
+    bool stable = equalState(&next, &head);
+    assignState(&head, &next);
+    free(next.vals);
+    if (stable)
+      break;
+  }
+  Rewrite = rewrite;
+
+  // the loop leaves from the test of cond
+  assignState(st, &head);
+  if (!node->cond) {
+    if (Rewrite) {
+      assignState(&cur, st);
+      propStmt(node->then, &cur);
+      if (node->inc)
+        propExpr(node->inc, &cur);
+    }
+    st->reachable = false;
+  } else {
+    Lat c = propExpr(node->cond, st);
+    // a condition with side effects is kept, constant or not
+    bool pure = isPureExpr(node->cond);
+    if (c.kind == LAT_CONST && c.val == 0 && Rewrite && pure) {
+      // the body never runs
+      replaceWithStmt(node, node->init);
+      BranchCnt++;
+    } else if (Rewrite) {
+      assignState(&cur, st);
+      propStmt(node->then, &cur);
+      if (node->inc)
+        propExpr(node->inc, &cur);
+      if (c.kind == LAT_CONST && pure) {
+        // the loop only ends by return
+        node->cond = NULL;
+        BranchCnt++;
+      }
+    }
+    if (c.kind == LAT_CONST && c.val != 0)
+      st->reachable = false;
+  }
+  free(head.vals);
+  free(cur.vals);
+}
+
+static void propStmt(Node *node, State *st) {
+  if (!st->reachable)
+    return;
+
+  switch (node->nodeType) {
+  case ND_EXPR_STMT:
+    propExpr(node->left, st);
+    return;
+  case ND_RETURN:
+    propExpr(node->left, st);
+    if (ReturnState)
+      meetState(ReturnState, st);
+    st->reachable = false;
+    return;
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      propStmt(n, st);
+    return;
+  case ND_IF: {
+    Lat c = propExpr(node->cond, st);
+    if (c.kind == LAT_CONST) {
+      Node *taken = c.val ? node->then : node->els;
+      if (taken)
+        propStmt(taken, st);
+      // the arm not taken never runs, but the condition does
+      if (Rewrite && isPureExpr(node->cond)) {
+        replaceWithStmt(node, taken);
+        BranchCnt++;
+      }
+      return;
+    }
+
+    State els = copyState(st);
+    propStmt(node->then, st);
+    if (node->els)
+      propStmt(node->els, &els);
+    meetState(st, &els);
+    free(els.vals);
+    return;
+  }
+  case ND_LOOP:
+    propLoop(node, st);
+    return;
+  default:
+    return;
+  }
+}
+
+void propagateConstants(Function *prog) {
+  for (Function *fn = prog; fn; fn = fn->next) {
+    CurrentFn = fn;
+    AddrTaken = takesAddr(fn->body);
+
+    VarCnt = 0;
+    for (Obj *var = fn->locals; var; var = var->next)
+      var->idx = VarCnt++;
+    Tracked = calloc(VarCnt, sizeof(bool));
+    for (Obj *var = fn->locals; var; var = var->next)
+      Tracked[var->idx] = !takesAddrOf(fn->body, var);
+
+    // parameters hold the arguments, other locals nothing yet
+    State st = newState();
+    st.reachable = true;
+    for (Obj *var = fn->params; var; var = var->next)
+      st.vals[var->idx] = (Lat){LAT_ANY};
+
+    Rewrite = true;
+    propStmt(fn->body, &st);
+    free(st.vals);
+    free(Tracked);
+  }
+}
+
+void reportPropagate() {
+  fprintf(stderr,
+          "propagate: %d constants, %d copies, %d folded, %d branches\n",
+          ConstCnt, CopyCnt, FoldCnt, BranchCnt);
+}
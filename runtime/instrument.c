@@ -0,0 +1,70 @@
+/*
+ *  Runtime of -finstrument-functions
+ *
+ *  Each object file of an instrumented program registers its table through
+ *  __rvcc_instrument_register(), which a function of .init_array calls
+ *  before main. The tables of all the files are written at exit. Compile
+ *  this file with the RISC-V toolchain and link it with the program. rvsim
+ *  has it built in.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// the time spent in the callees of the running function: cycles and
+// instructions. It is shared by the functions of every file, so a call
+// across files is charged to its caller.
+long __rvcc_instrument_child[2];
+
+// a row of table for each function: calls, cycles, cycles spent outside
+// of its callees, instructions, instructions outside of its callees. The
+// names follow one another, each ending with a zero.
+typedef struct Table {
+  struct Table *next;
+  long *table;
+  char *names;
+  long n;
+} Table;
+
+// in the order of registration
+static Table *Tables;
+static Table **Last = &Tables;
+
+static void dump(void) {
+  char *path = getenv("RVCC_INSTRUMENT");
+  if (!path || !*path)
+    path = "rvcc.instr";
+  FILE *out = fopen(path, "w");
+  if (!out) {
+    perror(path);
+    return;
+  }
+  fprintf(out, "# function calls cycles self-cycles instret self-instret\n");
+  for (Table *t = Tables; t; t = t->next) {
+    char *names = t->names;
+    for (long i = 0; i < t->n; i++) {
+      fprintf(out, "%s", names);
+      for (int j = 0; j < 5; j++)
+        fprintf(out, " %ld", t->table[i * 5 + j]);
+      fprintf(out, "\n");
+      while (*names++)
+        ;
+    }
+  }
+  fclose(out);
+}
+
+void __rvcc_instrument_register(long *table, char *names, long n) {
+  Table *t = calloc(1, sizeof(Table));
+  if (!t) {
+    perror("__rvcc_instrument_register");
+    return;
+  }
+  t->table = table;
+  t->names = names;
+  t->n = n;
+  if (!Tables)
+    atexit(dump);
+  *Last = t;
+  Last = &t->next;
+}
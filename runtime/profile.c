@@ -0,0 +1,29 @@
+/*
+ *  Runtime of -fprofile-generate
+ *
+ *  An instrumented program calls __rvcc_profile_dump() when main returns.
+ *  Compile this file with the RISC-V toolchain and link it with the
+ *  program. rvsim and rvcc -run have it built in.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// the kinds of counters, in the order of ProfKind in rvcc.h
+static char *Kinds[] = {"if", "then", "loop", "body", "call"};
+
+// each key is the offset of the counted node in the source times 8, plus
+// the kind of the counter
+void __rvcc_profile_dump(long *counts, long *keys, long n) {
+  char *path = getenv("RVCC_PROFILE");
+  if (!path || !*path)
+    path = "rvcc.prof";
+  FILE *out = fopen(path, "w");
+  if (!out) {
+    perror(path);
+    return;
+  }
+  for (long i = 0; i < n; i++)
+    fprintf(out, "%ld %s %ld\n", keys[i] / 8, Kinds[keys[i] % 8], counts[i]);
+  fclose(out);
+}
@@ -6,6 +6,7 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -46,6 +47,8 @@ typedef enum {
 
 typedef struct Type {
   TypeKind kind;
+  int size;  // sizeof() value
+  int align; // alignment of a variable of the type
   Token *name; // Type corresponding name, such as: variable name, function name
   struct Type *base;
   struct Type *returnType; // function return type
@@ -59,6 +62,7 @@ typedef struct Obj {
   char *name;
   Type *dataType;
   int offSet; // the offset of fp
+  int idx;    // index among the locals of the function, for dataflow passes
 } Obj;
 
 // define in type.c
@@ -92,6 +96,7 @@ typedef enum {
   ND_EXPR_STMT, // Expression Statements
   ND_BLOCK,     // code block {}
   ND_FUNCALL,   // function call
+  ND_INLINE,    // inlined function call, body holds the callee's statements
 } NodeType;
 
 // AST tree node
@@ -121,6 +126,7 @@ typedef struct Node {
   struct Node *init; // initialization for ND_LOOP(for)
   struct Node *inc;  // increment for ND_LOOP(for and while)
 
+  bool vectorize; // ND_LOOP which runs on vectors, see vector.c
 } Node;
 
 // function
@@ -132,8 +138,25 @@ typedef struct Function {
   Node *body;    // function body
   Obj *locals;   // local variables
   int stackSize; // stack size
+
+  // see cache.c
+  uint64_t cacheKey; // where the code goes in the cache, 0 if it does not
+  char *cachedAsm;   // the code found in the cache, printed as it is
 } Function;
 
+// a line of emitted assembly
+typedef struct Inst {
+  struct Inst *next;
+  struct Inst *prev;
+  char *text;    // the line as it is printed
+  char *op;      // mnemonic, NULL for labels, comments and directives
+  char *label;   // name of the label defined by this line
+  char *args[3]; // operands of the instruction
+  int nargs;
+  bool removed;      // unlinked by removeInst()
+  struct Inst *link; // list of removed instructions
+} Inst;
+
 // judge if is int
 bool isInteger(Type *ty);
 
@@ -147,13 +170,270 @@ void addType(Node *Nd);
 
 Type *copyType(Type *type);
 
+// deep copy of a node, the variables in from[i] are replaced by to[i]
+Node *copyNode(Node *node, Obj **from, Obj **to, int nvars);
+
+// number of nodes in the tree
+int countNodes(Node *node);
+
+// whether the address of a local variable is taken anywhere in the tree
+bool takesAddr(Node *node);
+
+// whether the tree takes the address of var
+bool takesAddrOf(Node *node, Obj *var);
+
+// whether the expression can be dropped without changing anything
+bool isPureExpr(Node *node);
+
+// whether two expressions without side effects have the same value
+bool sameExpr(Node *a, Node *b);
+
+// whether the node is one of the binary operators, +, -, *, /, ==, !=, <
+// and <=
+bool isBinary(Node *node);
+
+// the nodes down the left operands from node for which inChain() holds,
+// node first: the chain of a+b+c+... for isBinary(), every node for NULL.
+// Returns their number, the array is to be freed.
+int leftChain(Node *node, bool (*inChain)(Node *node), Node ***chain);
+
 // =================================================================
 
+// optimization level, set by -O<n>
+extern int OptLevel;
+// print statistics of the optimization passes, set by -fopt-report
+extern bool OptReport;
+// functions of at most this many nodes are inlined, set by -finline-limit=<n>
+extern int InlineLimit;
+// unroll loops, set by -funroll-loops
+extern bool UnrollLoops;
+// an unrolled loop takes at most this many nodes, set by -funroll-limit=<n>
+extern int UnrollLimit;
+
 // Syntax parsing entry
 Token *tokenize();
+// the source the tokens point into, for error messages
+void setCurrentInput(char *input);
+// the offset of the token in the source
+int sourceOffset(Token *tok);
 
 // Semantic analysis and code entry
 Function *parse(Token *Tok);
 
+// directory of the compilation cache, set by -fcache-dir=<dir>
+extern char *CacheDir;
+// the cache takes at most this many bytes, set by -fcache-limit=<n>
+extern long CacheLimit;
+
+// Parse the functions which are not in the cache, the others only get their
+// cached code
+Function *parseCached(Token *tok);
+// store the code of a compiled function in the cache
+void cacheStore(Function *fn, char *text);
+// remove the least recently used entries until the cache fits the limit,
+// once all the functions are stored
+void evictCache();
+void reportCache();
+
+// Write the AST of the program to a file, and read it back
+void writeAST(Function *prog, char *input, char *path);
+Function *readAST(char *path);
+// whether the input is a file written by writeAST()
+bool isASTFile(char *path);
+
+// counters of -fprofile-generate and counts of -fprofile-use, see profile.c
+typedef enum {
+  PROF_IF,   // an if statement ran
+  PROF_THEN, // its then branch ran
+  PROF_LOOP, // a loop was entered
+  PROF_BODY, // its body ran
+  PROF_CALL, // a call, inlined or not
+  PROF_KINDS,
+} ProfKind;
+
+// instrument the code, set by -fprofile-generate
+extern bool ProfileGenerate;
+// the profile to optimize with, set by -fprofile-use=<file>
+extern char *ProfileUse;
+
+// a new counter for the node, returns its index
+int newCounter(Node *node, ProfKind kind);
+int counterCnt();
+// the location and kind of the counter, as it is written to the profile
+long counterKey(int i);
+// write the counts of the counters to the profile
+void writeProfile(long *counts);
+void readProfile();
+// how many times the counter of the node ran in the profile, -1 if unknown
+long profileCount(Node *node, ProfKind kind);
+long maxProfileCount(ProfKind kind);
+
+// Inline small functions into their callers
+void inlineFunctions(Function *prog);
+
+// the input is the whole program, set by -fwhole-program
+extern bool WholeProgram;
+// With -fwhole-program, drop the functions main does not call and bind
+// parameters which get the same constant at every call. Returns the
+// functions which are left.
+Function *optimizeCalls(Function *prog);
+void reportCalls();
+
+// number of arguments passed in registers, the rest go on the stack
+#define NARGREG 8
+
+// Move loop invariant expressions out of loops, reduce induction variables
+// and unroll loops
+void optimizeLoops(Function *prog);
+void reportLoops();
+
+// use the vector extension, set by -march
+extern bool IsaV;
+
+// the parts of a loop which runs on vectors, see vector.c. The addresses
+// are those of the elements of the first iteration.
+#define VEC_PTRS 6
+#define VEC_SCALARS 4
+typedef struct {
+  Node *counter; // i of i < bound, i = i + 1
+  Node *bound;
+  Node *sum;     // s of s = s + expr, NULL if the loop stores expr
+  Node *expr;    // the value of an element
+  // the addresses of the arrays, the one stored to first
+  Node *ptrs[VEC_PTRS];
+  int ptrCnt;
+  // the operands of expr which do not change in the loop
+  Node *scalars[VEC_SCALARS];
+  int scalarCnt;
+} VecLoop;
+
+// the parts of the loop if it can run on vectors, NULL if it can not. The
+// result is to be freed.
+VecLoop *vectorLoop(Function *fn, Node *loop);
+// the index of the address or operand in the loop, -1 if it is not one
+int vecPtr(VecLoop *vl, Node *addr);
+int vecScalar(VecLoop *vl, Node *node);
+// the operators of expr down the left operands from node, see leftChain()
+int vecChain(VecLoop *vl, Node *node, Node ***chain);
+
+// Propagate constants and copies, fold constant expressions and branches
+void propagateConstants(Function *prog);
+void reportPropagate();
+
+// Reuse the values of repeated expressions
+void eliminateCommonSubexprs(Function *prog);
+void reportCse();
+
+// Remove unreachable statements, dead stores and unused locals
+void eliminateDeadCode(Function *prog);
+void reportDeadCode();
+
+// Let locals which are never live at the same time share a stack slot
+void colorStackSlots(Function *prog);
+void reportStackSlots();
+
+// =================================================================
+// control flow graph of a function, defined in cfg.c
+
+// an expression evaluated in a basic block
+typedef enum {
+  IT_STMT, // expression statement or return, expr is &stmt->left
+  IT_COND, // condition of an if or a loop
+  IT_INC,  // increment of a loop
+} ItemKind;
+
+typedef struct {
+  ItemKind kind;
+  Node *stmt;  // the statement the item belongs to
+  Node **expr; // where the statement holds the expression
+} Item;
+
+// a set of small integers, one bit for each
+typedef uint64_t *BitSet;
+
+// items which always run one after another, from the first to the last
+typedef struct BasicBlock {
+  int id;
+  Item *items;
+  int itemCnt;
+  int itemCap;
+
+  struct BasicBlock *succs[2];
+  int succCnt;
+  struct BasicBlock **preds;
+  int predCnt;
+  bool reachable;
+
+  // liveness, over CFG.vars
+  BitSet use; // read before any write in the block
+  BitSet def; // always written in the block
+  BitSet liveIn;
+  BitSet liveOut;
+
+  // reaching definitions, over CFG.defs
+  BitSet gen;  // definitions which reach the end of the block
+  BitSet kill; // definitions overwritten in the block
+  BitSet reachIn;
+  BitSet reachOut;
+} BasicBlock;
+
+typedef struct {
+  Function *fn;
+  BasicBlock **blocks; // entry, exit, then in the order of the code
+  int blockCnt;
+  BasicBlock *entry;
+  BasicBlock *exit; // where every return goes, has no items
+
+  Obj **vars;    // the locals, indexed by Obj.idx
+  bool *tracked; // no pointer may point to the local
+  int varCnt;
+  Node **defs;   // assignments which always write a tracked local
+  int defCnt;
+} CFG;
+
+CFG *buildCFG(Function *fn);
+void freeCFG(CFG *cfg);
+void computeLiveness(CFG *cfg);
+void computeReachingDefs(CFG *cfg);
+// the tracked locals expr reads before writing them, and always writes
+void exprUseDef(CFG *cfg, Node *expr, BitSet use, BitSet def);
+
+BitSet newBitSet(int n);
+bool inBitSet(BitSet set, int i);
+void addBitSet(BitSet set, int i);
+
 // Code Generation entry
-void codegen(Function *prog);
\ No newline at end of file
+void codegen(Function *prog);
+
+// time every function, set by -finstrument-functions
+extern bool InstrumentFunctions;
+
+// give every local its offset from fp
+void assignLVarOffset(Function *prog);
+
+// Run the program with the interpreter, returns the value of main
+int runProgram(Function *prog);
+
+// emit formatted assembly, kept in a list until the function is flushed
+void emit(char *fmt, ...);
+// print the assembly to out instead of stdout, NULL goes back to stdout
+void setOutput(FILE *out);
+void rewriteInst(Inst *inst, char *op, int nargs, char **args);
+// rewriteInst() keeping the comments, for an equivalent instruction
+void respellInst(Inst *inst, char *op, int nargs, char **args);
+void removeInst(Inst *inst);
+void flushInsts();
+
+// rewrite redundant instruction sequences
+void peephole(Inst *insts);
+void reportPeephole();
+
+// emit compressed instructions (the C extension), set by -march
+extern bool IsaC;
+// use the address generation (Zba) and basic bit manipulation (Zbb)
+// instructions, set by -march
+extern bool IsaZba;
+extern bool IsaZbb;
+// use the 2 byte forms of the instructions which have one
+void compressInsts(Inst *insts);
+void reportCompress();
\ No newline at end of file
@@ -0,0 +1,1698 @@
+/*
+ *  rvsim: a small RV64IM simulator for the assembly rvcc emits
+ *
+ *  It assembles the text subset produced by codegen.c, runs it from `main`
+ *  and reports dynamic instruction counts per opcode, memory traffic and a
+ *  cycle estimate. The estimate comes from a single issue in-order pipeline:
+ *  every instruction takes a cycle, a use of a loaded value or of a product
+ *  right after it stalls, divisions occupy the divider and taken branches
+ *  and jumps pay a refill penalty. The latencies can be set on the command
+ *  line.
+ *
+ *  The instructions of the V extension which -march=rv64gcv loops use are
+ *  run too, with vector registers of -vlen bits and LMUL 1. The vector unit
+ *  is as wide as a register: a vector instruction takes a cycle as well.
+ *
+ *  The helpers test.sh links from tmp2.o are built in, so the tests and
+ *  `make bench` run without a RISC-V toolchain. The exit status is the
+ *  value main returns.
+ *
+ *  Several files may be given, as if they were linked together: the .L
+ *  labels are local to their file, the functions of .init_array run before
+ *  main.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// =================================================================
+// instruction set
+
+typedef enum {
+  OP_INVALID = 0,
+  OP_LI,
+  OP_LA,
+  OP_LUI,
+  OP_MV,
+  OP_NEG,
+  OP_NEGW,
+  OP_NOT,
+  OP_SEQZ,
+  OP_SNEZ,
+  OP_SLTZ,
+  OP_SGTZ,
+  OP_SEXTW,
+  OP_ADD,
+  OP_ADDW,
+  OP_ADDI,
+  OP_ADDIW,
+  OP_SUB,
+  OP_SUBW,
+  OP_MUL,
+  OP_MULW,
+  OP_MULH,
+  OP_MULHU,
+  OP_DIV,
+  OP_DIVW,
+  OP_DIVU,
+  OP_REM,
+  OP_REMW,
+  OP_AND,
+  OP_ANDI,
+  OP_OR,
+  OP_ORI,
+  OP_XOR,
+  OP_XORI,
+  OP_SLL,
+  OP_SLLI,
+  OP_SRL,
+  OP_SRLI,
+  OP_SRA,
+  OP_SRAI,
+  OP_SLLIW,
+  OP_SRLIW,
+  OP_SRAIW,
+  OP_SLT,
+  OP_SLTI,
+  OP_SLTU,
+  OP_SLTIU,
+  OP_SH1ADD,
+  OP_SH2ADD,
+  OP_SH3ADD,
+  OP_ANDN,
+  OP_ORN,
+  OP_MIN,
+  OP_MAX,
+  OP_LD,
+  OP_LW,
+  OP_LWU,
+  OP_LB,
+  OP_LBU,
+  OP_SD,
+  OP_SW,
+  OP_SB,
+  OP_BEQ,
+  OP_BNE,
+  OP_BLT,
+  OP_BGE,
+  OP_BLTU,
+  OP_BGEU,
+  OP_BEQZ,
+  OP_BNEZ,
+  OP_J,
+  OP_JR,
+  OP_CALL,
+  OP_TAIL,
+  OP_RET,
+  OP_RDCYCLE,
+  OP_RDINSTRET,
+  OP_NOP,
+  OP_VSETVLI,
+  OP_VLE32,
+  OP_VLE64,
+  OP_VSE32,
+  OP_VSE64,
+  OP_VADD_VV,
+  OP_VADD_VX,
+  OP_VSUB_VV,
+  OP_VSUB_VX,
+  OP_VRSUB_VX,
+  OP_VMUL_VV,
+  OP_VMUL_VX,
+  OP_VDIV_VV,
+  OP_VDIV_VX,
+  OP_VREDSUM_VS,
+  OP_VMV_V_X,
+  OP_VMV_S_X,
+  OP_VMV_X_S,
+  OP_LAST,
+} OpKind;
+
+// how the operands of an instruction are written in the assembly text
+typedef enum {
+  FMT_NONE,   // ret
+  FMT_RI,     // li rd, imm
+  FMT_RS,     // la rd, symbol
+  FMT_RR,     // mv rd, rs1
+  FMT_RRR,    // add rd, rs1, rs2
+  FMT_RRI,    // addi rd, rs1, imm
+  FMT_LOAD,   // ld rd, imm(rs1)
+  FMT_STORE,  // sd rs2, imm(rs1)
+  FMT_BRR,    // beq rs1, rs2, label
+  FMT_BR,     // beqz rs1, label
+  FMT_LABEL,  // j label
+  FMT_R,      // jr rs1 / rdcycle rd
+  FMT_VSET,   // vsetvli rd, rs1, e32, m1, ta, ma
+  FMT_VLOAD,  // vle32.v vd, (rs1)
+  FMT_VSTORE, // vse32.v vs3, (rs1)
+  FMT_VVV,    // vadd.vv vd, vs2, vs1
+  FMT_VVX,    // vadd.vx vd, vs2, rs1
+  FMT_VX,     // vmv.v.x vd, rs1
+  FMT_XV,     // vmv.x.s rd, vs2
+} OpFormat;
+
+typedef enum {
+  CLS_ALU,
+  CLS_MUL,
+  CLS_DIV,
+  CLS_LOAD,
+  CLS_STORE,
+  CLS_BRANCH,
+  CLS_JUMP,
+  CLS_VECTOR,
+  CLS_VLOAD,
+  CLS_VSTORE,
+} OpClass;
+
+typedef struct {
+  char *name;
+  OpKind kind;
+  OpFormat fmt;
+  OpClass cls;
+} OpInfo;
+
+static OpInfo OpTable[] = {
+    {"li", OP_LI, FMT_RI, CLS_ALU},
+    {"la", OP_LA, FMT_RS, CLS_ALU},
+    {"lla", OP_LA, FMT_RS, CLS_ALU},
+    {"lui", OP_LUI, FMT_RI, CLS_ALU},
+    {"mv", OP_MV, FMT_RR, CLS_ALU},
+    {"neg", OP_NEG, FMT_RR, CLS_ALU},
+    {"negw", OP_NEGW, FMT_RR, CLS_ALU},
+    {"not", OP_NOT, FMT_RR, CLS_ALU},
+    {"seqz", OP_SEQZ, FMT_RR, CLS_ALU},
+    {"snez", OP_SNEZ, FMT_RR, CLS_ALU},
+    {"sltz", OP_SLTZ, FMT_RR, CLS_ALU},
+    {"sgtz", OP_SGTZ, FMT_RR, CLS_ALU},
+    {"sext.w", OP_SEXTW, FMT_RR, CLS_ALU},
+    {"add", OP_ADD, FMT_RRR, CLS_ALU},
+    {"addw", OP_ADDW, FMT_RRR, CLS_ALU},
+    {"addi", OP_ADDI, FMT_RRI, CLS_ALU},
+    {"addiw", OP_ADDIW, FMT_RRI, CLS_ALU},
+    {"sub", OP_SUB, FMT_RRR, CLS_ALU},
+    {"subw", OP_SUBW, FMT_RRR, CLS_ALU},
+    {"mul", OP_MUL, FMT_RRR, CLS_MUL},
+    {"mulw", OP_MULW, FMT_RRR, CLS_MUL},
+    {"mulh", OP_MULH, FMT_RRR, CLS_MUL},
+    {"mulhu", OP_MULHU, FMT_RRR, CLS_MUL},
+    {"div", OP_DIV, FMT_RRR, CLS_DIV},
+    {"divw", OP_DIVW, FMT_RRR, CLS_DIV},
+    {"divu", OP_DIVU, FMT_RRR, CLS_DIV},
+    {"rem", OP_REM, FMT_RRR, CLS_DIV},
+    {"remw", OP_REMW, FMT_RRR, CLS_DIV},
+    {"and", OP_AND, FMT_RRR, CLS_ALU},
+    {"andi", OP_ANDI, FMT_RRI, CLS_ALU},
+    {"or", OP_OR, FMT_RRR, CLS_ALU},
+    {"ori", OP_ORI, FMT_RRI, CLS_ALU},
+    {"xor", OP_XOR, FMT_RRR, CLS_ALU},
+    {"xori", OP_XORI, FMT_RRI, CLS_ALU},
+    {"sll", OP_SLL, FMT_RRR, CLS_ALU},
+    {"slli", OP_SLLI, FMT_RRI, CLS_ALU},
+    {"srl", OP_SRL, FMT_RRR, CLS_ALU},
+    {"srli", OP_SRLI, FMT_RRI, CLS_ALU},
+    {"sra", OP_SRA, FMT_RRR, CLS_ALU},
+    {"srai", OP_SRAI, FMT_RRI, CLS_ALU},
+    {"slliw", OP_SLLIW, FMT_RRI, CLS_ALU},
+    {"srliw", OP_SRLIW, FMT_RRI, CLS_ALU},
+    {"sraiw", OP_SRAIW, FMT_RRI, CLS_ALU},
+    {"slt", OP_SLT, FMT_RRR, CLS_ALU},
+    {"slti", OP_SLTI, FMT_RRI, CLS_ALU},
+    {"sltu", OP_SLTU, FMT_RRR, CLS_ALU},
+    {"sltiu", OP_SLTIU, FMT_RRI, CLS_ALU},
+    {"sh1add", OP_SH1ADD, FMT_RRR, CLS_ALU},
+    {"sh2add", OP_SH2ADD, FMT_RRR, CLS_ALU},
+    {"sh3add", OP_SH3ADD, FMT_RRR, CLS_ALU},
+    {"andn", OP_ANDN, FMT_RRR, CLS_ALU},
+    {"orn", OP_ORN, FMT_RRR, CLS_ALU},
+    {"min", OP_MIN, FMT_RRR, CLS_ALU},
+    {"max", OP_MAX, FMT_RRR, CLS_ALU},
+    {"ld", OP_LD, FMT_LOAD, CLS_LOAD},
+    {"lw", OP_LW, FMT_LOAD, CLS_LOAD},
+    {"lwu", OP_LWU, FMT_LOAD, CLS_LOAD},
+    {"lb", OP_LB, FMT_LOAD, CLS_LOAD},
+    {"lbu", OP_LBU, FMT_LOAD, CLS_LOAD},
+    {"sd", OP_SD, FMT_STORE, CLS_STORE},
+    {"sw", OP_SW, FMT_STORE, CLS_STORE},
+    {"sb", OP_SB, FMT_STORE, CLS_STORE},
+    {"beq", OP_BEQ, FMT_BRR, CLS_BRANCH},
+    {"bne", OP_BNE, FMT_BRR, CLS_BRANCH},
+    {"blt", OP_BLT, FMT_BRR, CLS_BRANCH},
+    {"bge", OP_BGE, FMT_BRR, CLS_BRANCH},
+    {"bltu", OP_BLTU, FMT_BRR, CLS_BRANCH},
+    {"bgeu", OP_BGEU, FMT_BRR, CLS_BRANCH},
+    {"beqz", OP_BEQZ, FMT_BR, CLS_BRANCH},
+    {"bnez", OP_BNEZ, FMT_BR, CLS_BRANCH},
+    {"j", OP_J, FMT_LABEL, CLS_JUMP},
+    {"jr", OP_JR, FMT_R, CLS_JUMP},
+    {"call", OP_CALL, FMT_LABEL, CLS_JUMP},
+    {"tail", OP_TAIL, FMT_LABEL, CLS_JUMP},
+    {"ret", OP_RET, FMT_NONE, CLS_JUMP},
+    {"rdcycle", OP_RDCYCLE, FMT_R, CLS_ALU},
+    {"rdinstret", OP_RDINSTRET, FMT_R, CLS_ALU},
+    {"nop", OP_NOP, FMT_NONE, CLS_ALU},
+    {"vsetvli", OP_VSETVLI, FMT_VSET, CLS_ALU},
+    {"vle32.v", OP_VLE32, FMT_VLOAD, CLS_VLOAD},
+    {"vle64.v", OP_VLE64, FMT_VLOAD, CLS_VLOAD},
+    {"vse32.v", OP_VSE32, FMT_VSTORE, CLS_VSTORE},
+    {"vse64.v", OP_VSE64, FMT_VSTORE, CLS_VSTORE},
+    {"vadd.vv", OP_VADD_VV, FMT_VVV, CLS_VECTOR},
+    {"vadd.vx", OP_VADD_VX, FMT_VVX, CLS_VECTOR},
+    {"vsub.vv", OP_VSUB_VV, FMT_VVV, CLS_VECTOR},
+    {"vsub.vx", OP_VSUB_VX, FMT_VVX, CLS_VECTOR},
+    {"vrsub.vx", OP_VRSUB_VX, FMT_VVX, CLS_VECTOR},
+    {"vmul.vv", OP_VMUL_VV, FMT_VVV, CLS_VECTOR},
+    {"vmul.vx", OP_VMUL_VX, FMT_VVX, CLS_VECTOR},
+    {"vdiv.vv", OP_VDIV_VV, FMT_VVV, CLS_DIV},
+    {"vdiv.vx", OP_VDIV_VX, FMT_VVX, CLS_DIV},
+    {"vredsum.vs", OP_VREDSUM_VS, FMT_VVV, CLS_VECTOR},
+    {"vmv.v.x", OP_VMV_V_X, FMT_VX, CLS_VECTOR},
+    {"vmv.s.x", OP_VMV_S_X, FMT_VX, CLS_VECTOR},
+    {"vmv.x.s", OP_VMV_X_S, FMT_XV, CLS_ALU},
+};
+
+typedef struct {
+  char *name;
+  int nargs;
+} Builtin;
+
+typedef struct {
+  OpInfo *info;
+  bool compressed; // written with a "c." prefix, 2 bytes
+  int rd, rs1, rs2;
+  int64_t imm;
+  char *sym;  // label operand
+  int target; // resolved instruction index of sym, -1 for builtins
+  Builtin *builtin;
+  int line;   // source line, for diagnostics
+} Inst;
+
+// =================================================================
+// errors
+
+static char *InputPath;
+static int CurLine;
+// the number of the file being assembled
+static int FileNo;
+
+static void fatal(const char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  fprintf(stderr, "rvsim: ");
+  if (CurLine)
+    fprintf(stderr, "%s:%d: ", InputPath, CurLine);
+  vfprintf(stderr, fmt, va);
+  fprintf(stderr, "\n");
+  va_end(va);
+  exit(1);
+}
+
+// =================================================================
+// assembler
+
+typedef struct {
+  char *name;
+  bool isData;
+  int64_t val; // instruction index or data address
+} Label;
+
+static Inst *Insts;
+static int InstCnt, InstCap;
+
+// labels are looked up for every branch while assembling, they are kept in
+// an open addressing hash table whose capacity is a power of two
+static Label *Labels;
+static int LabelCnt, LabelCap;
+
+// simulated memory: data grows up from MEM_BASE, the stack grows down from
+// the top
+#define MEM_BASE 0x10000
+static uint8_t *Mem;
+static int64_t MemSize = 64 << 20;
+static int64_t DataEnd = MEM_BASE;
+
+// FNV-1a
+static uint32_t hashName(char *name) {
+  uint32_t h = 2166136261u;
+  for (char *p = name; *p; p++)
+    h = (h ^ (uint8_t)*p) * 16777619u;
+  return h;
+}
+
+// the slot of name, or the empty slot it would go into
+static Label *labelSlot(char *name) {
+  uint32_t i = hashName(name) & (LabelCap - 1);
+  while (Labels[i].name && strcmp(Labels[i].name, name))
+    i = (i + 1) & (LabelCap - 1);
+  return &Labels[i];
+}
+
+static Label *findLabel(char *name) {
+  if (!LabelCap)
+    return NULL;
+  Label *l = labelSlot(name);
+  return l->name ? l : NULL;
+}
+
+static void growLabels(void) {
+  Label *old = Labels;
+  int oldCap = LabelCap;
+  LabelCap = LabelCap ? LabelCap * 2 : 1024;
+  Labels = calloc(LabelCap, sizeof(Label));
+  for (int i = 0; i < oldCap; i++)
+    if (old[i].name)
+      *labelSlot(old[i].name) = old[i];
+  free(old);
+}
+
+// .L labels are local to their file, they are told apart by its number
+static char *symName(char *name) {
+  if (strncmp(name, ".L", 2))
+    return strdup(name);
+  char *buf = malloc(strlen(name) + 16);
+  sprintf(buf, "%s@%d", name, FileNo);
+  return buf;
+}
+
+static void addLabel(char *name, bool isData, int64_t val) {
+  if (findLabel(name))
+    fatal("duplicate label %s", name);
+  // keep the table at most half full
+  if ((LabelCnt + 1) * 2 > LabelCap)
+    growLabels();
+  *labelSlot(name) = (Label){name, isData, val};
+  LabelCnt++;
+}
+
+static char *skipSpace(char *p) {
+  while (isspace(*p))
+    p++;
+  return p;
+}
+
+static int parseReg(char *s) {
+  static char *abi[] = {"zero", "ra", "sp",  "gp",  "tp", "t0", "t1", "t2",
+                        "s0",   "s1", "a0",  "a1",  "a2", "a3", "a4", "a5",
+                        "a6",   "a7", "s2",  "s3",  "s4", "s5", "s6", "s7",
+                        "s8",   "s9", "s10", "s11", "t3", "t4", "t5", "t6"};
+  for (int i = 0; i < 32; i++)
+    if (!strcmp(s, abi[i]))
+      return i;
+  if (!strcmp(s, "fp"))
+    return 8;
+  if (s[0] == 'x' && isdigit(s[1])) {
+    int n = atoi(s + 1);
+    if (n < 32)
+      return n;
+  }
+  fatal("invalid register '%s'", s);
+  return 0;
+}
+
+static int parseVReg(char *s) {
+  if (s[0] == 'v' && isdigit(s[1])) {
+    char *end;
+    long n = strtol(s + 1, &end, 10);
+    if (!*end && n < 32)
+      return n;
+  }
+  fatal("invalid vector register '%s'", s);
+  return 0;
+}
+
+static int64_t parseImm(char *s) {
+  char *end;
+  int64_t v = strtoll(s, &end, 0);
+  if (*end || end == s)
+    fatal("invalid immediate '%s'", s);
+  return v;
+}
+
+// split "a, b, c" into at most 3 trimmed operands, the third one takes the
+// rest of the line: "e32, m1, ta, ma" of vsetvli
+static int splitOperands(char *p, char **ops) {
+  int n = 0;
+  p = skipSpace(p);
+  if (!*p)
+    return 0;
+  while (n < 3) {
+    char *comma = n < 2 ? strchr(p, ',') : NULL;
+    if (comma)
+      *comma = '\0';
+    char *end = p + strlen(p);
+    while (end > p && isspace(end[-1]))
+      *--end = '\0';
+    ops[n++] = p;
+    if (!comma)
+      break;
+    p = skipSpace(comma + 1);
+  }
+  return n;
+}
+
+// "e32, m1, ta, ma", returns SEW. Only LMUL 1 is supported, the tail and
+// mask policies make no difference here: the elements past vl and the
+// inactive ones are left as they are, which both policies allow.
+static int parseVtype(char *s) {
+  char *end;
+  if (s[0] != 'e')
+    fatal("invalid vtype '%s'", s);
+  long sew = strtol(s + 1, &end, 10);
+  if (sew != 8 && sew != 16 && sew != 32 && sew != 64)
+    fatal("invalid SEW in '%s'", s);
+  for (char *p = end; *p; p++) {
+    if (*p == 'm' && strncmp(p, "m1", 2) && strncmp(p, "ma", 2) &&
+        strncmp(p, "mu", 2))
+      fatal("only LMUL m1 is supported: '%s'", s);
+  }
+  return sew;
+}
+
+// "imm(reg)"
+static void parseMem(char *s, int64_t *imm, int *reg) {
+  char *lp = strchr(s, '(');
+  char *rp = strchr(s, ')');
+  if (!lp || !rp)
+    fatal("invalid memory operand '%s'", s);
+  *rp = '\0';
+  *reg = parseReg(lp + 1);
+  *lp = '\0';
+  *imm = *s ? parseImm(s) : 0;
+}
+
+static OpInfo *findOp(char *name) {
+  for (int i = 0; i < sizeof(OpTable) / sizeof(*OpTable); i++)
+    if (!strcmp(OpTable[i].name, name))
+      return &OpTable[i];
+  return NULL;
+}
+
+static void addInst(Inst inst) {
+  if (InstCnt == InstCap) {
+    InstCap = InstCap ? InstCap * 2 : 1024;
+    Insts = realloc(Insts, sizeof(Inst) * InstCap);
+  }
+  Insts[InstCnt++] = inst;
+}
+
+// whether the operands fit the 2 byte encoding of the compressed
+// instruction c.<name>
+static bool fitsCompressed(Inst *inst, char *name) {
+  int rd = inst->rd, rs1 = inst->rs1, rs2 = inst->rs2;
+  int64_t imm = inst->imm;
+  // x8 to x15, the registers of the 3 bit fields
+#define CREG(r) ((r) >= 8 && (r) <= 15)
+#define IN(v, lo, hi, align) ((v) >= (lo) && (v) <= (hi) && (v) % (align) == 0)
+  if (!strcmp(name, "li"))
+    return rd && IN(imm, -32, 31, 1);
+  if (!strcmp(name, "mv"))
+    return rd && rs1;
+  if (!strcmp(name, "addi"))
+    return rd && rd == rs1 && imm && IN(imm, -32, 31, 1);
+  if (!strcmp(name, "addiw"))
+    return rd && rd == rs1 && IN(imm, -32, 31, 1);
+  if (!strcmp(name, "addi16sp"))
+    return rd == 2 && rs1 == 2 && imm && IN(imm, -512, 496, 16);
+  if (!strcmp(name, "addi4spn"))
+    return CREG(rd) && rs1 == 2 && IN(imm, 4, 1020, 4);
+  if (!strcmp(name, "andi"))
+    return CREG(rd) && rd == rs1 && IN(imm, -32, 31, 1);
+  if (!strcmp(name, "slli"))
+    return rd && rd == rs1 && IN(imm, 1, 63, 1);
+  if (!strcmp(name, "srli") || !strcmp(name, "srai"))
+    return CREG(rd) && rd == rs1 && IN(imm, 1, 63, 1);
+  if (!strcmp(name, "add"))
+    return rd && rd == rs1 && rs2;
+  if (!strcmp(name, "addw") || !strcmp(name, "subw") ||
+      !strcmp(name, "sub") || !strcmp(name, "and") || !strcmp(name, "or") ||
+      !strcmp(name, "xor"))
+    return CREG(rd) && rd == rs1 && CREG(rs2);
+  if (!strcmp(name, "ld"))
+    return CREG(rd) && CREG(rs1) && IN(imm, 0, 248, 8);
+  if (!strcmp(name, "lw"))
+    return CREG(rd) && CREG(rs1) && IN(imm, 0, 124, 4);
+  if (!strcmp(name, "sd"))
+    return CREG(rs2) && CREG(rs1) && IN(imm, 0, 248, 8);
+  if (!strcmp(name, "sw"))
+    return CREG(rs2) && CREG(rs1) && IN(imm, 0, 124, 4);
+  if (!strcmp(name, "ldsp"))
+    return rd && rs1 == 2 && IN(imm, 0, 504, 8);
+  if (!strcmp(name, "lwsp"))
+    return rd && rs1 == 2 && IN(imm, 0, 252, 4);
+  if (!strcmp(name, "sdsp"))
+    return rs1 == 2 && IN(imm, 0, 504, 8);
+  if (!strcmp(name, "swsp"))
+    return rs1 == 2 && IN(imm, 0, 252, 4);
+  if (!strcmp(name, "jr"))
+    return rs1;
+  if (!strcmp(name, "beqz") || !strcmp(name, "bnez"))
+    return CREG(rs1);
+  // the reach of c.j and the branches is checked once the code is laid out
+  return !strcmp(name, "j") || !strcmp(name, "nop");
+#undef CREG
+#undef IN
+}
+
+static void parseInst(char *mnemonic, char *rest) {
+  Inst inst = {.line = CurLine, .target = -1};
+  char *cname = NULL;
+  if (!strncmp(mnemonic, "c.", 2)) {
+    inst.compressed = true;
+    mnemonic += 2;
+    cname = mnemonic;
+    // the forms of sp have names of their own
+    static char *spForms[][2] = {
+        {"ldsp", "ld"}, {"lwsp", "lw"},       {"sdsp", "sd"},
+        {"swsp", "sw"}, {"addi16sp", "addi"}, {"addi4spn", "addi"},
+    };
+    for (int i = 0; i < sizeof(spForms) / sizeof(*spForms); i++)
+      if (!strcmp(mnemonic, spForms[i][0]))
+        mnemonic = spForms[i][1];
+  }
+  inst.info = findOp(mnemonic);
+  if (!inst.info)
+    fatal("unsupported instruction '%s'", mnemonic);
+
+  char *ops[3] = {};
+  int n = splitOperands(rest, ops);
+  static const int want[] = {
+      [FMT_NONE] = 0, [FMT_RI] = 2,  [FMT_RS] = 2,    [FMT_RR] = 2,
+      [FMT_RRR] = 3,  [FMT_RRI] = 3, [FMT_LOAD] = 2,  [FMT_STORE] = 2,
+      [FMT_BRR] = 3,  [FMT_BR] = 2,  [FMT_LABEL] = 1, [FMT_R] = 1,
+      [FMT_VSET] = 3, [FMT_VLOAD] = 2, [FMT_VSTORE] = 2, [FMT_VVV] = 3,
+      [FMT_VVX] = 3,  [FMT_VX] = 2,  [FMT_XV] = 2,
+  };
+  // compressed forms drop the repeated destination: c.addi sp, -16
+  if (inst.compressed && n == 2 && inst.info->fmt == FMT_RRR) {
+    ops[2] = ops[1];
+    ops[1] = ops[0];
+    n = 3;
+  }
+  if (inst.compressed && n == 2 && inst.info->fmt == FMT_RRI) {
+    ops[2] = ops[1];
+    ops[1] = ops[0];
+    n = 3;
+  }
+  if (n != want[inst.info->fmt])
+    fatal("'%s' expects %d operands", mnemonic, want[inst.info->fmt]);
+
+  switch (inst.info->fmt) {
+  case FMT_NONE:
+    break;
+  case FMT_RI:
+    inst.rd = parseReg(ops[0]);
+    inst.imm = parseImm(ops[1]);
+    break;
+  case FMT_RS:
+    inst.rd = parseReg(ops[0]);
+    inst.sym = symName(ops[1]);
+    break;
+  case FMT_RR:
+    inst.rd = parseReg(ops[0]);
+    inst.rs1 = parseReg(ops[1]);
+    break;
+  case FMT_RRR:
+    inst.rd = parseReg(ops[0]);
+    inst.rs1 = parseReg(ops[1]);
+    inst.rs2 = parseReg(ops[2]);
+    break;
+  case FMT_RRI:
+    inst.rd = parseReg(ops[0]);
+    inst.rs1 = parseReg(ops[1]);
+    inst.imm = parseImm(ops[2]);
+    break;
+  case FMT_LOAD:
+    inst.rd = parseReg(ops[0]);
+    parseMem(ops[1], &inst.imm, &inst.rs1);
+    break;
+  case FMT_STORE:
+    inst.rs2 = parseReg(ops[0]);
+    parseMem(ops[1], &inst.imm, &inst.rs1);
+    break;
+  case FMT_BRR:
+    inst.rs1 = parseReg(ops[0]);
+    inst.rs2 = parseReg(ops[1]);
+    inst.sym = symName(ops[2]);
+    break;
+  case FMT_BR:
+    inst.rs1 = parseReg(ops[0]);
+    inst.sym = symName(ops[1]);
+    break;
+  case FMT_LABEL:
+    inst.sym = symName(ops[0]);
+    break;
+  case FMT_R:
+    if (inst.info->kind == OP_JR)
+      inst.rs1 = parseReg(ops[0]);
+    else
+      inst.rd = parseReg(ops[0]);
+    break;
+  // vector registers go into the same fields, rs1 is the first source
+  case FMT_VSET:
+    inst.rd = parseReg(ops[0]);
+    inst.rs1 = parseReg(ops[1]);
+    inst.imm = parseVtype(ops[2]);
+    break;
+  case FMT_VLOAD:
+    inst.rd = parseVReg(ops[0]);
+    parseMem(ops[1], &inst.imm, &inst.rs1);
+    if (inst.imm)
+      fatal("vector loads take no offset");
+    break;
+  case FMT_VSTORE:
+    inst.rs2 = parseVReg(ops[0]);
+    parseMem(ops[1], &inst.imm, &inst.rs1);
+    if (inst.imm)
+      fatal("vector stores take no offset");
+    break;
+  case FMT_VVV:
+    inst.rd = parseVReg(ops[0]);
+    inst.rs1 = parseVReg(ops[1]);
+    inst.rs2 = parseVReg(ops[2]);
+    break;
+  case FMT_VVX:
+    inst.rd = parseVReg(ops[0]);
+    inst.rs1 = parseVReg(ops[1]);
+    inst.rs2 = parseReg(ops[2]);
+    break;
+  case FMT_VX:
+    inst.rd = parseVReg(ops[0]);
+    inst.rs1 = parseReg(ops[1]);
+    break;
+  case FMT_XV:
+    inst.rd = parseReg(ops[0]);
+    inst.rs1 = parseVReg(ops[1]);
+    break;
+  }
+  if (inst.compressed && !fitsCompressed(&inst, cname))
+    fatal("the operands of 'c.%s' do not fit its encoding", cname);
+  addInst(inst);
+}
+
+static void emitData(int64_t val, int size) {
+  if (DataEnd + size > MEM_BASE + MemSize / 2)
+    fatal("data segment too large");
+  memcpy(Mem + (DataEnd - MEM_BASE), &val, size);
+  DataEnd += size;
+}
+
+// the functions of .init_array, run before main
+static char **Ctors;
+static int CtorCnt;
+// in .init_array, whose .dword entries go into Ctors
+static bool InInitArray;
+
+static void parseDirective(char *name, char *rest, bool *inData) {
+  if (!strcmp(name, ".text")) {
+    *inData = InInitArray = false;
+    return;
+  }
+  if (!strcmp(name, ".data") || !strcmp(name, ".bss")) {
+    *inData = true;
+    InInitArray = false;
+    return;
+  }
+  if (!strcmp(name, ".section")) {
+    rest = skipSpace(rest);
+    *inData = strncmp(rest, ".text", 5) != 0;
+    InInitArray = !strncmp(rest, ".init_array", 11);
+    return;
+  }
+  if (!*inData)
+    return; // .global, .align, .type ... in text carry no semantics here
+
+  rest = skipSpace(rest);
+  if (InInitArray) {
+    if (!strcmp(name, ".dword") || !strcmp(name, ".quad")) {
+      Ctors = realloc(Ctors, sizeof(char *) * (CtorCnt + 1));
+      Ctors[CtorCnt++] = symName(rest);
+    }
+    return;
+  }
+  if (!strcmp(name, ".align") || !strcmp(name, ".p2align")) {
+    int64_t a = (int64_t)1 << parseImm(rest);
+    DataEnd = (DataEnd + a - 1) / a * a;
+  } else if (!strcmp(name, ".dword") || !strcmp(name, ".quad")) {
+    emitData(parseImm(rest), 8);
+  } else if (!strcmp(name, ".word")) {
+    emitData(parseImm(rest), 4);
+  } else if (!strcmp(name, ".byte")) {
+    emitData(parseImm(rest), 1);
+  } else if (!strcmp(name, ".string") || !strcmp(name, ".asciz")) {
+    // names of functions, no escapes
+    char *end = strrchr(rest, '"');
+    if (*rest != '"' || end == rest)
+      fatal("invalid string");
+    for (char *p = rest + 1; p < end; p++)
+      emitData(*p, 1);
+    emitData(0, 1);
+  } else if (!strcmp(name, ".zero")) {
+    for (int64_t i = parseImm(rest); i > 0; i--)
+      emitData(0, 1);
+  }
+}
+
+static void assemble(FILE *in) {
+  char *line = NULL;
+  size_t cap = 0;
+  bool inData = false;
+  InInitArray = false;
+
+  while (getline(&line, &cap, in) != -1) {
+    CurLine++;
+    char *hash = strchr(line, '#');
+    if (hash)
+      *hash = '\0';
+    char *end = line + strlen(line);
+    while (end > line && isspace(end[-1]))
+      *--end = '\0';
+    char *p = skipSpace(line);
+
+    // labels, possibly followed by an instruction
+    for (;;) {
+      char *colon = strchr(p, ':');
+      if (!colon)
+        break;
+      char *q = p;
+      while (q < colon && !isspace(*q))
+        q++;
+      if (q != colon)
+        break;
+      *colon = '\0';
+      addLabel(symName(p), inData, inData ? DataEnd : InstCnt);
+      p = skipSpace(colon + 1);
+    }
+    if (!*p)
+      continue;
+
+    char *word = p;
+    while (*p && !isspace(*p))
+      p++;
+    if (*p)
+      *p++ = '\0';
+
+    if (word[0] == '.')
+      parseDirective(word, p, &inData);
+    else if (inData)
+      fatal("instruction in data section");
+    else
+      parseInst(word, p);
+  }
+  free(line);
+  CurLine = 0;
+}
+
+// =================================================================
+// host-provided functions, standing in for the helpers test.sh links
+// from tmp2.o
+
+static Builtin Builtins[] = {
+    {"ret3", 0},  {"ret5", 0}, {"add", 2},   {"sub", 2},
+    {"add6", 6},  {"add8", 8}, {"add10", 10}, {"__rvcc_profile_dump", 3},
+    {"__rvcc_instrument_register", 3},
+};
+
+static int64_t load(int64_t addr, int size);
+
+// the counts of a program built with -fprofile-generate, written as
+// runtime/profile.c does
+static void dumpProfile(int64_t counts, int64_t keys, int64_t n) {
+  static char *kinds[] = {"if", "then", "loop", "body", "call"};
+  char *path = getenv("RVCC_PROFILE");
+  if (!path || !*path)
+    path = "rvcc.prof";
+  FILE *out = fopen(path, "w");
+  if (!out)
+    fatal("cannot open %s", path);
+  for (int64_t i = 0; i < n; i++) {
+    int64_t key = load(keys + i * 8, 8);
+    fprintf(out, "%" PRId64 " %s %" PRId64 "\n", key / 8, kinds[key % 8],
+            load(counts + i * 8, 8));
+  }
+  fclose(out);
+}
+
+// the tables each file built with -finstrument-functions registers
+typedef struct {
+  int64_t table, names, n;
+} InstrTable;
+
+static InstrTable *InstrTables;
+static int InstrTableCnt;
+
+static void registerInstrument(int64_t table, int64_t names, int64_t n) {
+  InstrTables =
+      realloc(InstrTables, sizeof(InstrTable) * (InstrTableCnt + 1));
+  InstrTables[InstrTableCnt++] = (InstrTable){table, names, n};
+}
+
+// the registered tables once main returns, written as runtime/instrument.c
+// does
+static void dumpInstrument(void) {
+  char *path = getenv("RVCC_INSTRUMENT");
+  if (!path || !*path)
+    path = "rvcc.instr";
+  FILE *out = fopen(path, "w");
+  if (!out)
+    fatal("cannot open %s", path);
+  fprintf(out, "# function calls cycles self-cycles instret self-instret\n");
+  for (int t = 0; t < InstrTableCnt; t++) {
+    int64_t names = InstrTables[t].names;
+    for (int64_t i = 0; i < InstrTables[t].n; i++) {
+      for (char c; (c = load(names++, 1));)
+        fputc(c, out);
+      for (int j = 0; j < 5; j++)
+        fprintf(out, " %" PRId64,
+                load(InstrTables[t].table + (i * 5 + j) * 8, 8));
+      fputc('\n', out);
+    }
+  }
+  fclose(out);
+}
+
+static int64_t callBuiltin(Builtin *fn, int64_t *x) {
+  // stack arguments beyond the 8 argument registers start at sp
+  int64_t a[10] = {};
+  for (int i = 0; i < fn->nargs; i++)
+    a[i] = i < 8 ? x[10 + i] : load(x[2] + (i - 8) * 8, 8);
+  char *name = fn->name;
+  int32_t r;
+  if (!strcmp(name, "__rvcc_profile_dump")) {
+    dumpProfile(a[0], a[1], a[2]);
+    r = 0;
+  } else if (!strcmp(name, "__rvcc_instrument_register")) {
+    registerInstrument(a[0], a[1], a[2]);
+    r = 0;
+  } else if (!strcmp(name, "ret3"))
+    r = 3;
+  else if (!strcmp(name, "ret5"))
+    r = 5;
+  else if (!strcmp(name, "add"))
+    r = (int32_t)a[0] + (int32_t)a[1];
+  else if (!strcmp(name, "sub"))
+    r = (int32_t)a[0] - (int32_t)a[1];
+  else if (!strcmp(name, "add6"))
+    r = a[0] + a[1] + a[2] + a[3] + a[4] + a[5];
+  else if (!strcmp(name, "add8"))
+    r = a[0] + a[1] + a[2] + a[3] + a[4] + a[5] + a[6] + a[7];
+  else
+    r = a[0] + a[1] + a[2] + a[3] + a[4] + a[5] + a[6] + a[7] + a[8] + a[9];
+  return r;
+}
+
+// the time the callees of the running function took, a global of
+// runtime/instrument.c
+#define INSTRUMENT_CHILD "__rvcc_instrument_child"
+
+static void resolve(void) {
+  for (int i = 0; i < InstCnt; i++) {
+    Inst *inst = &Insts[i];
+    if (!inst->sym)
+      continue;
+    Label *l = findLabel(inst->sym);
+    if (!l && !strcmp(inst->sym, INSTRUMENT_CHILD)) {
+      DataEnd = (DataEnd + 7) / 8 * 8;
+      addLabel(strdup(INSTRUMENT_CHILD), true, DataEnd);
+      emitData(0, 8);
+      emitData(0, 8);
+      l = findLabel(inst->sym);
+    }
+    if (inst->info->kind == OP_LA) {
+      if (!l)
+        fatal("undefined symbol %s (line %d)", inst->sym, inst->line);
+      inst->imm = l->val;
+      continue;
+    }
+    if (l && !l->isData) {
+      inst->target = l->val;
+      continue;
+    }
+    bool isCall = inst->info->kind == OP_CALL || inst->info->kind == OP_TAIL;
+    for (int j = 0; j < sizeof(Builtins) / sizeof(*Builtins); j++)
+      if (!strcmp(Builtins[j].name, inst->sym))
+        inst->builtin = &Builtins[j];
+    if (!isCall || !inst->builtin)
+      fatal("undefined label %s (line %d)", inst->sym, inst->line);
+  }
+}
+
+// =================================================================
+// pipeline cost model
+
+typedef struct {
+  int loadUse;     // stall when the next instruction reads a loaded value
+  int mulLatency;  // extra cycles for a dependent use of a mul result
+  int divCycles;   // divider occupancy
+  int takenBranch; // penalty for a taken branch or any jump
+} CostModel;
+
+static CostModel Model = {2, 2, 20, 2};
+
+typedef struct {
+  uint64_t count[OP_LAST];
+  uint64_t insts, loads, stores, branches, taken, cycles, calls;
+  int64_t maxStack;
+} Stats;
+
+static Stats St;
+
+// abort on calls made with a misaligned stack pointer
+static bool CheckAlign;
+
+// =================================================================
+// execution
+
+static int64_t X[32];
+
+static uint8_t *addrToHost(int64_t addr, int size) {
+  if (addr < MEM_BASE || addr + size > MEM_BASE + MemSize)
+    fatal("memory access out of bounds at 0x%" PRIx64, addr);
+  return Mem + (addr - MEM_BASE);
+}
+
+static int64_t load(int64_t addr, int size) {
+  uint8_t *p = addrToHost(addr, size);
+  switch (size) {
+  case 1:
+    return (int8_t)*p;
+  case 4: {
+    int32_t v;
+    memcpy(&v, p, 4);
+    return v;
+  }
+  default: {
+    int64_t v;
+    memcpy(&v, p, 8);
+    return v;
+  }
+  }
+}
+
+static void store(int64_t addr, int64_t val, int size) {
+  memcpy(addrToHost(addr, size), &val, size);
+}
+
+// =================================================================
+// vector unit
+
+// bits of a vector register, set by -vlen=N
+static int Vlen = 128;
+static uint8_t *V;
+static int64_t VL;
+// element width set by vsetvli, 0 before the first one
+static int Sew;
+
+static uint8_t *velem(int reg, int64_t i) {
+  return V + reg * (Vlen / 8) + i * (Sew / 8);
+}
+
+// element i of a vector register, sign extended
+static int64_t vget(int reg, int64_t i) {
+  uint8_t *p = velem(reg, i);
+  switch (Sew) {
+  case 8:
+    return (int8_t)*p;
+  case 16: {
+    int16_t v;
+    memcpy(&v, p, 2);
+    return v;
+  }
+  case 32: {
+    int32_t v;
+    memcpy(&v, p, 4);
+    return v;
+  }
+  default: {
+    int64_t v;
+    memcpy(&v, p, 8);
+    return v;
+  }
+  }
+}
+
+static void vput(int reg, int64_t i, int64_t val) {
+  memcpy(velem(reg, i), &val, Sew / 8);
+}
+
+// vsetvli: vl is the requested number of elements, as many as fit if rs1 is
+// zero, and stays as it is if rd is zero too
+static int64_t setVl(Inst *inst, int64_t avl) {
+  Sew = inst->imm;
+  int64_t vlmax = Vlen / Sew;
+  if (inst->rs1)
+    VL = (uint64_t)avl < (uint64_t)vlmax ? avl : vlmax;
+  else if (inst->rd)
+    VL = vlmax;
+  else if (VL > vlmax)
+    VL = vlmax;
+  return VL;
+}
+
+// a / b on elements of SEW bits, with the results of divw for 0 and overflow
+static int64_t vdiv(int64_t a, int64_t b) {
+  int64_t min = (int64_t)((uint64_t)-1 << (Sew - 1));
+  if (b == 0)
+    return -1;
+  if (a == min && b == -1)
+    return a;
+  return a / b;
+}
+
+static int64_t vop(OpKind k, int64_t a, int64_t b) {
+  switch (k) {
+  case OP_VADD_VV:
+  case OP_VADD_VX:
+    return (uint64_t)a + (uint64_t)b;
+  case OP_VSUB_VV:
+  case OP_VSUB_VX:
+    return (uint64_t)a - (uint64_t)b;
+  case OP_VRSUB_VX:
+    return (uint64_t)b - (uint64_t)a;
+  case OP_VMUL_VV:
+  case OP_VMUL_VX:
+    return (uint64_t)a * (uint64_t)b;
+  default:
+    return vdiv(a, b);
+  }
+}
+
+static void vmem(Inst *inst, int64_t addr, bool isStore) {
+  OpKind k = inst->info->kind;
+  int eew = k == OP_VLE32 || k == OP_VSE32 ? 32 : 64;
+  if (eew != Sew)
+    fatal("%s with SEW %d (line %d)", inst->info->name, Sew, inst->line);
+  for (int64_t i = 0; i < VL; i++) {
+    if (isStore)
+      store(addr + i * (eew / 8), vget(inst->rs2, i), eew / 8);
+    else
+      vput(inst->rd, i, load(addr + i * (eew / 8), eew / 8));
+  }
+}
+
+// runs a vector instruction other than vsetvli, returns the value of the
+// scalar register it writes
+static int64_t runVector(Inst *inst, int64_t x) {
+  OpKind k = inst->info->kind;
+  if (!Sew)
+    fatal("%s before vsetvli (line %d)", inst->info->name, inst->line);
+  switch (inst->info->fmt) {
+  case FMT_VLOAD:
+    vmem(inst, x, false);
+    return 0;
+  case FMT_VSTORE:
+    vmem(inst, x, true);
+    return 0;
+  case FMT_XV:
+    return vget(inst->rs1, 0);
+  default:
+    break;
+  }
+
+  switch (k) {
+  case OP_VREDSUM_VS:
+    if (VL) {
+      int64_t sum = vget(inst->rs2, 0);
+      for (int64_t i = 0; i < VL; i++)
+        sum = (uint64_t)sum + (uint64_t)vget(inst->rs1, i);
+      vput(inst->rd, 0, sum);
+    }
+    return 0;
+  case OP_VMV_V_X:
+    for (int64_t i = 0; i < VL; i++)
+      vput(inst->rd, i, x);
+    return 0;
+  case OP_VMV_S_X:
+    if (VL)
+      vput(inst->rd, 0, x);
+    return 0;
+  default:
+    break;
+  }
+
+  bool scalar = inst->info->fmt == FMT_VVX;
+  for (int64_t i = 0; i < VL; i++)
+    vput(inst->rd, i,
+         vop(k, vget(inst->rs1, i), scalar ? x : vget(inst->rs2, i)));
+  return 0;
+}
+
+// registers read by an instruction, for the load-use model
+static bool readsReg(Inst *inst, int r) {
+  if (r == 0)
+    return false;
+  switch (inst->info->fmt) {
+  case FMT_RR:
+  case FMT_RRI:
+  case FMT_LOAD:
+  case FMT_BR:
+  case FMT_VSET:
+  case FMT_VLOAD:
+  case FMT_VSTORE:
+  case FMT_VX:
+    return inst->rs1 == r;
+  case FMT_VVX:
+    return inst->rs2 == r;
+  case FMT_VVV:
+  case FMT_XV:
+    return false;
+  case FMT_RRR:
+  case FMT_BRR:
+  case FMT_STORE:
+    return inst->rs1 == r || inst->rs2 == r;
+  case FMT_R:
+    return inst->info->kind == OP_JR && inst->rs1 == r;
+  default:
+    // calls read the argument registers
+    return inst->info->kind == OP_CALL || inst->info->kind == OP_TAIL;
+  }
+}
+
+#define HALT_ADDR (-1)
+
+static int run(int entry) {
+  int64_t stackTop = MEM_BASE + MemSize;
+  X[2] = stackTop;
+  X[1] = HALT_ADDR;
+  int pc = entry;
+  // cycle at which the previous instruction's result becomes available
+  int pendingReg = 0;
+  uint64_t pendingReady = 0;
+  uint64_t divBusy = 0;
+
+  while (pc != HALT_ADDR) {
+    if (pc < 0 || pc >= InstCnt)
+      fatal("pc out of range: %d", pc);
+    Inst *inst = &Insts[pc];
+    OpKind k = inst->info->kind;
+    int next = pc + 1;
+    int64_t a = X[inst->rs1], b = X[inst->rs2], imm = inst->imm;
+    int64_t r = 0;
+    bool writes = true;
+    bool taken = false;
+
+    St.insts++;
+    St.count[k]++;
+    St.cycles++;
+    if (pendingReg && readsReg(inst, pendingReg) && St.cycles < pendingReady)
+      St.cycles = pendingReady;
+    pendingReg = 0;
+
+    switch (k) {
+    case OP_LI:
+    case OP_LA:
+      r = imm;
+      break;
+    case OP_LUI:
+      r = (int64_t)(int32_t)(imm << 12);
+      break;
+    case OP_MV:
+      r = a;
+      break;
+    case OP_NEG:
+      r = -a;
+      break;
+    case OP_NEGW:
+      r = (int32_t)-a;
+      break;
+    case OP_NOT:
+      r = ~a;
+      break;
+    case OP_SEQZ:
+      r = a == 0;
+      break;
+    case OP_SNEZ:
+      r = a != 0;
+      break;
+    case OP_SLTZ:
+      r = a < 0;
+      break;
+    case OP_SGTZ:
+      r = a > 0;
+      break;
+    case OP_SEXTW:
+      r = (int32_t)a;
+      break;
+    case OP_ADD:
+      r = a + b;
+      break;
+    case OP_ADDW:
+      r = (int32_t)(a + b);
+      break;
+    case OP_ADDI:
+      r = a + imm;
+      break;
+    case OP_ADDIW:
+      r = (int32_t)(a + imm);
+      break;
+    case OP_SUB:
+      r = a - b;
+      break;
+    case OP_SUBW:
+      r = (int32_t)(a - b);
+      break;
+    case OP_MUL:
+      r = (int64_t)((uint64_t)a * (uint64_t)b);
+      break;
+    case OP_MULW:
+      r = (int32_t)(a * b);
+      break;
+    case OP_MULH:
+      r = (int64_t)(((__int128)a * (__int128)b) >> 64);
+      break;
+    case OP_MULHU:
+      r = (int64_t)(((unsigned __int128)(uint64_t)a * (uint64_t)b) >> 64);
+      break;
+    case OP_DIV:
+      r = b == 0 ? -1 : (a == INT64_MIN && b == -1) ? a : a / b;
+      break;
+    case OP_DIVW: {
+      int32_t x = a, y = b;
+      r = y == 0 ? -1 : (x == INT32_MIN && y == -1) ? x : x / y;
+      break;
+    }
+    case OP_DIVU:
+      r = b == 0 ? -1 : (int64_t)((uint64_t)a / (uint64_t)b);
+      break;
+    case OP_REM:
+      r = b == 0 ? a : (a == INT64_MIN && b == -1) ? 0 : a % b;
+      break;
+    case OP_REMW: {
+      int32_t x = a, y = b;
+      r = y == 0 ? x : (x == INT32_MIN && y == -1) ? 0 : x % y;
+      break;
+    }
+    case OP_AND:
+      r = a & b;
+      break;
+    case OP_ANDI:
+      r = a & imm;
+      break;
+    case OP_OR:
+      r = a | b;
+      break;
+    case OP_ORI:
+      r = a | imm;
+      break;
+    case OP_XOR:
+      r = a ^ b;
+      break;
+    case OP_XORI:
+      r = a ^ imm;
+      break;
+    case OP_SLL:
+      r = (uint64_t)a << (b & 63);
+      break;
+    case OP_SLLI:
+      r = (uint64_t)a << (imm & 63);
+      break;
+    case OP_SRL:
+      r = (uint64_t)a >> (b & 63);
+      break;
+    case OP_SRLI:
+      r = (uint64_t)a >> (imm & 63);
+      break;
+    case OP_SRA:
+      r = a >> (b & 63);
+      break;
+    case OP_SRAI:
+      r = a >> (imm & 63);
+      break;
+    case OP_SLLIW:
+      r = (int32_t)((uint32_t)a << (imm & 31));
+      break;
+    case OP_SRLIW:
+      r = (int32_t)((uint32_t)a >> (imm & 31));
+      break;
+    case OP_SRAIW:
+      r = (int32_t)a >> (imm & 31);
+      break;
+    case OP_SLT:
+      r = a < b;
+      break;
+    case OP_SLTI:
+      r = a < imm;
+      break;
+    case OP_SLTU:
+      r = (uint64_t)a < (uint64_t)b;
+      break;
+    case OP_SLTIU:
+      r = (uint64_t)a < (uint64_t)imm;
+      break;
+    case OP_SH1ADD:
+      r = (a << 1) + b;
+      break;
+    case OP_SH2ADD:
+      r = (a << 2) + b;
+      break;
+    case OP_SH3ADD:
+      r = (a << 3) + b;
+      break;
+    case OP_ANDN:
+      r = a & ~b;
+      break;
+    case OP_ORN:
+      r = a | ~b;
+      break;
+    case OP_MIN:
+      r = a < b ? a : b;
+      break;
+    case OP_MAX:
+      r = a > b ? a : b;
+      break;
+    case OP_LD:
+      r = load(a + imm, 8);
+      break;
+    case OP_LW:
+      r = load(a + imm, 4);
+      break;
+    case OP_LWU:
+      r = (uint32_t)load(a + imm, 4);
+      break;
+    case OP_LB:
+      r = load(a + imm, 1);
+      break;
+    case OP_LBU:
+      r = (uint8_t)load(a + imm, 1);
+      break;
+    case OP_SD:
+      store(a + imm, b, 8);
+      writes = false;
+      break;
+    case OP_SW:
+      store(a + imm, b, 4);
+      writes = false;
+      break;
+    case OP_SB:
+      store(a + imm, b, 1);
+      writes = false;
+      break;
+    case OP_BEQ:
+      taken = a == b;
+      break;
+    case OP_BNE:
+      taken = a != b;
+      break;
+    case OP_BLT:
+      taken = a < b;
+      break;
+    case OP_BGE:
+      taken = a >= b;
+      break;
+    case OP_BLTU:
+      taken = (uint64_t)a < (uint64_t)b;
+      break;
+    case OP_BGEU:
+      taken = (uint64_t)a >= (uint64_t)b;
+      break;
+    case OP_BEQZ:
+      taken = a == 0;
+      break;
+    case OP_BNEZ:
+      taken = a != 0;
+      break;
+    case OP_J:
+      next = inst->target;
+      writes = false;
+      break;
+    case OP_JR:
+      next = a;
+      writes = false;
+      break;
+    case OP_CALL:
+    case OP_TAIL:
+      St.calls++;
+      if (CheckAlign && X[2] % 16)
+        fatal("sp not 16-byte aligned at call (line %d)", inst->line);
+      writes = false;
+      if (inst->target >= 0) {
+        if (k == OP_CALL)
+          X[1] = pc + 1;
+        next = inst->target;
+        break;
+      }
+      X[10] = callBuiltin(inst->builtin, X);
+      if (k == OP_TAIL)
+        next = X[1];
+      break;
+    case OP_RET:
+      next = X[1];
+      writes = false;
+      break;
+    case OP_RDCYCLE:
+      r = St.cycles;
+      break;
+    case OP_RDINSTRET:
+      r = St.insts;
+      break;
+    case OP_NOP:
+      writes = false;
+      break;
+    case OP_VSETVLI:
+      r = setVl(inst, a);
+      break;
+    case OP_VMV_X_S:
+      r = runVector(inst, 0);
+      break;
+    case OP_VLE32:
+    case OP_VLE64:
+    case OP_VSE32:
+    case OP_VSE64:
+    case OP_VMV_V_X:
+    case OP_VMV_S_X:
+      runVector(inst, a);
+      writes = false;
+      break;
+    case OP_VADD_VV:
+    case OP_VADD_VX:
+    case OP_VSUB_VV:
+    case OP_VSUB_VX:
+    case OP_VRSUB_VX:
+    case OP_VMUL_VV:
+    case OP_VMUL_VX:
+    case OP_VDIV_VV:
+    case OP_VDIV_VX:
+    case OP_VREDSUM_VS:
+      runVector(inst, b);
+      writes = false;
+      break;
+    default:
+      fatal("unimplemented instruction %s", inst->info->name);
+    }
+
+    switch (inst->info->cls) {
+    case CLS_LOAD:
+      St.loads++;
+      pendingReg = inst->rd;
+      pendingReady = St.cycles + Model.loadUse + 1;
+      break;
+    case CLS_STORE:
+      St.stores++;
+      break;
+    case CLS_MUL:
+      pendingReg = inst->rd;
+      pendingReady = St.cycles + Model.mulLatency + 1;
+      break;
+    case CLS_DIV:
+      if (St.cycles < divBusy)
+        St.cycles = divBusy;
+      St.cycles += Model.divCycles;
+      divBusy = St.cycles;
+      break;
+    case CLS_BRANCH:
+      St.branches++;
+      writes = false;
+      if (taken) {
+        St.taken++;
+        next = inst->target;
+        St.cycles += Model.takenBranch;
+      }
+      break;
+    case CLS_JUMP:
+      St.cycles += Model.takenBranch;
+      break;
+    case CLS_VLOAD:
+      St.loads++;
+      break;
+    case CLS_VSTORE:
+      St.stores++;
+      break;
+    default:
+      break;
+    }
+
+    if (writes && inst->rd)
+      X[inst->rd] = r;
+    if (stackTop - X[2] > St.maxStack)
+      St.maxStack = stackTop - X[2];
+    pc = next;
+  }
+  return X[10] & 0xff;
+}
+
+// =================================================================
+// reporting
+
+static int instSize(Inst *inst) {
+  if (inst->compressed)
+    return 2;
+  switch (inst->info->kind) {
+  case OP_LI: {
+    int64_t v = inst->imm;
+    if (v >= -2048 && v < 2048)
+      return 4;
+    if (v >= INT32_MIN && v <= INT32_MAX)
+      return 8;
+    return 32;
+  }
+  case OP_LA:
+  case OP_CALL:
+  case OP_TAIL:
+    return 8;
+  default:
+    return 4;
+  }
+}
+
+// the compressed jumps and branches reach their targets
+static void checkReach(void) {
+  int64_t *addr = malloc(sizeof(int64_t) * (InstCnt + 1));
+  addr[0] = 0;
+  for (int i = 0; i < InstCnt; i++)
+    addr[i + 1] = addr[i] + instSize(&Insts[i]);
+  for (int i = 0; i < InstCnt; i++) {
+    Inst *inst = &Insts[i];
+    if (!inst->compressed || inst->target < 0)
+      continue;
+    int64_t dist = addr[inst->target] - addr[i];
+    int64_t reach = inst->info->kind == OP_J ? 2048 : 256;
+    if (dist < -reach || dist >= reach) {
+      CurLine = inst->line;
+      fatal("'c.%s' can not reach %s", inst->info->name, inst->sym);
+    }
+  }
+  free(addr);
+}
+
+static void report(FILE *out, int exitCode) {
+  uint64_t codeSize = 0;
+  for (int i = 0; i < InstCnt; i++)
+    codeSize += instSize(&Insts[i]);
+
+  fprintf(out, "exit        %d\n", exitCode);
+  fprintf(out, "insts       %" PRIu64 "\n", St.insts);
+  fprintf(out, "cycles      %" PRIu64 "\n", St.cycles);
+  fprintf(out, "loads       %" PRIu64 "\n", St.loads);
+  fprintf(out, "stores      %" PRIu64 "\n", St.stores);
+  fprintf(out, "branches    %" PRIu64 "\n", St.branches);
+  fprintf(out, "taken       %" PRIu64 "\n", St.taken);
+  fprintf(out, "calls       %" PRIu64 "\n", St.calls);
+  fprintf(out, "max-stack   %" PRId64 "\n", St.maxStack);
+  fprintf(out, "code-size   %" PRIu64 "\n", codeSize);
+  for (int i = 0; i < sizeof(OpTable) / sizeof(*OpTable); i++) {
+    OpKind k = OpTable[i].kind;
+    // aliases such as lla share a counter with their canonical name
+    if (St.count[k] && findOp(OpTable[i].name) == &OpTable[i] &&
+        (i == 0 || OpTable[i - 1].kind != k))
+      fprintf(out, "  %-10s%" PRIu64 "\n", OpTable[i].name, St.count[k]);
+  }
+}
+
+static void usage(int status) {
+  fprintf(stderr,
+          "usage: rvsim [-stats] [-check-align] [-o report] [-load-use=N] [-mul-latency=N]\n"
+          "             [-div-cycles=N] [-branch-penalty=N] [-mem=MB] "
+          "[-vlen=N] file.s...\n");
+  exit(status);
+}
+
+static bool parseIntOpt(char *arg, char *name, int *out) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) || arg[len] != '=')
+    return false;
+  *out = atoi(arg + len + 1);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  bool stats = false;
+  char *reportPath = NULL;
+  int memMB = 0;
+  char **inputs = calloc(argc, sizeof(char *));
+  int inputCnt = 0;
+
+  for (int i = 1; i < argc; i++) {
+    char *arg = argv[i];
+    if (!strcmp(arg, "-stats")) {
+      stats = true;
+    } else if (!strcmp(arg, "-check-align")) {
+      CheckAlign = true;
+    } else if (!strcmp(arg, "-o")) {
+      if (++i == argc)
+        usage(1);
+      reportPath = argv[i];
+      stats = true;
+    } else if (parseIntOpt(arg, "-load-use", &Model.loadUse) ||
+               parseIntOpt(arg, "-mul-latency", &Model.mulLatency) ||
+               parseIntOpt(arg, "-div-cycles", &Model.divCycles) ||
+               parseIntOpt(arg, "-branch-penalty", &Model.takenBranch) ||
+               parseIntOpt(arg, "-mem", &memMB) ||
+               parseIntOpt(arg, "-vlen", &Vlen)) {
+      continue;
+    } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+      usage(0);
+    } else if (arg[0] == '-' && arg[1]) {
+      usage(1);
+    } else {
+      inputs[inputCnt++] = arg;
+    }
+  }
+  if (!inputCnt)
+    usage(1);
+  if (memMB)
+    MemSize = (int64_t)memMB << 20;
+  Mem = calloc(1, MemSize);
+  // a power of two, at least one element of 64 bits
+  if (Vlen < 64 || Vlen > 65536 || (Vlen & (Vlen - 1)))
+    fatal("invalid -vlen=%d", Vlen);
+  V = calloc(32, Vlen / 8);
+
+  for (FileNo = 0; FileNo < inputCnt; FileNo++) {
+    InputPath = inputs[FileNo];
+    FILE *in = strcmp(InputPath, "-") ? fopen(InputPath, "r") : stdin;
+    if (!in)
+      fatal("cannot open %s", InputPath);
+    assemble(in);
+    if (in != stdin)
+      fclose(in);
+  }
+  resolve();
+  checkReach();
+
+  for (int i = 0; i < CtorCnt; i++) {
+    Label *ctor = findLabel(Ctors[i]);
+    if (!ctor || ctor->isData)
+      fatal("undefined function %s in .init_array", Ctors[i]);
+    run(ctor->val);
+  }
+  Label *entry = findLabel("main");
+  if (!entry || entry->isData)
+    fatal("no main function");
+  int exitCode = run(entry->val);
+  if (InstrTableCnt)
+    dumpInstrument();
+
+  if (stats) {
+    FILE *out = reportPath ? fopen(reportPath, "w") : stderr;
+    if (!out)
+      fatal("cannot open %s", reportPath);
+    report(out, exitCode);
+  }
+  return exitCode;
+}
@@ -0,0 +1,212 @@
+/*
+ *  Stack slot coloring
+ *
+ *  Every local gets a slot of its own in the frame, even when it is only
+ *  used in one branch of an if and another local only in the other one.
+ *  With the liveness of the locals (see cfg.c), two locals interfere when
+ *  they are both live at the same time, or both used by the same
+ *  expression. Locals of the same size which do not interfere are merged:
+ *  the reads and writes of one are renamed to the other, which then holds
+ *  both in its slot.
+ *
+ *  Parameters keep their own slots, the prologue writes them before the
+ *  body runs. In a function which takes the address of a local, no local
+ *  is tracked and the layout stays as it is.
+ */
+
+#include "rvcc.h"
+
+// number of locals merged and the bytes of the frames before and after
+static int MergeCnt;
+static int FrameBefore;
+static int FrameAfter;
+
+static CFG *Cfg;
+// Interfere[i] is the set of locals local i may not share a slot with
+static BitSet *Interfere;
+
+static void addInterference(BitSet set) {
+  for (int i = 0; i < Cfg->varCnt; i++) {
+    if (!inBitSet(set, i))
+      continue;
+    for (int j = 0; j < Cfg->varCnt; j++)
+      if (inBitSet(set, j))
+        addBitSet(Interfere[i], j);
+  }
+}
+
+// the tracked locals the tree reads or writes
+static void collectVars(Node *node, BitSet set) {
+  // down the left operands in a loop, see node.c
+  for (; node; node = node->left) {
+    if (node->nodeType == ND_VAR && Cfg->tracked[node->var->idx])
+      addBitSet(set, node->var->idx);
+    collectVars(node->right, set);
+    collectVars(node->cond, set);
+    collectVars(node->then, set);
+    collectVars(node->els, set);
+    collectVars(node->init, set);
+    collectVars(node->inc, set);
+    for (Node *n = node->body; n; n = n->next)
+      collectVars(n, set);
+    for (Node *n = node->args; n; n = n->next)
+      collectVars(n, set);
+  }
+}
+
+// walk the items of each block backwards: the locals live after an item
+// and the ones it uses are all in use at the same time
+static void buildInterference() {
+  int words = (Cfg->varCnt + 63) / 64;
+  BitSet live = newBitSet(Cfg->varCnt);
+  BitSet use = newBitSet(Cfg->varCnt);
+  BitSet def = newBitSet(Cfg->varCnt);
+  BitSet busy = newBitSet(Cfg->varCnt);
+
+  for (int i = 0; i < Cfg->blockCnt; i++) {
+    BasicBlock *bb = Cfg->blocks[i];
+    if (!bb->reachable)
+      continue;
+    memcpy(live, bb->liveOut, words * sizeof(uint64_t));
+    // locals read before they are written hold something from the start
+    if (bb == Cfg->entry)
+      addInterference(bb->liveIn);
+
+    for (int j = bb->itemCnt - 1; j >= 0; j--) {
+      Node *expr = *bb->items[j].expr;
+      if (!expr)
+        continue;
+
+      memcpy(busy, live, words * sizeof(uint64_t));
+      collectVars(expr, busy);
+      addInterference(busy);
+
+      memset(use, 0, words * sizeof(uint64_t));
+      memset(def, 0, words * sizeof(uint64_t));
+      exprUseDef(Cfg, expr, use, def);
+      for (int k = 0; k < words; k++)
+        live[k] = use[k] | (live[k] & ~def[k]);
+    }
+  }
+
+  free(live);
+  free(use);
+  free(def);
+  free(busy);
+}
+
+static void renameVars(Node *node, Obj **rename) {
+  for (; node; node = node->left) {
+    if (node->nodeType == ND_VAR && rename[node->var->idx])
+      node->var = rename[node->var->idx];
+    renameVars(node->right, rename);
+    renameVars(node->cond, rename);
+    renameVars(node->then, rename);
+    renameVars(node->els, rename);
+    renameVars(node->init, rename);
+    renameVars(node->inc, rename);
+    for (Node *n = node->body; n; n = n->next)
+      renameVars(n, rename);
+    for (Node *n = node->args; n; n = n->next)
+      renameVars(n, rename);
+  }
+}
+
+// the position of var among the parameters, -1 if it is not one
+static int paramIndex(Function *fn, Obj *var) {
+  int i = 0;
+  for (Obj *param = fn->params; param; param = param->next, i++)
+    if (param == var)
+      return i;
+  return -1;
+}
+
+static bool isParam(Function *fn, Obj *var) {
+  return paramIndex(fn, var) != -1;
+}
+
+// bytes taken by the locals, laid out as assignLVarOffset() does
+static int frameSize(Function *fn) {
+  int size = 0;
+  for (Obj *var = fn->locals; var; var = var->next) {
+    // parameters past the 8th are in the caller's frame
+    if (paramIndex(fn, var) >= NARGREG)
+      continue;
+    size = (size + var->dataType->size + var->dataType->align - 1) /
+           var->dataType->align * var->dataType->align;
+  }
+  return (size + 15) / 16 * 16;
+}
+
+static void colorSlots(Function *fn) {
+  Cfg = buildCFG(fn);
+  computeLiveness(Cfg);
+  int n = Cfg->varCnt;
+  Interfere = calloc(n, sizeof(BitSet));
+  for (int i = 0; i < n; i++)
+    Interfere[i] = newBitSet(n);
+  buildInterference();
+
+  // greedily put each local into the slot of the first one it may share
+  // with: owner[i] is the local whose slot local i is in
+  Obj **rename = calloc(n, sizeof(Obj *));
+  int *owner = calloc(n, sizeof(int));
+  int merged = 0;
+  for (int i = 0; i < n; i++) {
+    owner[i] = i;
+    Obj *var = Cfg->vars[i];
+    if (!Cfg->tracked[i] || isParam(fn, var))
+      continue;
+
+    for (int j = 0; j < i; j++) {
+      Obj *slot = Cfg->vars[j];
+      if (owner[j] != j || !Cfg->tracked[j] || isParam(fn, slot) ||
+          slot->dataType->size != var->dataType->size)
+        continue;
+
+      bool fits = true;
+      for (int k = 0; k < i && fits; k++)
+        if (owner[k] == j && inBitSet(Interfere[i], k))
+          fits = false;
+      if (!fits)
+        continue;
+
+      owner[i] = j;
+      rename[i] = slot;
+      merged++;
+      break;
+    }
+  }
+
+  MergeCnt += merged;
+  if (merged) {
+    renameVars(fn->body, rename);
+    Obj head = {};
+    Obj *cur = &head;
+    for (Obj *var = fn->locals; var; var = var->next)
+      if (!rename[var->idx])
+        cur = cur->next = var;
+    cur->next = NULL;
+    fn->locals = head.next;
+  }
+
+  for (int i = 0; i < n; i++)
+    free(Interfere[i]);
+  free(Interfere);
+  free(rename);
+  free(owner);
+  freeCFG(Cfg);
+}
+
+void colorStackSlots(Function *prog) {
+  for (Function *fn = prog; fn; fn = fn->next) {
+    FrameBefore += frameSize(fn);
+    colorSlots(fn);
+    FrameAfter += frameSize(fn);
+  }
+}
+
+void reportStackSlots() {
+  fprintf(stderr, "slots: %d locals merged, frames %d -> %d bytes\n",
+          MergeCnt, FrameBefore, FrameAfter);
+}
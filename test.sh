@@ -1,5 +1,8 @@
 #!/bin/bash
 
+# RUN=1时用rvcc -run解释执行, SIM=1时用rvsim运行生成的汇编,
+# 两者都不需要交叉编译工具链和qemu, 下列辅助函数由它们内置
+if [ -z "$RUN" ] && [ -z "$SIM" ]; then
 # 将下列代码编译为tmp2.o，"-xc"强制以c语言进行编译
 # cat <<EOF | gcc -xc -c -o tmp2.o -
 cat <<EOF | $RISCV/bin/riscv64-unknown-linux-gnu-gcc -xc -c -o tmp2.o -
@@ -10,19 +13,39 @@ int sub(int x, int y) { return x-y; }
 int add6(int a, int b, int c, int d, int e, int f) {
   return a+b+c+d+e+f;
 }
+int add8(int a, int b, int c, int d, int e, int f, int g, int h) {
+  return a+b+c+d+e+f+g+h;
+}
+int add10(int a, int b, int c, int d, int e, int f, int g, int h, int i, int j) {
+  return a+b+c+d+e+f+g+h+i+j;
+}
 EOF
+# -fprofile-generate和-finstrument-functions的运行时
+$RISCV/bin/riscv64-unknown-linux-gnu-gcc -c -o tmp3.o runtime/profile.c
+$RISCV/bin/riscv64-unknown-linux-gnu-gcc -c -o tmp4.o runtime/instrument.c
+fi
 
 # 校验rvcc生成的汇编能够正确运行的辅助函数
 assert() {
     expected="$1"  # expected arg number
     input="$2"     # argument sent to rvcc
+    shift 2        # the rest are extra options for rvcc
+
+    if [ -n "$RUN" ]; then
+        ./rvcc -run $RVCC_FLAGS "$@" "$input"
+        actual="$?"
+    elif [ -n "$SIM" ]; then
+        ./rvcc $RVCC_FLAGS "$@" "$input" > tmp.s || exit
+        rvsim/rvsim tmp.s
+        actual="$?"
+    else
+        ./rvcc $RVCC_FLAGS "$@" "$input" > tmp.s || exit # "$input" but not $input
+        # gcc -static -o tmp tmp.s tmp2.o
+        $RISCV/bin/riscv64-unknown-linux-gnu-gcc -static -o tmp tmp.s tmp2.o tmp3.o tmp4.o
 
-    ./rvcc "$input" > tmp.s || exit # "$input" but not $input
-    # gcc -static -o tmp tmp.s tmp2.o
-    $RISCV/bin/riscv64-unknown-linux-gnu-gcc -static -o tmp tmp.s tmp2.o
-
-    qemu-riscv64 -L $RISCV/sysroot ./tmp
-    actual="$?"
+        qemu-riscv64 -L $RISCV/sysroot ./tmp
+        actual="$?"
+    fi
     if [ "$actual" = "$expected" ]; then
         echo "$input => $actual"
     else
@@ -157,4 +180,283 @@ assert 7 'int main() { return add2(3,4); } int add2(int x, int y) { return x+y;
 assert 1 'int main() { return sub2(4,3); } int sub2(int x, int y) { return x-y; }'
 assert 55 'int main() { return fib(9); } int fib(int x) { if (x<=1) return 1; return fib(x-1) + fib(x-2); }'
 
+# [27] 尾调用优化, 尾递归不再增长栈
+assert 42 'int main() { return down(1000000); } int down(int n) { if (n==0) return 42; return down(n-1); }' -O1
+assert 64 'int main() { return sum(1000000, 0); } int sum(int n, int acc) { if (n==0) return acc; return sum(n-1, acc+1); }' -O1
+assert 1 'int main() { return even(1000000); } int even(int n) { if (n==0) return 1; return odd(n-1); } int odd(int n) { if (n==0) return 0; return even(n-1); }' -O1
+assert 8 'int main() { return f(3); } int f(int x) { return add(x, 5); }' -O1
+assert 7 'int main() { return f(3); } int f(int x) { int y=x+4; int *p=&y; return g(p); } int g(int *p) { return *p; }' -O1
+
+# [28] 内联小函数
+assert 7 'int main() { return add2(3,4); } int add2(int x, int y) { return x+y; }' -O2
+assert 5 'int main() { int x=5; return get(&x); } int get(int *p) { return *p; }' -O2
+assert 10 'int main() { return max(3,9)+max(0,-1)+1; } int max(int a, int b) { if (a<b) return b; return a; }' -O2
+assert 40 'int main() { int i=0; int s=0; for (i=0;i<10;i=i+1) s = s + tw(i) - i; return s - 15; } int tw(int x) { return tri(x,x); } int tri(int a, int b) { return a+b+1; }' -O2
+assert 10 'int main() { int x=3; set(&x, 10); return x; } int set(int *p, int v) { *p = v; return 0; }' -O2
+assert 6 'int main() { return sq(sq(2)) - 10; } int sq(int x) { return x*x; }' -O2
+assert 8 'int main() { return sq(3) - 1; } int sq(int x) { return x*x; }' -O2 -finline-limit=0
+
+# [29] 使用8个参数寄存器, 更多的参数通过栈传递
+assert 36 'int main() { return add8(1,2,3,4,5,6,7,8); }'
+assert 55 'int main() { return add10(1,2,3,4,5,6,7,8,9,10); }'
+assert 55 'int main() { int x=1; return add10(x,2,3,4,5,6,7,8,9,x+9); }'
+assert 55 'int main() { return add10(1,2,3,4,5,6,7,8,9,add10(1,2,3,4,5,6,7,8,9,10)-45); }'
+assert 19 'int main() { int x=3; int y=7; return sub(add(x,y)*add(x,y)/5, add(x,y)-1) + sub(y, x)*2; }'
+assert 55 'int main() { return f(1,2,3,4,5,6,7,8,9,10); } int f(int a,int b,int c,int d,int e,int g,int h,int i,int j,int k) { return a+b+c+d+e+g+h+i+j+k; }'
+assert 80 'int main() { return 1+f(1,2,3,4,5,6,7,8,9,10)-1; } int f(int a,int b,int c,int d,int e,int g,int h,int i,int j,int k) { return a*k+add(b*j,c*i)+d*h; }'
+
+# [30] 窥孔优化
+assert 55 'int main() {int i = 0;int j = 0; for(i = 0; i <= 10; i=i+1) j = i + j; return j; }' -O1
+assert 3 'int main() { int x=3; int y=5; return *(&y-1); }' -O1
+assert 1 'int main() { int a=2; int b=2; if (a==b) return 1; return 0; }' -O1
+assert 0 'int main() { int a=2; int b=3; if (a==b) return 1; return 0; }' -O1
+assert 1 'int main() { int a=2; int b=3; if (a!=b) return 1; return 0; }' -O1
+assert 7 'int main() { int a=4; int b=3; int c=a+b; if (a<b) return 0; return c; }' -O1
+
+# [31] 循环不变量外提
+assert 120 'int main(){int a=3;int b=4;int s=0;int i; for(i=0;i<10;i=i+1) s=s+a*b; return s;}' -O1
+assert 48 'int main(){int a=3;int b=4;int s=0;int i;int *p=&a; for(i=0;i<3;i=i+1){ s=s+a*b; *p=*p+1;} return s;}' -O1
+assert 12 'int main(){int a=1;int s=0;int i; for(i=0;i<3;i=i+1){ s=s+a*2; set(&a, a+1);} return s;} int set(int *p,int v){*p=v;return 0;}' -O1
+assert 28 'int main(){int x=5;int y=7;int *p=&x;int n=1;int s=0;int i; for(i=0;i<4;i=i+1) s=s+*(p+n); return s;}' -O1
+assert 1 'int main(){int a=0;int s=0; while(s) s = 5/a; return 1;}' -O1
+assert 90 'int main(){int s=0;int i;int j;int k=2;int n=3; for(i=0;i<3;i=i+1) for(j=0;j<5;j=j+1) s=s+i*k+n*k-j; return s;}' -O1
+assert 10 'int main(){int n=5;int i=0; while(i<n*2) i=i+1; return i;}' -O1
+
+# [32] 归纳变量强度削减
+assert 10 'int main(){int a=1;int b=2;int c=3;int d=4;int *p=&a;int s=0;int i;int n=4; for(i=0;i<n;i=i+1) s=s+*(p+i); return s;}' -O1
+assert 14 'int main(){int a=1;int b=2;int c=3;int d=4;int *p=&a;int s=0;int i; for(i=0;i<4;i=i+1) s=s+*(p+i); return s+i;}' -O1
+assert 4 'int main(){int a=1;int b=2;int c=3;int d=4;int *p=&a;int s=0;int i; for(i=0;4>i;i=i+2) s=s+*(p+i); return s;}' -O1
+assert 16 'int main(){int a=1;int b=2;int c=3;int d=4;int *p=&a;int s=0;int i; for(i=0;i!=4;i=i+1) s=s+*(p+i)+i; return s;}' -O1
+assert 20 'int main(){int a=1;int b=2;int c=3;int d=4;int *p=&a;int i; for(i=0;i<4;i=i+1) *(p+i)=*(p+i)*2; return a+b+c+d;}' -O1
+assert 54 'int main(){int a=1;int b=2;int c=3;int d=4;int *p=&a;int s=0;int i;int j; for(j=0;j<3;j=j+1) for(i=0;i<4;i=i+1) s=s+*(p+i)+*(p+j); return s-d*0+0;}' -O1
+assert 7 'int main(){int a=1;int b=2;int *p=&a;int i=5; while(i<3) i=i+1; for(i=2;i<2;i=i+1) a=*(p+i); return a+i+4;}' -O1
+# 取了地址的计数器可以通过指针读到, 不能删掉
+assert 43 'int main(){int z=3;int n=3;int i;int *pi=&i;int *p=&z;int s=0;for(i=0;i<n;i=i+1)s=s+*pi+(p+i==p);return s*10+*pi;}' -O1
+
+# [33] 循环展开
+assert 55 'int main(){int s=0;int i; for(i=1;i<=10;i=i+1) s=s+i; return s;}' -O1 -funroll-loops
+assert 45 'int main(){int s=0;int i; for(i=0;i<10;i=i+1) s=s+i; return s+i-10;}' -O1 -funroll-loops
+assert 30 'int main(){int s=0;int i=10; while(i>0) { s=s+i; i=i-2; } return s;}' -O1 -funroll-loops
+assert 0 'int main(){int s=0;int i; for(i=5;i<5;i=i+1) s=s+i; return s;}' -O1 -funroll-loops
+assert 55 'int main(){return sum(11);} int sum(int n){int s=0;int i; for(i=0;i<n;i=i+1) s=s+i; return s;}' -O1 -funroll-loops
+assert 49 'int main(){return sum(13)-29;} int sum(int n){int s=0;int i; for(i=0;i<n;i=i+1) s=s+i; return s+i-n;}' -O1 -funroll-loops
+assert 66 'int main(){return sum(11);} int sum(int n){int s=0;int i; for(i=0;i<=n;i=i+1) s=s+i; return s;}' -O1 -funroll-loops
+assert 52 'int main(){return sum(13, 0);} int sum(int n, int m){int s=0;int i; for(i=n;i>m;i=i-1) s=s+i; return s-39;}' -O1 -funroll-loops
+assert 10 'int main(){int a=1;int b=2;int c=3;int d=4; return sum(&a, 4);} int sum(int *p, int n){int s=0;int i; for(i=0;i<n;i=i+1) s=s+*(p+i); return s;}' -O1 -funroll-loops
+assert 9 'int main(){int a=1;int b=2;int c=3;int d=4; return sum(&a, 3)+i3(&a);} int sum(int *p, int n){int s=0;int i; for(i=0;i<n;i=i+1) s=s+*(p+i); return s;} int i3(int *p){return *(p+2)-0;}' -O1 -funroll-loops
+assert 20 'int main(){int a=1;int b=2;int c=3;int d=4;int *p=&a;int i; for(i=0;i<4;i=i+1) *(p+i)=*(p+i)*2; return a+b+c+d;}' -O1 -funroll-loops
+assert 7 'int main(){int a=1;int b=2;int c=3;int *p=&a;int i=0;int s=0; while(i<3) { s=s+*(p+i); *(p+i+1)=0; i=i+1; } return s+6;}' -O1 -funroll-loops
+assert 3 'int main(){int i; for(i=0;i<100;i=i+1) if (i==3) return i; return 0;}' -O1 -funroll-loops
+assert 55 'int main(){return sum(11);} int sum(int n){int s=0;int i; for(i=0;i<n;i=i+1) s=s+i; return s;}' -O1 -funroll-loops -funroll-limit=20
+# 取了地址的计数器不替换为i+d
+assert 21 'int main(){int s=0;int i;int *q;int n=20; for(i=0;i<n;i=i+1){q=&i;s=s+1;} return s+(*q==20);}' -O1 -funroll-loops
+# 边界接近int的两端时, 展开后的循环条件不能溢出
+assert 3 'int main(){return f(2147483647);} int f(int n){int s=0;int i; for(i=n-3;i<n;i=i+1) s=s+1; return s;}' -O1 -funroll-loops
+assert 11 'int main(){return f(2147483645);} int f(int n){int s=0;int i; for(i=n-20;i<=n;i=i+2) s=s+1; return s;}' -O1 -funroll-loops
+assert 3 'int main(){return f(-2147483647);} int f(int n){int s=0;int i; for(i=n+3;i>n;i=i-1) s=s+1; return s;}' -O1 -funroll-loops
+assert 21 'int main(){return f(-2147483647)+f(21);} int f(int n){int s=0;int i; for(i=0;i<n;i=i+1) s=s+1; return s;}' -O1 -funroll-loops
+
+# [34] 公共子表达式消除
+assert 26 'int main(){int a=3;int b=4; return a*b+1 + a*b+1;}' -O1
+assert 24 'int main(){int a=3;int b=4; int c=a*b; a=5; return c+a*b-8;}' -O1
+assert 14 'int main(){int a=3;int b=4;int *p=&a; int c=a*b; *p=1; return c+a*b-2;}' -O1
+assert 12 'int main(){int a=3;int b=4;int *p=&a; return *(p+1) + *(p+1) + *(p+1);}' -O1
+assert 2 'int main(){int a=3;int b=4;int *p=&b; int c=*(p-1); *(p-1)=c-2; return *(p-1)*2;}' -O1
+assert 7 'int main(){int a=3;int b=4; int c=a+b; set(&a, 10); return c+a+b-14;} int set(int *p, int v){*p=v; return 0;}' -O1
+assert 21 'int main(){int a=3;int b=4; int c=b*a; if (a*b>10) c=c+a*b-3; return c-a*b+12;}' -O1
+assert 30 'int main(){int x=2; int y=x*x+x*x; x=3; return y+x*x+x*x+4;}' -O1
+assert 11 'int main(){int a=3;int b=4; return add(a*b, a*b-13);}' -O1
+assert 36 'int main(){int a=1;int b=2; return add10(a+b,a+b,a+b,a+b,a+b,a+b,a+b,a+b,a+b,a+b)+6;}' -O1
+assert 24 'int main(){int a=3; return sq(a+1)+sq(a+1)-8;} int sq(int x){return x*x;}' -O1
+
+# [35] 常量与复制传播
+assert 24 'int main(){int k=8; int x=3; return x*k;}' -O1
+assert 5 'int main(){int k=8; if (k>4) return 5; return 6;}' -O1
+assert 10 'int main(){int k=0; int i; int s=0; for(i=0;i<10;i=i+1) { if (k) s=s+100; s=s+1; } return s;}' -O1
+assert 3 'int main(){int x=1; int y=x; x=2; return y+x;}' -O1
+assert 6 'int main(){int x=1; int i; for(i=0;i<5;i=i+1) x=x+1; return x;}' -O1
+assert 7 'int main(){int x=3; int *p=&x; *p=7; return x;}' -O1
+assert 4 'int main(){int a=3; int b=4; int *p=&a; *(p+1)=4; return b;}' -O1
+assert 11 'int main(){int x=5; if (x==5) x=11; else x=12; return x;}' -O1
+assert 0 'int main(){int x=0; while(0) x=x+1; return x;}' -O1
+assert 8 'int main(){return g(3)+g(4)-3;} int g(int n){int k=2; if (n>3) k=k+1; return n*k-k-1;}' -O2
+# 常量运算数里的赋值不能随折叠丢掉
+assert 34 'int f(int c){int x=0;int y=0;if(c){y=(x=3)+1;}return x*10+y;} int main(){return f(1);}' -O1
+assert 34 'int f(int c){int x=0;int y=0;if(c){y=(x=3)+1;}return x*10+y;} int main(){return f(1);}' -O2
+assert 45 'int main(){int x=0;int y=0;if((x=1)) y=2; for(;(y=0);) x=9; return x*10+y-(x=5);}' -O1
+
+# [36] 不可达代码与死存储消除
+assert 5 'int main(){int x=1; return 5; x=2; return x;}' -O1
+assert 4 'int main(){int i; for(i=0;;i=i+1) { if (i==4) return i; } return 9;}' -O1
+assert 1 'int main(){int i; for(i=0;i<10;i=i+1) { return 1; } return 2;}' -O1
+assert 7 'int main(){int x=3; x=4; x=7; return x;}' -O1
+assert 6 'int main(){int x=ret3(); int y=x; x=ret3()+x; return x;}' -O1
+assert 8 'int main(){int x=1; int y=2; if (x) y=8; else return 2; return y;}' -O1
+assert 12 'int main(){int s=0; int i; int t; for(i=0;i<4;i=i+1) { t=i*2; s=s+i; } return s+6;}' -O1
+assert 13 'int main(){int a; int b; b = a = 10; return a+3;}' -O1
+assert 6 'int main(){int x=1; while (x<5) { x=x+1; if (x==3) x=x+2; } return x+1;}' -O1
+assert 5 'int main(){int u=ret5(); int v=u+1; return u;}' -O1
+assert 14 'int main(){return g(5)+g(5);} int g(int n){int t=n*2; if (n>3) return t-3; return t;}' -O2
+
+# [37] 32位int
+assert 1 'int main(){int x=2147483647; return x+1 < 0;}'
+assert 1 'int main(){int a=65536; return a*a==0;}'
+assert 1 'int main(){return 2147483647+1 < 0;}' -O1
+assert 1 'int main(){int a=65536; int b=a; int i; int s=0; for(i=0;i<2;i=i+1) s=s+a*b; return s==0;}' -O1
+assert 3 'int main(){int a=1; int b=2; int *p=&a; return *(p+1)+1;}'
+assert 4 'int main(){int a; int b; return &b-&a+3;}'
+assert 6 'int main(){int a=2;int b=3;int c=0;int *p=&a; *(p+2)=a*b; return c;}'
+assert 55 'int main(){return sum10(1,2,3,4,5,6,7,8,9,10);} int sum10(int a,int b,int c,int d,int e,int f,int g,int h,int i,int j){return a+b+c+d+e+f+g+h+i+j;}'
+assert 1 'int main(){int x=-2147483647; x=x-1; return x-1 > 0;}' -O1
+
+# [38] 栈槽复用
+assert 12 'int main(){int k=ret3(); int r; if (k==1) {int a=k*2; int b=a+1; r=a*b;} else if (k==3) {int c=k+1; int d=c*c; r=d-4;} else {int e=k; r=e;} return r;}' -O1
+assert 30 'int main(){int s=0; {int a=ret5(); s=s+a*2;} {int b=ret5(); s=s+b*4;} return s;}' -O1
+assert 10 'int main(){int x=ret5(); int y=x+1; int z=y+x; int w=z-2; return w+y-5;}' -O1
+assert 21 'int main(){int i; int s=0; for(i=0;i<3;i=i+1){int t=i*2; s=s+t;} {int u=ret5(); s=s+u*3;} return s;}' -O1
+assert 8 'int main(){int a=ret3(); int b=ret5(); int t; if (a<b) {t=a; a=b; b=t;} return a+b-t+3;}' -O1
+
+# [39] 增量编译缓存, 第二次编译时函数的代码来自缓存
+rm -rf tmp-cache
+assert 10 'int f(int x) { if (x) return x+1; return 0; } int main() { int i; int s=0; for (i=0; i<3; i=i+1) s=s+f(i); return s+f(3)+1; }' -fcache-dir=tmp-cache
+assert 10 'int f(int x) { if (x) return x+1; return 0; } int main() { int i; int s=0; for (i=0; i<3; i=i+1) s=s+f(i); return s+f(3)+1; }' -fcache-dir=tmp-cache
+assert 13 'int f(int x) { if (x) return x+2; return 0; } int main() { int i; int s=0; for (i=0; i<3; i=i+1) s=s+f(i); return s+f(3)+1; }' -fcache-dir=tmp-cache
+assert 15 'int f(int x) { if (x) return x+2; return 0; } int main() { int i; int s=0; for (i=0; i<3; i=i+1) s=s+f(i); return s+f(3)+3; }' -fcache-dir=tmp-cache -O2
+assert 15 'int f(int x) { if (x) return x+2; return 0; } int main() { int i; int s=0; for (i=0; i<3; i=i+1) s=s+f(i); return s+f(3)+3; }' -fcache-dir=tmp-cache -O2 -fcache-limit=0
+rm -rf tmp-cache
+# 三千个函数写入空的缓存: 编译结束时才扫描一遍目录清理旧文件,
+# 而不是每写入一个函数就扫描一遍
+{
+    for i in $(seq 3000); do printf 'int f%d() { return %d; }\n' $i $((i % 7)); done
+    printf 'int main() { return f3000() + f3(); }\n'
+} > tmp-many.c
+timeout 3 ./rvcc $RVCC_FLAGS -fcache-dir=tmp-cache tmp-many.c > /dev/null ||
+    { echo "tmp-many.c: 写入缓存超时"; exit 1; }
+assert 7 tmp-many.c -fcache-dir=tmp-cache
+rm -rf tmp-cache tmp-many.c
+
+# [40] 二进制AST文件, 解析一次后以不同的优化等级编译
+./rvcc -emit-ast tmp.rast 'int sq(int x) { return x*x; } int main() { int s=0; int i; for (i=0; i<5; i=i+1) s=s+sq(i); int *p=&s; return *p+1; }' || exit
+assert 31 tmp.rast
+assert 31 tmp.rast -O1
+assert 31 tmp.rast -O2 -funroll-loops
+# 读回的AST与源程序生成相同的汇编, int仍是解析器共用的TyInt
+P='int k(int *b, int n) { int s = 9; int i; for (i = 1; i < n; i = i + 1) s = (*(b + (i + 1)) + (i + 1)) + s; return s; } int main() { int a0=1; int a1=2; int a2=3; int a3=4; int a4=5; return k(&a0, 4); }'
+./rvcc -emit-ast tmp.rast "$P" || exit
+for opt in -O0 -O1 "-O2 -funroll-loops"; do
+    [ "$(./rvcc $opt "$P")" = "$(./rvcc $opt tmp.rast)" ] ||
+        { echo "tmp.rast $opt: 汇编与源程序不同"; exit 1; }
+done
+assert 30 tmp.rast -O2 -funroll-loops
+# 第一个节点的类型改为不存在的值, 读取时报错而不是交给代码生成
+./rvcc -emit-ast tmp.rast 'int main() { return 0; }' || exit
+printf '\x63\x00\x00\x00' | dd of=tmp.rast bs=1 seek=64 conv=notrunc 2> /dev/null
+./rvcc tmp.rast > /dev/null 2>&1 && { echo "tmp.rast: 损坏的文件没有报错"; exit 1; }
+
+# [41] 剖析反馈优化, 先插桩运行得到剖析数据, 再按数据编译
+export RVCC_PROFILE=tmp.prof
+rm -f tmp.prof
+assert 28 'int main() { int s=0; int i; for (i=0; i<10; i=i+1) { if (i<2) s=s+1; else s=s+3; } return s+2; }' -fprofile-generate
+assert 28 'int main() { int s=0; int i; for (i=0; i<10; i=i+1) { if (i<2) s=s+1; else s=s+3; } return s+2; }' -fprofile-use=tmp.prof
+assert 21 'int g(int x) { return x*2+1; } int main() { int s=0; int i; for (i=0; i<10; i=i+1) if (i>20) s=s+g(i); else s=s+g(0)*2; return s+1; }' -fprofile-generate -O2
+assert 21 'int g(int x) { return x*2+1; } int main() { int s=0; int i; for (i=0; i<10; i=i+1) if (i>20) s=s+g(i); else s=s+g(0)*2; return s+1; }' -fprofile-use=tmp.prof -O2
+unset RVCC_PROFILE
+# 剖析数据只有一个源文件的偏移, 没有main的文件不能插桩
+./rvcc -fprofile-generate 'int f() { return 1; }' > /dev/null 2>&1 && { echo "-fprofile-generate: 没有main的文件没有报错"; exit 1; }
+
+# [42] 冷热代码布局, 很少执行的分支放到函数末尾
+assert 75 'int g(int x) { if (x < 0) return -1; return x * 2; } int h(int x) { int s = 0; int i; for (i = 0; i < x; i = i + 1) { if (i == 7) { if (x > 100) return 99; s = s + g(i - 20); } else s = s + g(i); } return s; } int main() { return h(10); }' -O1
+assert 99 'int g(int x) { if (x < 0) return -1; return x * 2; } int h(int x) { int s = 0; int i; for (i = 0; i < x; i = i + 1) { if (i == 7) { if (x > 100) return 99; s = s + g(i - 20); } else s = s + g(i); } return s; } int main() { return h(200); }' -O2
+assert 6 'int f(int x) { if (x > 5) { x = x - 1; } else return x + 1; return x; } int main() { return f(5) + f(0) - 1; }' -O1
+assert 55 'int main() { int s=0; int i=0; while (i<=10) { s=s+i; i=i+1; } return s; }' -O1
+assert 0 'int main() { int s=0; int i; for (i=0; i<0; i=i+1) s=s+1; return s; }' -O1
+
+# [43] 函数计时插桩, 解释执行时没有周期计数器可读
+if [ -z "$RUN" ]; then
+export RVCC_INSTRUMENT=tmp.instr
+assert 8 'int f(int x) { if (x <= 1) return x; return f(x-1) + f(x-2); } int main() { return f(6); }' -finstrument-functions -finline-limit=0
+grep -q '^f 25 ' tmp.instr || { echo "tmp.instr: f should be called 25 times"; exit 1; }
+assert 8 'int f(int x) { if (x <= 1) return x; return f(x-1) + f(x-2); } int main() { return f(6); }' -finstrument-functions -O1
+grep -q '^main 1 ' tmp.instr || { echo "tmp.instr: main should be called once"; exit 1; }
+# 分别插桩的两个文件共用被调函数用时, 两者的计时表都写出.
+# 不带$RVCC_FLAGS, -fwhole-program会删去另一个文件调用的函数
+echo 'int f(int x) { if (x <= 1) return x; return g(x-1) + g(x-2); }' > tmp-f.c
+./rvcc -finstrument-functions -finline-limit=0 tmp-f.c > tmp-f.s || exit
+./rvcc -finstrument-functions -finline-limit=0 'int g(int x) { return f(x); } int main() { return f(6); }' > tmp.s || exit
+if [ -n "$SIM" ]; then
+    rvsim/rvsim tmp.s tmp-f.s
+else
+    $RISCV/bin/riscv64-unknown-linux-gnu-gcc -static -o tmp tmp.s tmp-f.s tmp2.o tmp3.o tmp4.o
+    qemu-riscv64 -L $RISCV/sysroot ./tmp
+fi
+[ "$?" = 8 ] || { echo "tmp-f.c: 8 expected"; exit 1; }
+grep -q '^f 25 ' tmp.instr && grep -q '^g 24 ' tmp.instr || { echo "tmp.instr: f and g are missing"; exit 1; }
+# 各函数自身用时之和等于main的总用时
+awk '!/^#/ { self += $4 } /^main / { total = $3 } END { exit self != total }' tmp.instr || { echo "tmp.instr: self-cycles do not add up"; exit 1; }
+echo "tmp-f.c tmp.s => 8"
+unset RVCC_INSTRUMENT
+rm -f tmp.instr tmp-f.c tmp-f.s
+fi
+
+# [44] RVC压缩指令
+assert 7 'int main() { int x=3; int y=5; *(&x+1)=7; return y; }' -march=rv64gc
+assert 55 'int sum(int a, int b, int c, int d, int e, int f, int g, int h, int i, int j) { return a+b+c+d+e+f+g+h+i+j; } int main() { return sum(1,2,3,4,5,6,7,8,9,10); }' -march=rv64gc
+assert 55 'int sum(int a, int b, int c, int d, int e, int f, int g, int h, int i, int j) { return a+b+c+d+e+f+g+h+i+j; } int main() { return sum(1,2,3,4,5,6,7,8,9,10); }' -march=rv64gc -O1
+assert 89 'int fib(int n) { if (n <= 1) return 1; return fib(n-1) + fib(n-2); } int main() { return fib(10); }' -march=rv64gc -O1
+assert 10 'int main() { int x=3; set(&x, 10); return x; } int set(int *p, int v) { *p = v; return 0; }' -march=rv64gc -O2
+
+# [45] 很长的左结合表达式
+# 五万项的a+a+...和a*a*...超出了命令行参数的长度, 从.c文件读入;
+# 编译器只有1MB的栈, 解析和遍历AST都不能每项递归一层
+{
+    printf 'int f(int a) { return a'
+    printf '+a%.0s' $(seq 24999)
+    printf '+a'
+    printf '*a%.0s' $(seq 24999)
+    printf '; } int main() { return f(1)-24991; }\n'
+} > tmp-chain.c
+for opt in -O0 -O1 -O2; do
+    (ulimit -s 1024; ./rvcc $RVCC_FLAGS $opt tmp-chain.c > /dev/null) ||
+        { echo "tmp-chain.c $opt: 编译失败"; exit 1; }
+done
+assert 10 tmp-chain.c
+assert 10 tmp-chain.c -O1
+assert 0 'int main() { return 3>2>1; }'
+assert 1 'int main() { return 1<2<3; }'
+assert 1 'int main() { int a=5; return 0<a<=1; }'
+
+# [46] RVV向量化
+# 连续声明的局部变量当作数组, 元素个数不是向量长度的倍数时最后一段较短;
+# 写入的数组紧跟在读取的数组之后时, 改为执行标量循环
+export QEMU_CPU=rv64,v=true,vlen=128
+assert 111 'int saxpy(int *c, int *a, int *b, int x, int n) { int i; for (i = 0; i < n; i = i + 1) *(c + i) = *(a + i) * x + *(b + i); return i; } int dot(int *a, int *b, int n) { int s = 0; int i; for (i = 0; i < n; i = i + 1) s = s + *(a + i) * *(b + i); return s; } int main() { int a0=1; int a1=2; int a2=3; int a3=4; int a4=5; int a5=6; int a6=7; int b0=10; int b1=20; int b2=30; int b3=40; int b4=50; int b5=60; int b6=70; int c0=0; int c1=0; int c2=0; int c3=0; int c4=0; int c5=0; int c6=0; int r = saxpy(&c0, &a0, &b0, 3, 7); return r + c0 + c6 + dot(&a0, &b0, 7) - 1400; }' -O1 -march=rv64gcv
+assert 66 'int f(int *a, int x, int n) { int s = 5; int i; for (i = 1; i < n; i = i + 1) s = s + (x - *(a + i)) / 2; return s; } int main() { int a0=1; int a1=2; int a2=3; int a3=4; int a4=5; int a5=6; int a6=7; int a7=8; int a8=9; int a9=10; return f(&a0, 20, 10); }' -O1 -march=rv64gcv
+assert 19 'int f(int *c, int *a, int n) { int i; for (i = 0; i < n; i = i + 1) *(c + i) = *(a + (i + 1)) + 1; return i; } int main() { int a0=1; int a1=2; int a2=3; int a3=4; int a4=5; int a5=6; int a6=7; int a7=8; int a8=9; int a9=10; return f(&a0, &a0, 9) + a0 + a8; }' -O1 -march=rv64gcv
+assert 1 'int f(int *c, int *a, int n) { int i; for (i = 0; i < n; i = i + 1) *(c + i) = *(a + i); return i; } int main() { int a0=1; int a1=2; int a2=3; int a3=4; int a4=5; int a5=6; int a6=7; int a7=8; int a8=9; int a9=10; f(&a1, &a0, 9); return a9; }' -O1 -march=rv64gcv
+assert 4 'int f(int *c, int *a, int n) { int i; for (i = 3; i < n; i = 1 + i) *(c + i) = -*(a + i) * 2; return i; } int main() { int a0=1; int a1=2; int a2=3; int a3=4; int a4=5; int a5=6; int a6=7; int a7=8; int a8=9; int a9=10; return f(&a0, &a0, 1) + a0; }' -O1 -march=rv64gcv
+unset QEMU_CPU
+
+# [47] Zba/Zbb位操作指令
+assert 7 'int main() { int x=3; int y=5; *(&x+1)=7; return y; }' -march=rv64gc_zba_zbb
+assert 11 'int main() { int a=2; int b=3; int c=4; int *p=&a; return *(p+2) + a*2 + b*1 + 0*8; }' -march=rv64gc_zba_zbb
+assert 3 'int main() { int a=3; int b=8; int m; if (a < b) m = a; else m = b; return m; }' -march=rv64gc_zba_zbb
+assert 8 'int main() { int a=3; int b=8; int m=a; if (m <= b) m = b; return m; }' -march=rv64gc_zba_zbb
+assert 251 'int main() { int a=-5; int b=-8; int m=a; if (b < m) m = b; return m + 3; }' -march=rv64g_zbb -O1
+assert 5 'int main() { int a=5; int b=5; int m; if (a < b) m = b; else m = a; return m; }' -march=rv64gc_zbb
+
+# [48] 除以常数, 用乘法和移位代替除法指令
+# 与除以同一个数的变量(仍用divw)比较, 被除数取边界值和伪随机数
+assert 0 'int bad(int x, int *d) { return (x/1 != x / *d) + (x/2 != x / *(d+1)) + (x/3 != x / *(d+2)) + (x/7 != x / *(d+3)) + (x/8 != x / *(d+4)) + (x/10 != x / *(d+5)) + (x/641 != x / *(d+6)) + (x/-1 != x / *(d+7)) + (x/-4 != x / *(d+8)) + (x/-6 != x / *(d+9)) + (x/1000000 != x / *(d+10)) + (x/2147483647 != x / *(d+11)); } int main() { int d0=1; int d1=2; int d2=3; int d3=7; int d4=8; int d5=10; int d6=641; int d7=-1; int d8=-4; int d9=-6; int d10=1000000; int d11=2147483647; int n = bad(2147483647, &d0) + bad(-2147483647-1, &d0) + bad(-1, &d0) + bad(0, &d0); int x = 1; int i; for (i = 0; i < 3000; i = i + 1) { x = x * 1103515245 + 12345; n = n + bad(x, &d0) + bad(x / 65536, &d0) + bad(i - 1500, &d0); } return n; }' -O1
+assert 0 'int bad(int x, int *d) { return (x/1 != x / *d) + (x/2 != x / *(d+1)) + (x/3 != x / *(d+2)) + (x/7 != x / *(d+3)) + (x/8 != x / *(d+4)) + (x/10 != x / *(d+5)) + (x/641 != x / *(d+6)) + (x/-1 != x / *(d+7)) + (x/-4 != x / *(d+8)) + (x/-6 != x / *(d+9)) + (x/1000000 != x / *(d+10)) + (x/2147483647 != x / *(d+11)); } int main() { int d0=1; int d1=2; int d2=3; int d3=7; int d4=8; int d5=10; int d6=641; int d7=-1; int d8=-4; int d9=-6; int d10=1000000; int d11=2147483647; int n = bad(2147483647, &d0) + bad(-2147483647-1, &d0) + bad(-1, &d0) + bad(0, &d0); int x = 1; int i; for (i = 0; i < 3000; i = i + 1) { x = x * 1103515245 + 12345; n = n + bad(x, &d0) + bad(x / 65536, &d0) + bad(i - 1500, &d0); } return n; }' -O2 -march=rv64gc
+assert 1 'int main() { int x=-17; return x/-3 + 17/3 - 17/4 + x/4 - 1; }' -O1
+assert 1 'int main() { int a=3; int b=5; int *p=&a; int *q=&b; return q-p; }' -O1
+
+# [49] 调用图, 删除main调用不到的函数, 常量参数特化
+# 调用不到的函数调用了未定义的missing, 没有删除就无法链接
+assert 50 'int dead() { return missing(); } int sq(int x, int k) { int r = 1; int i; for (i = 0; i < k; i = i + 1) r = r * x; return r; } int f(int n, int k) { if (n <= 0) return 0; return k + f(n - 1, k); } int main() { return sq(2, 3) + sq(3, 3) + f(5, 3); }' -fwhole-program
+assert 50 'int dead() { return missing(); } int sq(int x, int k) { int r = 1; int i; for (i = 0; i < k; i = i + 1) r = r * x; return r; } int f(int n, int k) { if (n <= 0) return 0; return k + f(n - 1, k); } int main() { return sq(2, 3) + sq(3, 3) + f(5, 3); }' -O1 -fwhole-program
+assert 50 'int dead() { return missing(); } int sq(int x, int k) { int r = 1; int i; for (i = 0; i < k; i = i + 1) r = r * x; return r; } int f(int n, int k) { if (n <= 0) return 0; return k + f(n - 1, k); } int main() { return sq(2, 3) + sq(3, 3) + f(5, 3); }' -O2 -fwhole-program
+assert 7 'int even(int n) { if (n == 0) return missing(); return odd(n - 1); } int odd(int n) { return even(n - 1); } int g(int x, int k) { return x + k; } int main() { return g(1, 2) + g(2, 2); }' -O1 -fwhole-program
+assert 12 'int f(int n, int k) { if (n <= 0) return 0; k = k + 1; return k + f(n - 1, k - 1); } int h(int x) { return x * 2; } int main() { return f(3, 3) + h(1) - h(2) + 2; }' -O1 -fwhole-program
+
 echo OK
\ No newline at end of file
@@ -2,6 +2,10 @@
 
 static char *currentInput;
 
+void setCurrentInput(char *input) { currentInput = input; }
+
+int sourceOffset(Token *tok) { return tok->idx - currentInput; }
+
 // printf where error occurred
 static void _errorAt(char *idx, char *fmt, va_list va) {
   // 0. print current input
@@ -2,7 +2,7 @@
 #include <assert.h>
 #include <stdlib.h>
 
-Type *TyInt = &(Type){TY_INT};
+Type *TyInt = &(Type){TY_INT, 4, 4};
 
 bool isInteger(Type *ty) {
   assert(ty != NULL);
@@ -13,6 +13,8 @@ Type *pointerTo(Type *base) {
   assert(base != NULL);
   Type *ty = calloc(1, sizeof(Type));
   ty->kind = TY_POINTER;
+  ty->size = 8;
+  ty->align = 8;
   ty->base = base;
   return ty;
 }
@@ -24,24 +26,10 @@ Type *funcType(Type *returnType) {
   return ty;
 }
 
-void addType(Node *node) {
-  if (!node || node->dataType)
-    return;
-
-  addType(node->left);
-  addType(node->right);
-  addType(node->cond);
-  addType(node->then);
-  addType(node->els);
-  addType(node->init);
-  addType(node->inc);
-
-  // Access all nodes and args in the linked-list to increase the type
-  for (Node *n = node->body; n; n = n->next)
-    addType(n);
-  for (Node *n = node->args; n; n = n->next)
-    addType(n);
+static bool untyped(Node *node) { return !node->dataType; }
 
+// the type of the node, once its children have theirs
+static void setType(Node *node) {
   switch (node->nodeType) {
   // set the dataType of the node to the left child's
   case ND_ADD:
@@ -59,6 +47,7 @@ void addType(Node *node) {
   case ND_LE:
   case ND_NUM:
   case ND_FUNCALL:
+  case ND_INLINE:
     node->dataType = TyInt;
     return;
   case ND_VAR:
@@ -79,6 +68,32 @@ void addType(Node *node) {
   }
 }
 
+void addType(Node *node) {
+  if (!node || node->dataType)
+    return;
+
+  // the left operands are typed bottom up in a loop, see node.c
+  Node **chain;
+  int cnt = leftChain(node, untyped, &chain);
+  for (int i = cnt - 1; i >= 0; i--) {
+    Node *nd = chain[i];
+    addType(nd->right);
+    addType(nd->cond);
+    addType(nd->then);
+    addType(nd->els);
+    addType(nd->init);
+    addType(nd->inc);
+
+    // Access all nodes and args in the linked-list to increase the type
+    for (Node *n = nd->body; n; n = n->next)
+      addType(n);
+    for (Node *n = nd->args; n; n = n->next)
+      addType(n);
+    setType(nd);
+  }
+  free(chain);
+}
+
 Type *copyType(Type *Ty) {
   Type *Ret = calloc(1, sizeof(Type));
   *Ret = *Ty;
@@ -0,0 +1,255 @@
+/*
+ *  Loop vectorization (the V extension)
+ *
+ *  With -march=rv64gcv, a loop which stores one element of an int array,
+ *  or adds one up, from the elements of the same iteration and values
+ *  which do not change in the loop:
+ *
+ *    for (i = k; i < n; i = i + 1) *(c + i) = *(a + i) * x + *(b + i);
+ *    for (i = k; i < n; i = i + 1) s = s + *(a + i) * *(b + i);
+ *
+ *  runs on vectors of 32 bit elements. codegen.c emits a strip-mined loop:
+ *  each iteration asks vsetvli for as many of the remaining elements as fit
+ *  in a vector register, and takes one instruction per operator for all of
+ *  them. A sum is added up in element 0 of v1 by vredsum.
+ *
+ *  optimizeLoops() marks such loops before it rewrites any loop, so that
+ *  they keep this shape, and codegen.c finds their parts again here. Only
+ *  functions which take the address of no local are vectorized: memory may
+ *  hold any local otherwise (see the *(&x+1) tests).
+ *
+ *  The scalar loop is still generated after the vector one. It runs
+ *  instead if an array loaded from starts right below the one stored to,
+ *  less than a vector away: an iteration would then read an element an
+ *  earlier one wrote, which the vector loop loads too early.
+ */
+
+#include "rvcc.h"
+
+// use the vector extension, set by -march
+bool IsaV;
+
+// v1 holds the sum, the operands go to v2 to v31
+#define VEC_REGS 30
+
+static VecLoop *Vec;
+static Obj *Counter;
+static Obj *Sum;
+
+static bool isInt(Node *node) {
+  return node->dataType && node->dataType->kind == TY_INT;
+}
+
+static bool isVar(Node *node, Obj *var) {
+  return node->nodeType == ND_VAR && node->var == var;
+}
+
+// whether the value of the expression is the same on every iteration, and
+// can be computed once before the loop
+static bool isInvariant(Node *node) {
+  while (true) {
+    switch (node->nodeType) {
+    case ND_NUM:
+      return true;
+    case ND_VAR:
+      return node->var != Counter && node->var != Sum;
+    case ND_ADDR:
+      return node->left->nodeType == ND_VAR;
+    case ND_NEG:
+      node = node->left;
+      continue;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+      if (!isInvariant(node->right))
+        return false;
+      node = node->left;
+      continue;
+    default:
+      return false;
+    }
+  }
+}
+
+// (i + d)*4 or 4*(i + d), d may be left out
+static bool isIndex(Node *node) {
+  if (node->nodeType != ND_MUL)
+    return false;
+  Node *i = node->left, *size = node->right;
+  if (i->nodeType == ND_NUM) {
+    i = node->right;
+    size = node->left;
+  }
+  if (size->nodeType != ND_NUM || size->val != 4)
+    return false;
+  return isVar(i, Counter) || (i->nodeType == ND_ADD &&
+                               isVar(i->left, Counter) &&
+                               i->right->nodeType == ND_NUM);
+}
+
+// p + (i + d)*4 as built by newAdd, for an int *p which does not change in
+// the loop: the address of the element of the iteration
+static bool isElement(Node *node) {
+  return node->nodeType == ND_ADD && node->dataType &&
+         node->dataType->kind == TY_POINTER &&
+         node->dataType->base->kind == TY_INT && isIndex(node->right) &&
+         isInvariant(node->left);
+}
+
+static bool addPtr(Node *addr) {
+  if (vecPtr(Vec, addr) >= 0)
+    return true;
+  if (Vec->ptrCnt == VEC_PTRS)
+    return false;
+  Vec->ptrs[Vec->ptrCnt++] = addr;
+  return true;
+}
+
+static bool addScalar(Node *node) {
+  if (vecScalar(Vec, node) >= 0)
+    return true;
+  if (Vec->scalarCnt == VEC_SCALARS)
+    return false;
+  Vec->scalars[Vec->scalarCnt++] = node;
+  return true;
+}
+
+// the operators which are computed on vectors
+static bool isVecOp(Node *node) {
+  switch (node->nodeType) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+    return isInt(node) && !isInvariant(node);
+  default:
+    return false;
+  }
+}
+
+// the number of vector registers the value of an element takes, from the
+// first one it goes into, 0 if it can not be computed on vectors. The
+// operands and arrays are collected on the way.
+static int vecRegs(Node *node) {
+  if (!isInt(node))
+    return 0;
+  if (isInvariant(node))
+    return addScalar(node) ? 1 : 0;
+  if (node->nodeType == ND_DEREF)
+    return isElement(node->left) && addPtr(node->left) ? 1 : 0;
+  if (node->nodeType == ND_NEG)
+    return vecRegs(node->left);
+
+  // down the left operands in a loop (see node.c), each right operand goes
+  // into the register after the value of the ones below
+  Node **chain;
+  int cnt = leftChain(node, isVecOp, &chain);
+  int regs = cnt ? vecRegs(chain[cnt - 1]->left) : 0;
+  for (int i = cnt - 1; i >= 0 && regs; i--) {
+    int right = vecRegs(chain[i]->right);
+    if (!right)
+      regs = 0;
+    else if (right + 1 > regs)
+      regs = right + 1;
+  }
+  free(chain);
+  return regs;
+}
+
+// s = s + expr or s = expr + s, returns expr
+static Node *sumOperand(Node *assign) {
+  Node *rhs = assign->right;
+  if (rhs->nodeType != ND_ADD)
+    return NULL;
+  if (isVar(rhs->left, Sum))
+    return rhs->right;
+  if (isVar(rhs->right, Sum))
+    return rhs->left;
+  return NULL;
+}
+
+// the statement of the loop: *(p + i) = expr or s = s + expr
+static bool vecStmt(Node *stmt) {
+  if (stmt && stmt->nodeType == ND_BLOCK && stmt->body && !stmt->body->next)
+    stmt = stmt->body;
+  if (!stmt || stmt->nodeType != ND_EXPR_STMT ||
+      stmt->left->nodeType != ND_ASSIGN)
+    return false;
+
+  Node *assign = stmt->left;
+  Node *lhs = assign->left;
+  if (!isInt(lhs))
+    return false;
+  if (lhs->nodeType == ND_DEREF) {
+    Vec->expr = assign->right;
+    return isElement(lhs->left) && addPtr(lhs->left);
+  }
+  if (lhs->nodeType != ND_VAR || lhs->var == Counter)
+    return false;
+  Sum = lhs->var;
+  Vec->sum = lhs;
+  Vec->expr = sumOperand(assign);
+  return Vec->expr;
+}
+
+VecLoop *vectorLoop(Function *fn, Node *loop) {
+  if (!IsaV || takesAddr(fn->body))
+    return NULL;
+
+  // i < n, i = i + 1 or i = 1 + i
+  Node *cond = loop->cond;
+  Node *inc = loop->inc;
+  if (!cond || cond->nodeType != ND_LT || cond->left->nodeType != ND_VAR ||
+      !isInt(cond->left) || !inc || inc->nodeType != ND_ASSIGN)
+    return NULL;
+  Counter = cond->left->var;
+  Node *step = inc->right;
+  if (!isVar(inc->left, Counter) || step->nodeType != ND_ADD ||
+      !((isVar(step->left, Counter) && step->right->nodeType == ND_NUM &&
+         step->right->val == 1) ||
+        (isVar(step->right, Counter) && step->left->nodeType == ND_NUM &&
+         step->left->val == 1)))
+    return NULL;
+
+  Sum = NULL;
+  Vec = calloc(1, sizeof(VecLoop));
+  Vec->counter = cond->left;
+  Vec->bound = cond->right;
+  int regs = 0;
+  if (vecStmt(loop->then) && isInt(Vec->bound) && isInvariant(Vec->bound))
+    regs = vecRegs(Vec->expr);
+  // a sum of values which do not change is a product
+  if (!regs || regs > VEC_REGS || (Sum && !Vec->ptrCnt)) {
+    free(Vec);
+    return NULL;
+  }
+  return Vec;
+}
+
+int vecPtr(VecLoop *vl, Node *addr) {
+  for (int i = 0; i < vl->ptrCnt; i++)
+    if (sameExpr(vl->ptrs[i], addr))
+      return i;
+  return -1;
+}
+
+int vecScalar(VecLoop *vl, Node *node) {
+  for (int i = 0; i < vl->scalarCnt; i++)
+    if (sameExpr(vl->scalars[i], node))
+      return i;
+  return -1;
+}
+
+static bool inVecChain(Node *node) {
+  return isBinary(node) && vecScalar(Vec, node) < 0;
+}
+
+int vecChain(VecLoop *vl, Node *node, Node ***chain) {
+  Vec = vl;
+  return leftChain(node, inVecChain, chain);
+}